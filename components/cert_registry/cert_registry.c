@@ -0,0 +1,281 @@
+
+#include "cert_registry.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#ifdef CONFIG_CERT_REGISTRY
+
+struct slot
+{
+	const char *pem;  // Key, compared by address
+	uint32_t refs;
+	uint32_t heap_bytes;
+	int64_t last_used_at;
+	mbedtls_x509_crt chain;	 // Parsed, the DER of every certificate kept in chain.raw
+};
+
+static const char *TAG = "cert_registry";
+
+static struct slot slots[ CONFIG_CERT_REGISTRY_SLOTS ];
+static struct cert_registry_stats stats;
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static SemaphoreHandle_t registry_lock( void )
+{
+	static StaticSemaphore_t lock_buf;
+	static SemaphoreHandle_t lock;
+	static portMUX_TYPE lock_mux = portMUX_INITIALIZER_UNLOCKED;
+
+	portENTER_CRITICAL( &lock_mux );
+	if ( !lock )
+		lock = xSemaphoreCreateMutexStatic( &lock_buf );
+	portEXIT_CRITICAL( &lock_mux );
+	return lock;
+}
+
+#define lock()	 xSemaphoreTake( registry_lock(), portMAX_DELAY )
+#define unlock() xSemaphoreGive( registry_lock() )
+
+/* Attach functions stand for a PEM text rather than a slot, twice as many as there are slots */
+#define N_ATTACHERS 16
+
+static const char *bound[ N_ATTACHERS ];  // The text each attach function stands for, NULL until first handed out
+static size_t next_bound;				   // Where the search for an attach function to rebind starts
+
+static struct slot *find( const char *const pem )
+{
+	for ( size_t i = 0; i < CONFIG_CERT_REGISTRY_SLOTS; ++i )
+		if ( slots[ i ].pem == pem )
+			return &slots[ i ];
+	return NULL;
+}
+
+/**
+ * Runs inside esp-tls while it sets up a client, in place of parsing cacert_buf. The chain is only ever read, by
+ * however many handshakes at once, and cannot go away while the client that got this function holds its reference.
+ * A client that kept the function past cert_registry_put() gets its connection refused rather than someone else's CA.
+ */
+static esp_err_t attach( const size_t k, void *conf )
+{
+	lock();
+	struct slot *const s = bound[ k ] ? find( bound[ k ] ) : NULL;
+	const bool ok = s && s->refs;
+	if ( ok )
+		mbedtls_ssl_conf_ca_chain( conf, &s->chain, NULL );
+	unlock();
+
+	portENTER_CRITICAL( &stats_mux );
+	if ( ok )
+		++stats.attached;
+	else
+		++stats.failed;
+	portEXIT_CRITICAL( &stats_mux );
+	if ( !ok )
+	{
+		ESP_LOGE( TAG, "attach %u: its CA is no longer referenced", ( unsigned )k );
+		return ESP_ERR_INVALID_STATE;
+	}
+	return ESP_OK;
+}
+
+/* The hook takes no context, so each text gets a function of its own */
+#define ATTACH( i )                                                                                                    \
+	static esp_err_t attach_##i( void *conf )                                                                          \
+	{                                                                                                                  \
+		return attach( i, conf );                                                                                      \
+	}
+ATTACH( 0 )
+ATTACH( 1 )
+ATTACH( 2 )
+ATTACH( 3 )
+ATTACH( 4 )
+ATTACH( 5 )
+ATTACH( 6 )
+ATTACH( 7 )
+ATTACH( 8 )
+ATTACH( 9 )
+ATTACH( 10 )
+ATTACH( 11 )
+ATTACH( 12 )
+ATTACH( 13 )
+ATTACH( 14 )
+ATTACH( 15 )
+
+static const cert_registry_attach_t attachers[ N_ATTACHERS ] = {
+	attach_0, attach_1, attach_2,  attach_3,  attach_4,  attach_5,  attach_6,  attach_7,
+	attach_8, attach_9, attach_10, attach_11, attach_12, attach_13, attach_14, attach_15,
+};
+_Static_assert( 2 * CONFIG_CERT_REGISTRY_SLOTS <= N_ATTACHERS, "attach functions to spare for every slot" );
+
+/**
+ * The attach function for pem, which is parsed. A text keeps its function for as long as it stays parsed, and across
+ * evictions until the function is needed for another text; those go round the unparsed ones oldest first, so one
+ * left behind by a client keeps failing for as long as possible.
+ */
+static cert_registry_attach_t attacher_for( const char *const pem )
+{
+	for ( size_t k = 0; k < N_ATTACHERS; ++k )
+		if ( bound[ k ] == pem )
+			return attachers[ k ];
+	for ( size_t n = 0; n < N_ATTACHERS; ++n )
+	{
+		const size_t k = ( next_bound + n ) % N_ATTACHERS;
+		if ( !bound[ k ] || !find( bound[ k ] ) )
+		{
+			bound[ k ] = pem;
+			next_bound = ( k + 1 ) % N_ATTACHERS;
+			return attachers[ k ];
+		}
+	}
+	return NULL;  // Not reached, there are more functions than slots
+}
+
+static void release( struct slot *const s )
+{
+	mbedtls_x509_crt_free( &s->chain );
+	portENTER_CRITICAL( &stats_mux );
+	--stats.held;
+	stats.heap_bytes -= s->heap_bytes;
+	portEXIT_CRITICAL( &stats_mux );
+	s->pem = NULL;
+	s->heap_bytes = 0;
+}
+
+/** A free slot, or the least recently used one nobody references */
+static struct slot *slot_for( void )
+{
+	struct slot *lru = NULL;
+
+	for ( size_t i = 0; i < CONFIG_CERT_REGISTRY_SLOTS; ++i )
+	{
+		if ( !slots[ i ].pem )
+			return &slots[ i ];
+		if ( !slots[ i ].refs && ( !lru || slots[ i ].last_used_at < lru->last_used_at ) )
+			lru = &slots[ i ];
+	}
+	if ( lru )
+	{
+		release( lru );
+		portENTER_CRITICAL( &stats_mux );
+		++stats.evicted;
+		portEXIT_CRITICAL( &stats_mux );
+	}
+	return lru;
+}
+
+static esp_err_t parse( struct slot *const s, const char *const pem )
+{
+	const size_t free_before = heap_caps_get_free_size( MALLOC_CAP_DEFAULT );
+	const int64_t start = esp_timer_get_time();
+
+	mbedtls_x509_crt_init( &s->chain );
+	// The length counts the NUL, which is how mbedtls tells PEM from DER
+	const int ret = mbedtls_x509_crt_parse( &s->chain, ( const unsigned char * )pem, strlen( pem ) + 1 );
+	const uint32_t us = esp_timer_get_time() - start;
+	const size_t free_after = heap_caps_get_free_size( MALLOC_CAP_DEFAULT );
+
+	// A positive return counts certificates that failed while others parsed
+	if ( ret < 0 || !s->chain.version )
+	{
+		ESP_LOGE( TAG, "PEM at %p does not parse: -0x%04x", pem, ret < 0 ? -ret : 0 );
+		mbedtls_x509_crt_free( &s->chain );
+		return ESP_ERR_INVALID_ARG;
+	}
+	if ( ret > 0 )
+		ESP_LOGW( TAG, "PEM at %p: %d certificates skipped", pem, ret );
+
+	s->pem = pem;
+	s->heap_bytes = free_before > free_after ? free_before - free_after : 0;
+	portENTER_CRITICAL( &stats_mux );
+	++stats.parsed;
+	++stats.held;
+	stats.heap_bytes += s->heap_bytes;
+	stats.parse_us += us;
+	portEXIT_CRITICAL( &stats_mux );
+	ESP_LOGD( TAG, "parsed %p in %" PRIu32 " us, %" PRIu32 " bytes", pem, us, s->heap_bytes );
+	return ESP_OK;
+}
+
+cert_registry_attach_t cert_registry_get( const char *const pem )
+{
+	cert_registry_attach_t fn = NULL;
+
+	if ( !pem )
+		return NULL;
+
+	lock();
+	struct slot *s = find( pem );
+	if ( !s && ( s = slot_for() ) && parse( s, pem ) != ESP_OK )
+		s = NULL;
+	if ( s && ( fn = attacher_for( pem ) ) )
+	{
+		++s->refs;
+		s->last_used_at = esp_timer_get_time();
+	}
+	unlock();
+
+	if ( !fn )
+	{
+		portENTER_CRITICAL( &stats_mux );
+		++stats.failed;
+		portEXIT_CRITICAL( &stats_mux );
+	}
+	return fn;
+}
+
+void cert_registry_put( const char *const pem )
+{
+	lock();
+	struct slot *const s = pem ? find( pem ) : NULL;
+	if ( s && s->refs )
+		--s->refs;
+	unlock();
+}
+
+void cert_registry_trim( void )
+{
+	lock();
+	for ( size_t i = 0; i < CONFIG_CERT_REGISTRY_SLOTS; ++i )
+		if ( slots[ i ].pem && !slots[ i ].refs )
+			release( &slots[ i ] );
+	unlock();
+}
+
+void cert_registry_get_stats( struct cert_registry_stats *const out )
+{
+	portENTER_CRITICAL( &stats_mux );
+	*out = stats;
+	portEXIT_CRITICAL( &stats_mux );
+}
+
+void cert_registry_log_stats( void )
+{
+	struct cert_registry_stats s;
+
+	cert_registry_get_stats( &s );
+	// What attaching saves each connection is what parsing from PEM costs, measured the one time it was done
+	ESP_LOGI(
+		TAG,
+		"%" PRIu32 " connections attached %" PRIu32 " parsed CAs; parsing costs %" PRIu32 " us and %" PRIu32
+		" bytes of heap per CA, %" PRIu32 " held now in %" PRIu32 " bytes, %" PRIu32 " evicted, %" PRIu32 " failed",
+		s.attached,
+		s.parsed,
+		s.parsed ? ( uint32_t )( s.parse_us / s.parsed ) : 0,
+		s.held ? s.heap_bytes / s.held : 0,
+		s.held,
+		s.heap_bytes,
+		s.evicted,
+		s.failed );
+}
+
+#endif
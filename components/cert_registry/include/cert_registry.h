@@ -0,0 +1,36 @@
+
+#pragma once
+
+#include "esp_err.h"
+
+#include <stdint.h>
+
+/** Same signature as esp_crt_bundle_attach(), goes where a client config takes crt_bundle_attach */
+typedef esp_err_t ( *cert_registry_attach_t )( void *conf );
+
+struct cert_registry_stats
+{
+	uint32_t parsed;	// PEM texts parsed, once each unless evicted
+	uint32_t attached;	// Connections given a parsed chain instead of parsing their own
+	uint32_t evicted;
+	uint32_t failed;	// Unparseable PEM or no free slot
+	uint32_t held;		// Chains parsed right now
+	uint32_t heap_bytes;  // Heap those chains take
+	uint64_t parse_us;	  // Time spent parsing, what each attach saves on average parse_us / parsed
+};
+
+/**
+ * Takes a reference to the CA chain in pem, a NUL terminated PEM text such as one embedded with EMBED_TXTFILES,
+ * parsing it on first use. Texts are told apart by address. Returns the function to set as crt_bundle_attach, NULL if
+ * the text does not parse or every slot is referenced. The function refuses the connection once the reference is put.
+ */
+cert_registry_attach_t cert_registry_get( const char *const pem );
+
+/** Drops a reference taken by cert_registry_get(), once no client built with it is left. The chain stays parsed. */
+void cert_registry_put( const char *const pem );
+
+/** Frees every chain nobody references */
+void cert_registry_trim( void );
+
+void cert_registry_get_stats( struct cert_registry_stats *const out );
+void cert_registry_log_stats( void );
@@ -0,0 +1,514 @@
+
+#include "dns_cache.h"
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/dns.h"
+#include "lwip/memp.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef CONFIG_DNS_CACHE
+
+#define NAME_MAX_LEN   64
+#define MSG_MAX		   512	// Largest reply over UDP, longer ones come truncated
+#define TTL_MIN_US	   ( CONFIG_DNS_CACHE_MIN_TTL_S * 1000000LL )
+#define TTL_MAX_US	   ( CONFIG_DNS_CACHE_MAX_TTL_S * 1000000LL )
+#define STALE_US	   ( CONFIG_DNS_CACHE_STALE_S * 1000000LL )
+#define PREFETCH	   ( CONFIG_DNS_CACHE_PREFETCH_PERCENT < 100 )
+#define PREFETCH_STACK 3072
+
+int __real_lwip_getaddrinfo(
+	const char *nodename,
+	const char *servname,
+	const struct addrinfo *hints,
+	struct addrinfo **res );
+int __wrap_lwip_getaddrinfo(
+	const char *nodename,
+	const char *servname,
+	const struct addrinfo *hints,
+	struct addrinfo **res );
+
+struct entry
+{
+	char name[ NAME_MAX_LEN ];
+	bool resolved;	// addr holds an answer, possibly expired
+	bool pending;	// A query is in flight, the entry is not evicted meanwhile
+	uint32_t addr;	// Network order
+	uint32_t uses;	// Lookups since the last answer, what makes it worth prefetching
+	int64_t resolved_at;
+	int64_t ttl_us;
+	int64_t last_used_at;
+};
+
+static const char *TAG = "dns_cache";
+
+static struct entry cache[ CONFIG_DNS_CACHE_ENTRIES ];
+static struct dns_cache_stats stats;
+static EventGroupHandle_t idle;	 // Bit i set while entry i has no query in flight
+static TaskHandle_t prefetcher;
+
+static SemaphoreHandle_t cache_lock( void )
+{
+	static StaticSemaphore_t lock_buf;
+	static StaticEventGroup_t idle_buf;
+	static SemaphoreHandle_t lock;
+	static portMUX_TYPE lock_mux = portMUX_INITIALIZER_UNLOCKED;
+
+	portENTER_CRITICAL( &lock_mux );
+	if ( !lock )
+	{
+		lock = xSemaphoreCreateMutexStatic( &lock_buf );
+		idle = xEventGroupCreateStatic( &idle_buf );
+	}
+	portEXIT_CRITICAL( &lock_mux );
+	return lock;
+}
+
+#define lock()	 xSemaphoreTake( cache_lock(), portMAX_DELAY )
+#define unlock() xSemaphoreGive( cache_lock() )
+
+#define BIT_OF( e ) ( ( EventBits_t )1 << ( ( e ) - cache ) )
+
+/** An A query for name, returns its length or 0 when the name cannot be encoded */
+static size_t encode( uint8_t *const msg, const uint16_t id, const char *name )
+{
+	size_t off = 12;
+
+	memset( msg, 0, off );
+	msg[ 0 ] = id >> 8;
+	msg[ 1 ] = id;
+	msg[ 2 ] = 0x01;  // Recursion desired
+	msg[ 5 ] = 1;	  // One question
+	while ( *name )
+	{
+		const char *const dot = strchr( name, '.' );
+		const size_t len = dot ? ( size_t )( dot - name ) : strlen( name );
+		if ( !len || len > 63 || off + 1 + len + 5 > MSG_MAX )
+			return 0;
+		msg[ off++ ] = len;
+		memcpy( msg + off, name, len );
+		off += len;
+		name += len + ( dot ? 1 : 0 );
+	}
+	msg[ off++ ] = 0;
+	msg[ off++ ] = 0;
+	msg[ off++ ] = 1;  // QTYPE A
+	msg[ off++ ] = 0;
+	msg[ off++ ] = 1;  // QCLASS IN
+	return off;
+}
+
+/** Offset past the name at off, 0 when it runs off the message */
+static size_t skip_name( const uint8_t *const msg, const size_t n, size_t off )
+{
+	while ( off < n )
+	{
+		if ( ( msg[ off ] & 0xc0 ) == 0xc0 )
+			return off + 2 <= n ? off + 2 : 0;
+		if ( !msg[ off ] )
+			return off + 1;
+		off += 1 + msg[ off ];
+	}
+	return 0;
+}
+
+/**
+ * 1 with the first A record's address and the lowest TTL along the answer (a CNAME expiring first expires the address
+ * with it), 0 for an answer to our query without an address, -1 for anything else.
+ */
+static int parse(
+	const uint8_t *const msg,
+	const size_t n,
+	const uint16_t id,
+	uint32_t *const addr,
+	uint32_t *const ttl )
+{
+	if ( n < 12 || ( msg[ 0 ] << 8 | msg[ 1 ] ) != id || !( msg[ 2 ] & 0x80 ) )
+		return -1;
+	if ( msg[ 3 ] & 0x0f )
+		return 0;
+
+	const unsigned qd = msg[ 4 ] << 8 | msg[ 5 ], an = msg[ 6 ] << 8 | msg[ 7 ];
+	size_t off = 12;
+	bool found = false;
+
+	*ttl = UINT32_MAX;
+	for ( unsigned i = 0; i < qd; ++i )
+		if ( !( off = skip_name( msg, n, off ) ) || ( off += 4 ) > n )
+			return -1;
+	for ( unsigned i = 0; i < an; ++i )
+	{
+		if ( !( off = skip_name( msg, n, off ) ) || off + 10 > n )
+			return -1;
+		const uint8_t *const rr = msg + off;
+		const uint16_t type = rr[ 0 ] << 8 | rr[ 1 ], class = rr[ 2 ] << 8 | rr[ 3 ], rdlen = rr[ 8 ] << 8 | rr[ 9 ];
+		const uint32_t rr_ttl = ( uint32_t )rr[ 4 ] << 24 | rr[ 5 ] << 16 | rr[ 6 ] << 8 | rr[ 7 ];
+		if ( ( off += 10 + rdlen ) > n )
+			return -1;
+		if ( class != 1 || ( type != 1 && type != 5 ) || ( type == 1 && rdlen != 4 ) )
+			continue;
+		if ( rr_ttl < *ttl )
+			*ttl = rr_ttl;
+		if ( type == 1 && !found )
+		{
+			memcpy( addr, rr + 10, 4 );
+			found = true;
+		}
+	}
+	return found;
+}
+
+/** Asks each DNS server the interface has in turn, until one answers; any failure moves on to the next one */
+static bool resolve( const char *const name, uint32_t *const addr, uint32_t *const ttl )
+{
+	uint8_t msg[ MSG_MAX ];
+	const struct timeval tv = {
+		.tv_sec = CONFIG_DNS_CACHE_TIMEOUT_MS / 1000,
+		.tv_usec = CONFIG_DNS_CACHE_TIMEOUT_MS % 1000 * 1000,
+	};
+	int answer = -1;
+
+	for ( uint8_t i = 0; i < DNS_MAX_SERVERS && answer < 0; ++i )
+	{
+		const ip_addr_t *const server = dns_getserver( i );
+		if ( !server || !IP_IS_V4( server ) || ip_addr_isany( server ) )
+			continue;
+
+		const struct sockaddr_in to = {
+			.sin_family = AF_INET,
+			.sin_port = htons( 53 ),
+			.sin_addr.s_addr = ip_2_ip4( server )->addr,
+		};
+		const uint16_t id = esp_random();
+		const size_t len = encode( msg, id, name );
+		if ( !len )
+			return false;
+		const int s = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+		if ( s < 0 )
+			continue;
+		// Connected, so only the server's replies get through; a reply to an older query just takes another recv
+		if ( !setsockopt( s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) )
+			 && !connect( s, ( const struct sockaddr * )&to, sizeof( to ) )
+			 && send( s, msg, len, 0 ) == ( ssize_t )len )
+		{
+			ssize_t n;
+			for ( int tries = 0; answer < 0 && tries < 4 && ( n = recv( s, msg, sizeof( msg ), 0 ) ) > 0; ++tries )
+				answer = parse( msg, n, id, addr, ttl );
+		}
+		close( s );
+	}
+	if ( answer == 0 )
+		ESP_LOGW( TAG, "%s: no address", name );
+	return answer > 0;
+}
+
+static struct entry *find( const char *const name )
+{
+	for ( size_t i = 0; i < CONFIG_DNS_CACHE_ENTRIES; ++i )
+		if ( cache[ i ].name[ 0 ] && !strcmp( cache[ i ].name, name ) )
+			return &cache[ i ];
+	return NULL;
+}
+
+/** An empty entry, or the least recently used one without a query in flight */
+static struct entry *slot_for( void )
+{
+	struct entry *lru = NULL;
+
+	for ( size_t i = 0; i < CONFIG_DNS_CACHE_ENTRIES; ++i )
+	{
+		if ( !cache[ i ].name[ 0 ] )
+			return &cache[ i ];
+		if ( !cache[ i ].pending && ( !lru || cache[ i ].last_used_at < lru->last_used_at ) )
+			lru = &cache[ i ];
+	}
+	if ( lru )
+	{
+		memset( lru, 0, sizeof( *lru ) );
+		++stats.evicted;
+	}
+	return lru;
+}
+
+static bool fresh( const struct entry *const e, const int64_t now )
+{
+	return e->resolved && now - e->resolved_at < e->ttl_us;
+}
+
+/** Takes the answer to the query made for e, called locked */
+static void answered( struct entry *const e, const bool ok, const uint32_t addr, const uint32_t ttl )
+{
+	if ( ok )
+	{
+		e->resolved = true;
+		e->addr = addr;
+		e->resolved_at = esp_timer_get_time();
+		e->ttl_us = ttl * 1000000LL;
+		if ( e->ttl_us < TTL_MIN_US )
+			e->ttl_us = TTL_MIN_US;
+		if ( e->ttl_us > TTL_MAX_US )
+			e->ttl_us = TTL_MAX_US;
+		e->uses = 0;
+	}
+	e->pending = false;
+	xEventGroupSetBits( idle, BIT_OF( e ) );
+}
+
+#if PREFETCH
+/** Resolves names in use again before they expire, so their lookups keep hitting */
+static void prefetch_task( void *arg )
+{
+	char name[ NAME_MAX_LEN ];
+
+	for ( ;; )
+	{
+		struct entry *due = NULL;
+		TickType_t wait = portMAX_DELAY;
+
+		lock();
+		const int64_t now = esp_timer_get_time();
+		for ( size_t i = 0; i < CONFIG_DNS_CACHE_ENTRIES && !due; ++i )
+		{
+			struct entry *const e = &cache[ i ];
+			// Expired ones are left to the next lookup
+			if ( !e->uses || e->pending || !fresh( e, now ) )
+				continue;
+			const int64_t left = e->resolved_at + e->ttl_us * CONFIG_DNS_CACHE_PREFETCH_PERCENT / 100 - now;
+			if ( left <= 0 )
+				due = e;
+			else if ( pdMS_TO_TICKS( left / 1000 ) + 1 < wait )
+				wait = pdMS_TO_TICKS( left / 1000 ) + 1;
+		}
+		if ( due )
+		{
+			due->pending = true;
+			xEventGroupClearBits( idle, BIT_OF( due ) );
+			strcpy( name, due->name );
+		}
+		unlock();
+
+		if ( !due )
+		{
+			ulTaskNotifyTake( pdTRUE, wait );
+			continue;
+		}
+
+		uint32_t addr, ttl;
+		const bool ok = resolve( name, &addr, &ttl );
+		lock();
+		++stats.prefetches;
+		// Not retried on failure, the entry runs out and its next lookup queries
+		due->uses = 0;
+		answered( due, ok, addr, ttl );
+		unlock();
+	}
+}
+#endif
+
+/** The address for name, from the cache or a query, false when there is none to give */
+static bool lookup( const char *const name, uint32_t *const addr )
+{
+	struct entry *e;
+	bool waited = false, wake = false, ok;
+
+	lock();
+	++stats.lookups;
+	// Someone else is asking already, their answer will do; a prefetch leaves the old one good meanwhile
+	while ( ( e = find( name ) ) && e->pending && !fresh( e, esp_timer_get_time() ) )
+	{
+		const EventBits_t bit = BIT_OF( e );
+		unlock();
+		waited = true;
+		xEventGroupWaitBits( idle, bit, pdFALSE, pdTRUE, portMAX_DELAY );
+		lock();
+	}
+
+	int64_t now = esp_timer_get_time();
+	if ( e && fresh( e, now ) )
+	{
+		*addr = e->addr;
+		e->last_used_at = now;
+		wake = !e->uses++;
+		if ( waited )
+			++stats.coalesced;
+		else
+			++stats.hits;
+		unlock();
+#if PREFETCH
+		if ( wake && prefetcher )
+			xTaskNotifyGive( prefetcher );
+#endif
+		return true;
+	}
+	if ( waited || ( !e && !( e = slot_for() ) ) )
+	{
+		// The query just waited for failed, or every entry has one in flight
+		ok = e && e->resolved && now - e->resolved_at < e->ttl_us + STALE_US;
+		if ( ok )
+		{
+			*addr = e->addr;
+			++stats.stale;
+		}
+		else
+			++stats.failed;
+		unlock();
+		return ok;
+	}
+
+	if ( !e->name[ 0 ] )
+		strcpy( e->name, name );
+	e->pending = true;
+	e->last_used_at = now;
+	xEventGroupClearBits( idle, BIT_OF( e ) );
+#if PREFETCH
+	if ( !prefetcher
+		 && pdPASS
+				!= xTaskCreate(
+					prefetch_task, "dns_prefetch", PREFETCH_STACK, NULL, CONFIG_DNS_CACHE_TASK_PRIORITY, &prefetcher ) )
+		prefetcher = NULL;
+#endif
+	unlock();
+
+	uint32_t got, ttl;
+	ok = resolve( name, &got, &ttl );
+	const int64_t elapsed = esp_timer_get_time() - now;
+
+	lock();
+	now = esp_timer_get_time();
+	++stats.queries;
+	stats.query_us += elapsed;
+	answered( e, ok, got, ttl );
+	if ( ok )
+		*addr = got;
+	else if ( e->resolved && now - e->resolved_at < e->ttl_us + STALE_US )
+	{
+		*addr = e->addr;
+		ok = true;
+		++stats.stale;
+	}
+	else
+	{
+		memset( e, 0, sizeof( *e ) );
+		++stats.failed;
+	}
+	unlock();
+	return ok;
+}
+
+/** The same result lwip_getaddrinfo() would build, in the same pool so that lwip_freeaddrinfo() takes it back */
+static int result(
+	const char *const name,
+	const uint32_t addr,
+	const int port,
+	const struct addrinfo *const hints,
+	struct addrinfo **const res )
+{
+	const size_t name_len = strlen( name );
+	struct addrinfo *const ai = memp_malloc( MEMP_NETDB );
+
+	if ( !ai )
+		return EAI_MEMORY;
+	memset( ai, 0, sizeof( struct addrinfo ) + sizeof( struct sockaddr_storage ) + name_len + 1 );
+
+	struct sockaddr_in *const sa = ( struct sockaddr_in * )( void * )( ( uint8_t * )ai + sizeof( struct addrinfo ) );
+	sa->sin_len = sizeof( struct sockaddr_in );
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons( port );
+	sa->sin_addr.s_addr = addr;
+
+	ai->ai_family = AF_INET;
+	if ( hints )
+	{
+		ai->ai_socktype = hints->ai_socktype;
+		ai->ai_protocol = hints->ai_protocol;
+	}
+	ai->ai_canonname = ( char * )sa + sizeof( struct sockaddr_storage );
+	memcpy( ai->ai_canonname, name, name_len + 1 );
+	ai->ai_addrlen = sizeof( struct sockaddr_storage );
+	ai->ai_addr = ( struct sockaddr * )sa;
+	*res = ai;
+	return 0;
+}
+
+int __wrap_lwip_getaddrinfo(
+	const char *nodename,
+	const char *servname,
+	const struct addrinfo *hints,
+	struct addrinfo **res )
+{
+	struct in_addr numeric;
+	uint32_t addr;
+	size_t len;
+	int port = 0;
+
+	// Only what is worth caching, the rest exactly as lwIP does it; mDNS names are lwIP's to resolve as well
+	if ( !nodename || !res || ( len = strlen( nodename ) ) >= NAME_MAX_LEN || inet_aton( nodename, &numeric )
+		 || ( len > 6 && !strcasecmp( nodename + len - 6, ".local" ) )
+		 || ( hints && ( hints->ai_family == AF_INET6 || ( hints->ai_flags & AI_NUMERICHOST ) ) ) )
+		return __real_lwip_getaddrinfo( nodename, servname, hints, res );
+	// Numeric services only, like lwIP, which answers anything else with the error it always does
+	if ( ( servname && ( port = atoi( servname ) ) == 0 && servname[ 0 ] != '0' ) || port < 0 || port > 0xffff )
+		return __real_lwip_getaddrinfo( nodename, servname, hints, res );
+
+	// Whatever we cannot answer is left to lwIP's resolver, which may still know better
+	if ( !lookup( nodename, &addr ) || result( nodename, addr, port, hints, res ) )
+		return __real_lwip_getaddrinfo( nodename, servname, hints, res );
+	return 0;
+}
+
+void dns_cache_get_stats( struct dns_cache_stats *const out )
+{
+	lock();
+	*out = stats;
+	unlock();
+}
+
+void dns_cache_log_stats( void )
+{
+	struct dns_cache_stats s;
+
+	dns_cache_get_stats( &s );
+	const uint32_t avg_ms = s.queries ? ( uint32_t )( s.query_us / s.queries / 1000 ) : 0;
+	// What a hit saves is a query, at what queries have taken on average
+	ESP_LOGI(
+		TAG,
+		"lookups %" PRIu32 ", hits %" PRIu32 " (%" PRIu32 "%%) saving ~%" PRIu32 " ms, shared queries %" PRIu32
+		", stale %" PRIu32 ", failed %" PRIu32,
+		s.lookups,
+		s.hits,
+		s.lookups ? s.hits * 100 / s.lookups : 0,
+		( s.hits + s.coalesced ) * avg_ms,
+		s.coalesced,
+		s.stale,
+		s.failed );
+	ESP_LOGI(
+		TAG,
+		"queries %" PRIu32 " avg %" PRIu32 " ms, prefetches %" PRIu32 ", evicted %" PRIu32,
+		s.queries,
+		avg_ms,
+		s.prefetches,
+		s.evicted );
+}
+
+void dns_cache_flush( void )
+{
+	lock();
+	for ( size_t i = 0; i < CONFIG_DNS_CACHE_ENTRIES; ++i )
+		if ( !cache[ i ].pending )
+			memset( &cache[ i ], 0, sizeof( cache[ i ] ) );
+	unlock();
+}
+
+#endif
@@ -0,0 +1,21 @@
+
+#pragma once
+
+#include <stdint.h>
+
+struct dns_cache_stats
+{
+	uint32_t lookups;
+	uint32_t hits;		 // Answered from the cache without a query
+	uint32_t coalesced;	 // Waited for a query another caller had in flight
+	uint32_t stale;		 // Query failed, expired address handed out
+	uint32_t failed;	 // Query failed with nothing to fall back on, left to lwIP's resolver
+	uint32_t prefetches;
+	uint32_t evicted;
+	uint32_t queries;	 // Sent on behalf of a caller, prefetches not counted
+	uint64_t query_us;
+};
+
+void dns_cache_get_stats( struct dns_cache_stats *const out );
+void dns_cache_log_stats( void );
+void dns_cache_flush( void );
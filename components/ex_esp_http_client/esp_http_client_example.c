@@ -7,28 +7,33 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
-#include "esp_log.h"
-
-#include <ctype.h>
-#include <stdlib.h>
-#include <string.h>
+#include "esp_http_client_example.h"
 
-#include <sys/param.h>
-// #include "nvs_flash.h"
-// #include "esp_event.h"
-// #include "esp_netif.h"
+#include "cert_registry.h"
+#include "dns_cache.h"
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_system.h"
 #include "esp_tls.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "http_bench.h"
+#include "http_pool.h"
+#include "http_sink.h"
+#include "ota_stream.h"
 #include "protocol_examples_common.h"
 #include "protocol_examples_utils.h"
+#include "tls_buffer_pool.h"
+#include "tls_session_cache.h"
 #if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
 #include "esp_crt_bundle.h"
 #endif
 
-#include "esp_http_client.h"
-#include "esp_http_client_example.h"
-#include "esp_system.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
 
 #define MAX_HTTP_RECV_BUFFER   512
 #define MAX_HTTP_OUTPUT_BUFFER 2048
@@ -50,10 +55,23 @@ extern const char howsmyssl_com_root_cert_pem_end[] asm( "_binary_howsmyssl_com_
 extern const char postman_root_cert_pem_start[] asm( "_binary_postman_root_cert_pem_start" );
 extern const char postman_root_cert_pem_end[] asm( "_binary_postman_root_cert_pem_end" );
 
+/* Root CAs parsed once and shared by every client trusting them, rather than parsed from PEM on each connection */
+#if CONFIG_CERT_REGISTRY
+#define TRUST( pem )   .crt_bundle_attach = cert_registry_get( pem )
+#define UNTRUST( pem ) cert_registry_put( pem )
+#else
+#define TRUST( pem )   .cert_pem = pem
+#define UNTRUST( pem )
+#endif
+
+/**
+ * Bodies go to the struct http_sink passed as user_data, or to an arena sink bound to the client for the length of the
+ * request. Either way nothing is shared between clients and chunked bodies are kept like any other.
+ */
 esp_err_t _http_event_handler( esp_http_client_event_t *evt )
 {
-	static char *output_buffer;	 // Buffer to store response of http request from event handler
-	static int output_len;		 // Stores number of bytes read
+	struct http_sink *sink = evt->user_data;
+
 	switch ( evt->event_id )
 	{
 		case HTTP_EVENT_ERROR:
@@ -64,66 +82,32 @@ esp_err_t _http_event_handler( esp_http_client_event_t *evt )
 			break;
 		case HTTP_EVENT_HEADER_SENT:
 			ESP_LOGD( TAG, "HTTP_EVENT_HEADER_SENT" );
+			if ( sink || ( sink = http_sink_find( evt->client ) ) )
+				http_sink_on_event( sink, evt );
 			break;
 		case HTTP_EVENT_ON_HEADER:
 			ESP_LOGD( TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value );
 			break;
 		case HTTP_EVENT_ON_DATA:
 			ESP_LOGD( TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len );
-			// Clean the buffer in case of a new request
-			if ( output_len == 0 && evt->user_data )
-			{
-				// we are just starting to copy the output data into the use
-				memset( evt->user_data, 0, MAX_HTTP_OUTPUT_BUFFER );
-			}
-			/*
-			 *  Check for chunked encoding is added as the URL for chunked encoding used in this example returns binary
-			 * data. However, event handler can also be used in case chunked encoding is used.
-			 */
-			if ( !esp_http_client_is_chunked_response( evt->client ) )
+			if ( !sink && !( sink = http_sink_bind( evt->client ) ) )
 			{
-				// If user_data buffer is configured, copy the response into the buffer
-				int copy_len = 0;
-				if ( evt->user_data )
-				{
-					// The last byte in evt->user_data is kept for the NULL character in case of out-of-bound access.
-					copy_len = MIN( evt->data_len, ( MAX_HTTP_OUTPUT_BUFFER - output_len ) );
-					if ( copy_len )
-						memcpy( evt->user_data + output_len, evt->data, copy_len );
-				}
-				else
-				{
-					int content_len = esp_http_client_get_content_length( evt->client );
-					if ( output_buffer == NULL )
-					{
-						// We initialize output_buffer with 0 because it is used by strlen() and similar functions
-						// therefore should be null terminated.
-						output_buffer = ( char * )calloc( content_len + 1, sizeof( char ) );
-						output_len = 0;
-						if ( output_buffer == NULL )
-						{
-							ESP_LOGE( TAG, "Failed to allocate memory for output buffer" );
-							return ESP_FAIL;
-						}
-					}
-					copy_len = MIN( evt->data_len, ( content_len - output_len ) );
-					if ( copy_len )
-						memcpy( output_buffer + output_len, evt->data, copy_len );
-				}
-				output_len += copy_len;
+				ESP_LOGE( TAG, "No response sink free" );
+				return ESP_FAIL;
 			}
-
+			http_sink_on_event( sink, evt );
 			break;
 		case HTTP_EVENT_ON_FINISH:
 			ESP_LOGD( TAG, "HTTP_EVENT_ON_FINISH" );
-			if ( output_buffer != NULL )
+			if ( sink )
+				http_sink_on_event( sink, evt );
+			else if ( ( sink = http_sink_find( evt->client ) ) )
 			{
-				// Response is accumulated in output_buffer. Uncomment the below line to print the accumulated response
-				// ESP_LOG_BUFFER_HEX(TAG, output_buffer, output_len);
-				free( output_buffer );
-				output_buffer = NULL;
+				// Response is accumulated in the sink. Uncomment the below line to print the accumulated response
+				// ESP_LOG_BUFFER_HEX(TAG, http_sink_body( sink, NULL ), sink->len);
+				ESP_LOGD( TAG, "Body %u bytes%s", ( unsigned )sink->len, sink->truncated ? ", truncated" : "" );
+				http_sink_unbind( evt->client );
 			}
-			output_len = 0;
 			break;
 		case HTTP_EVENT_DISCONNECTED:
 			ESP_LOGI( TAG, "HTTP_EVENT_DISCONNECTED" );
@@ -134,12 +118,8 @@ esp_err_t _http_event_handler( esp_http_client_event_t *evt )
 				ESP_LOGI( TAG, "Last esp error code: 0x%x", err );
 				ESP_LOGI( TAG, "Last mbedtls failure: 0x%x", mbedtls_err );
 			}
-			if ( output_buffer != NULL )
-			{
-				free( output_buffer );
-				output_buffer = NULL;
-			}
-			output_len = 0;
+			if ( !sink )
+				http_sink_unbind( evt->client );
 			break;
 		case HTTP_EVENT_REDIRECT:
 			ESP_LOGD( TAG, "HTTP_EVENT_REDIRECT" );
@@ -151,11 +131,12 @@ esp_err_t _http_event_handler( esp_http_client_event_t *evt )
 	return ESP_OK;
 }
 
+#ifndef CONFIG_EXAMPLE_HTTP_BENCHMARK
 static void http_rest_with_url( void )
 {
-	// Declare local_response_buffer with size (MAX_HTTP_OUTPUT_BUFFER + 1) to prevent out of bound access when
-	// it is used by functions like strlen(). The buffer should only be used upto size MAX_HTTP_OUTPUT_BUFFER
-	char local_response_buffer[ MAX_HTTP_OUTPUT_BUFFER + 1 ] = { 0 };
+	// The response lands in an arena slot owned by this sink until it is released, NUL terminated
+	struct http_sink response;
+	http_sink_init_arena( &response );
 	/**
 	 * NOTE: All the configuration parameters for http_client must be spefied either in URL or as host and path
 	 * parameters. If host and path parameters are not set, query parameter will be ignored. In such cases, query
@@ -168,7 +149,7 @@ static void http_rest_with_url( void )
 		.path = "/get",
 		.query = "esp",
 		.event_handler = _http_event_handler,
-		.user_data = local_response_buffer,	 // Pass address of local buffer to get response
+		.user_data = &response,	 // Pass address of the sink to get response
 		.disable_auto_redirect = true,
 	};
 	esp_http_client_handle_t client = esp_http_client_init( &config );
@@ -187,7 +168,10 @@ static void http_rest_with_url( void )
 	{
 		ESP_LOGE( TAG, "HTTP GET request failed: %s", esp_err_to_name( err ) );
 	}
-	ESP_LOG_BUFFER_HEX( TAG, local_response_buffer, strlen( local_response_buffer ) );
+	size_t response_len;
+	const char *const body = http_sink_body( &response, &response_len );
+	if ( body )
+		ESP_LOG_BUFFER_HEX( TAG, body, response_len );
 
 	// POST
 	const char *post_data = "{\"field1\":\"value1\"}";
@@ -279,6 +263,7 @@ static void http_rest_with_url( void )
 	}
 
 	esp_http_client_cleanup( client );
+	http_sink_release( &response );
 }
 
 static void http_rest_with_hostname_path( void )
@@ -397,6 +382,47 @@ static void http_rest_with_hostname_path( void )
 	esp_http_client_cleanup( client );
 }
 
+/** A run of small REST calls borrowing clients from the pool, the URL and host/path forms share one connection */
+static void http_rest_pooled( void )
+{
+	static const char *const paths[] = { "/get", "/status/200", "/headers", "/uuid" };
+	const esp_http_client_config_t url_config = {
+		.url = "http://" CONFIG_EXAMPLE_HTTP_ENDPOINT "/get",
+		.event_handler = _http_event_handler,
+	};
+
+	ESP_ERROR_CHECK( http_pool_init() );
+	for ( int i = 0; i < 8; ++i )
+	{
+		const esp_http_client_config_t path_config = {
+			.host = CONFIG_EXAMPLE_HTTP_ENDPOINT,
+			.path = paths[ i % ( sizeof( paths ) / sizeof( paths[ 0 ] ) ) ],
+			.event_handler = _http_event_handler,
+		};
+		esp_http_client_handle_t client = http_pool_acquire( i % 2 ? &path_config : &url_config );
+		if ( !client )
+		{
+			ESP_LOGE( TAG, "No pooled client" );
+			continue;
+		}
+		esp_err_t err = http_pool_perform( client );
+		if ( err == ESP_OK )
+		{
+			ESP_LOGI(
+				TAG,
+				"HTTP pooled GET Status = %d, content_length = %" PRId64,
+				esp_http_client_get_status_code( client ),
+				esp_http_client_get_content_length( client ) );
+		}
+		else
+		{
+			ESP_LOGE( TAG, "HTTP pooled GET request failed: %s", esp_err_to_name( err ) );
+		}
+		http_pool_release( client, err == ESP_OK );
+	}
+	http_pool_log_stats();
+}
+
 #if CONFIG_ESP_HTTP_CLIENT_ENABLE_BASIC_AUTH
 static void http_auth_basic( void )
 {
@@ -516,7 +542,7 @@ static void https_with_hostname_path( void )
 		.path = "/",
 		.transport_type = HTTP_TRANSPORT_OVER_SSL,
 		.event_handler = _http_event_handler,
-		.cert_pem = howsmyssl_com_root_cert_pem_start,
+		TRUST( howsmyssl_com_root_cert_pem_start ),
 	};
 	esp_http_client_handle_t client = esp_http_client_init( &config );
 	esp_err_t err = esp_http_client_perform( client );
@@ -534,6 +560,7 @@ static void https_with_hostname_path( void )
 		ESP_LOGE( TAG, "Error perform http request %s", esp_err_to_name( err ) );
 	}
 	esp_http_client_cleanup( client );
+	UNTRUST( howsmyssl_com_root_cert_pem_start );
 }
 
 static void http_encoded_query( void )
@@ -648,7 +675,7 @@ static void http_redirect_to_https( void )
 	esp_http_client_config_t config = {
 		.url = "http://" CONFIG_EXAMPLE_HTTP_ENDPOINT "/redirect-to?url=https://www.howsmyssl.com",
 		.event_handler = _http_event_handler,
-		.cert_pem = howsmyssl_com_root_cert_pem_start,
+		TRUST( howsmyssl_com_root_cert_pem_start ),
 	};
 	esp_http_client_handle_t client = esp_http_client_init( &config );
 	esp_err_t err = esp_http_client_perform( client );
@@ -666,6 +693,7 @@ static void http_redirect_to_https( void )
 		ESP_LOGE( TAG, "Error perform http request %s", esp_err_to_name( err ) );
 	}
 	esp_http_client_cleanup( client );
+	UNTRUST( howsmyssl_com_root_cert_pem_start );
 }
 
 static void http_download_chunk( void )
@@ -692,6 +720,50 @@ static void http_download_chunk( void )
 	esp_http_client_cleanup( client );
 }
 
+static void log_json_value(
+	void *ctx,
+	const char *path,
+	const enum http_sink_json_type type,
+	const char *value,
+	const size_t len,
+	const bool truncated )
+{
+	++*( int * )ctx;
+	ESP_LOGI( TAG, "%s = %s%s", path, value, truncated ? "..." : "" );
+}
+
+/** Parses the response as it arrives, however long it is only the current key and value are ever held */
+static void http_json_stream( void )
+{
+	int values = 0;
+	struct http_sink sink;
+	http_sink_init_json( &sink, log_json_value, &values );
+
+	esp_http_client_config_t config = {
+		.url = "http://" CONFIG_EXAMPLE_HTTP_ENDPOINT "/json",
+		.event_handler = http_sink_event_handler,
+		.user_data = &sink,
+	};
+	esp_http_client_handle_t client = esp_http_client_init( &config );
+	esp_err_t err = esp_http_client_perform( client );
+
+	if ( err == ESP_OK )
+	{
+		ESP_LOGI(
+			TAG,
+			"HTTP JSON stream Status = %d, %u bytes, %d values, %s",
+			esp_http_client_get_status_code( client ),
+			( unsigned )sink.received,
+			values,
+			esp_err_to_name( sink.err ) );
+	}
+	else
+	{
+		ESP_LOGE( TAG, "Error perform http request %s", esp_err_to_name( err ) );
+	}
+	esp_http_client_cleanup( client );
+}
+
 static void http_perform_as_stream_reader( void )
 {
 	char *buffer = malloc( MAX_HTTP_RECV_BUFFER + 1 );
@@ -736,7 +808,7 @@ static void https_async( void )
 	esp_http_client_config_t config = {
 		.url = "https://postman-echo.com/post",
 		.event_handler = _http_event_handler,
-		.cert_pem = postman_root_cert_pem_start,
+		TRUST( postman_root_cert_pem_start ),
 		.is_async = true,
 		.timeout_ms = 5000,
 	};
@@ -768,6 +840,7 @@ static void https_async( void )
 		ESP_LOGE( TAG, "Error perform http request %s", esp_err_to_name( err ) );
 	}
 	esp_http_client_cleanup( client );
+	UNTRUST( postman_root_cert_pem_start );
 
 	// Test HTTP_METHOD_HEAD with is_async enabled
 	config.url = "https://" CONFIG_EXAMPLE_HTTP_ENDPOINT "/get";
@@ -978,10 +1051,28 @@ static void http_partial_download( void )
 }
 #endif	// CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
 
+static void http_ota_stream( void )
+{
+	const esp_http_client_config_t http = {
+		.url = CONFIG_EXAMPLE_OTA_URL,
+		.timeout_ms = 10000,
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+		.crt_bundle_attach = esp_crt_bundle_attach,
+#endif
+	};
+	struct ota_stream_stats stats;
+
+	if ( !*CONFIG_EXAMPLE_OTA_URL )
+		return;
+	if ( ota_stream_download( &( const struct ota_stream_config ) { .http = &http }, &stats ) == ESP_OK )
+		ota_stream_log_stats( &stats );
+}
+
 static void http_test_task( void *pvParameters )
 {
 	http_rest_with_url();
 	http_rest_with_hostname_path();
+	http_rest_pooled();
 #if CONFIG_ESP_HTTP_CLIENT_ENABLE_BASIC_AUTH
 	http_auth_basic();
 	http_auth_basic_redirect();
@@ -999,6 +1090,7 @@ static void http_test_task( void *pvParameters )
 	https_with_hostname_path();
 	http_redirect_to_https();
 	http_download_chunk();
+	http_json_stream();
 	http_perform_as_stream_reader();
 	https_async();
 	https_with_invalid_url();
@@ -1006,18 +1098,49 @@ static void http_test_task( void *pvParameters )
 #if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
 	http_partial_download();
 #endif
+	http_ota_stream();
 
+#if CONFIG_TLS_SESSION_CACHE
+	tls_session_cache_log_stats();
+#endif
+#if CONFIG_CERT_REGISTRY
+	cert_registry_log_stats();
+#endif
+#if CONFIG_DNS_CACHE
+	dns_cache_log_stats();
+#endif
+#if CONFIG_TLS_BUFFER_POOL
+	tls_buffer_pool_log_stats();
+#endif
 	ESP_LOGI( TAG, "Finish http example" );
 #if !CONFIG_IDF_TARGET_LINUX
 	vTaskDelete( NULL );
 #endif
 }
 
+#endif
+
+#ifdef CONFIG_EXAMPLE_HTTP_BENCHMARK
+static void http_bench_task( void *pvParameters )
+{
+	http_bench();
+#if !CONFIG_IDF_TARGET_LINUX
+	vTaskDelete( NULL );
+#endif
+}
+#endif
+
 void http_client_test( void )
 {
+#ifdef CONFIG_EXAMPLE_HTTP_BENCHMARK
+	TaskFunction_t task = http_bench_task;
+#else
+	TaskFunction_t task = http_test_task;
+#endif
+
 #if CONFIG_IDF_TARGET_LINUX
-	http_test_task( NULL );
+	task( NULL );
 #else
-	xTaskCreate( &http_test_task, "http_test_task", 8192, NULL, 5, NULL );
+	xTaskCreate( task, "http_test_task", 8192, NULL, 5, NULL );
 #endif
 }
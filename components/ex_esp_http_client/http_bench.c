@@ -0,0 +1,380 @@
+
+#include "http_bench.h"
+
+#include "esp_heap_caps.h"
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "tls_buffer_pool.h"
+#include "tls_session_cache.h"
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CONFIG_EXAMPLE_HTTP_BENCHMARK
+
+#define STR_( x ) #x
+#define STR( x )  STR_( x )
+#define BODY_SIZE CONFIG_EXAMPLE_HTTP_BENCH_BODY_SIZE
+#define N_ITER	  CONFIG_EXAMPLE_HTTP_BENCH_ITERATIONS
+#define SESSIONS  CONFIG_EXAMPLE_HTTP_BENCH_TLS_SESSIONS
+
+// Input record buffer at the default MBEDTLS_SSL_IN_CONTENT_LEN, overhead included
+#define RECORD_BUF_SIZE ( 17 * 1024 )
+
+enum phase
+{
+	PHASE_DNS,
+	PHASE_CONNECT,
+	PHASE_TLS,
+	PHASE_FIRST_BYTE,  // From the connection being up to the first response header
+	PHASE_COMPLETE,	   // Whole request, DNS included
+	PHASE_MAX
+};
+
+struct scenario
+{
+	const char *name;
+	esp_http_client_method_t method;
+	const char *path;
+	bool upload;
+	bool stream;  // esp_http_client_open/read instead of perform
+	bool https_async;
+};
+
+struct timing
+{
+	int64_t connected_at;
+	int64_t first_byte_at;
+	uint32_t bytes;
+};
+
+static const char *TAG = "http_bench";
+
+static const char *const phase_names[ PHASE_MAX ] = {
+	[PHASE_DNS] = "dns_us",
+	[PHASE_CONNECT] = "connect_us",
+	[PHASE_TLS] = "tls_us",
+	[PHASE_FIRST_BYTE] = "first_byte_us",
+	[PHASE_COMPLETE] = "complete_us",
+};
+
+static const struct scenario scenarios[] = {
+	{ .name = "get", .method = HTTP_METHOD_GET, .path = "/get" },
+	{ .name = "post", .method = HTTP_METHOD_POST, .path = "/post", .upload = true },
+	{ .name = "put", .method = HTTP_METHOD_PUT, .path = "/put", .upload = true },
+	{ .name = "patch", .method = HTTP_METHOD_PATCH, .path = "/patch", .upload = true },
+	{ .name = "delete", .method = HTTP_METHOD_DELETE, .path = "/delete" },
+	{ .name = "head", .method = HTTP_METHOD_HEAD, .path = "/get" },
+	{ .name = "chunked", .method = HTTP_METHOD_GET, .path = "/stream-bytes/" STR( BODY_SIZE ) "?chunk_size=512" },
+	{ .name = "redirect", .method = HTTP_METHOD_GET, .path = "/relative-redirect/3" },
+	{ .name = "stream_read", .method = HTTP_METHOD_GET, .path = "/bytes/" STR( BODY_SIZE ), .stream = true },
+#if CONFIG_EXAMPLE_HTTP_BENCH_HTTPS
+	{ .name = "https_async", .method = HTTP_METHOD_GET, .path = "/get", .https_async = true },
+#endif
+};
+
+static esp_err_t event_handler( esp_http_client_event_t *evt )
+{
+	struct timing *const t = evt->user_data;
+
+	switch ( evt->event_id )
+	{
+		case HTTP_EVENT_ON_CONNECTED:
+			if ( !t->connected_at )
+				t->connected_at = esp_timer_get_time();
+			break;
+		case HTTP_EVENT_ON_HEADER:
+			if ( !t->first_byte_at )
+				t->first_byte_at = esp_timer_get_time();
+			break;
+		case HTTP_EVENT_ON_DATA:
+			t->bytes += evt->data_len;
+			break;
+		default:
+			break;
+	}
+	return ESP_OK;
+}
+
+/**
+ * lwIP keeps resolved names in its own table, so resolving right before the request measures what the client's own
+ * lookup costs: the full query the first time, a table hit afterwards.
+ */
+static uint32_t resolve( void )
+{
+	const struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *res = NULL;
+	const int64_t start = esp_timer_get_time();
+
+	if ( !getaddrinfo( CONFIG_EXAMPLE_HTTP_ENDPOINT, NULL, &hints, &res ) )
+		freeaddrinfo( res );
+	return esp_timer_get_time() - start;
+}
+
+/** Handshake time as timed by the session cache; without it TLS time stays inside the connect phase */
+static uint64_t tls_us( void )
+{
+#if CONFIG_TLS_SESSION_CACHE
+	struct tls_session_cache_stats s;
+	tls_session_cache_get_stats( &s );
+	return s.full_us + s.resumed_us;
+#else
+	return 0;
+#endif
+}
+
+static esp_err_t run_stream( esp_http_client_handle_t client, struct timing *const t, char *const buf )
+{
+	esp_err_t err = esp_http_client_open( client, 0 );
+	int n;
+
+	if ( err != ESP_OK )
+		return err;
+	if ( esp_http_client_fetch_headers( client ) < 0 )
+		return ESP_FAIL;
+	while ( ( n = esp_http_client_read( client, buf, BODY_SIZE ) ) > 0 )
+		t->bytes += n;
+	esp_http_client_close( client );
+	return n < 0 ? ESP_FAIL : ESP_OK;
+}
+
+/** One request, filling in its phase times. Returns the bytes received, < 0 on error. */
+static int run_once( const struct scenario *const sc, char *const body, uint32_t phases[ PHASE_MAX ] )
+{
+	struct timing t = { 0 };
+	esp_http_client_config_t config = {
+		.host = CONFIG_EXAMPLE_HTTP_ENDPOINT,
+		.path = sc->path,
+		.method = sc->method,
+		.event_handler = event_handler,
+		.user_data = &t,
+		.timeout_ms = 10000,
+	};
+	esp_err_t err;
+
+	if ( sc->https_async )
+	{
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+		config.transport_type = HTTP_TRANSPORT_OVER_SSL;
+		config.crt_bundle_attach = esp_crt_bundle_attach;
+		config.is_async = true;
+#endif
+	}
+
+	phases[ PHASE_DNS ] = resolve();
+	const uint64_t tls_before = tls_us();
+	const int64_t start = esp_timer_get_time();
+	esp_http_client_handle_t client = esp_http_client_init( &config );
+	if ( !client )
+		return -1;
+	if ( sc->upload )
+		esp_http_client_set_post_field( client, body, BODY_SIZE );
+
+	if ( sc->stream )
+		err = run_stream( client, &t, body );
+	else
+		// The async client returns as soon as the socket would block, give the stack a tick to make progress
+		while ( ( err = esp_http_client_perform( client ) ) == ESP_ERR_HTTP_EAGAIN )
+			vTaskDelay( 1 );
+	const int64_t done = esp_timer_get_time();
+	const int status = esp_http_client_get_status_code( client );
+	esp_http_client_cleanup( client );
+
+	if ( err != ESP_OK || status >= 400 || !t.connected_at )
+	{
+		ESP_LOGW( TAG, "%s: %s, status %d", sc->name, esp_err_to_name( err ), status );
+		return -1;
+	}
+	phases[ PHASE_TLS ] = tls_us() - tls_before;
+	// The TLS time is measured around the handshake alone, so jitter can put it past the connection being up
+	const int64_t connect_us = t.connected_at - start - phases[ PHASE_TLS ];
+	phases[ PHASE_CONNECT ] = connect_us > 0 ? connect_us : 0;
+	phases[ PHASE_FIRST_BYTE ] = t.first_byte_at ? t.first_byte_at - t.connected_at : 0;
+	phases[ PHASE_COMPLETE ] = phases[ PHASE_DNS ] + ( done - start );
+	return t.bytes;
+}
+
+static int cmp_u32( const void *a, const void *b )
+{
+	const uint32_t x = *( const uint32_t * )a, y = *( const uint32_t * )b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(
+	const struct scenario *const sc,
+	uint32_t *const samples,
+	const int n,
+	const int errors,
+	const uint64_t bytes )
+{
+	uint64_t total_us = 0;
+	char line[ 512 ];
+	int len;
+
+	for ( int i = 0; i < n; ++i )
+		total_us += samples[ PHASE_COMPLETE * N_ITER + i ];
+
+	len = snprintf(
+		line,
+		sizeof( line ),
+		"{\"scenario\":\"%s\",\"n\":%d,\"errors\":%d,\"req_per_s\":%" PRIu32 ",\"bytes_per_s\":%" PRIu32,
+		sc->name,
+		n,
+		errors,
+		total_us ? ( uint32_t )( n * 1000000ULL / total_us ) : 0,
+		total_us ? ( uint32_t )( bytes * 1000000 / total_us ) : 0 );
+	for ( enum phase p = 0; p < PHASE_MAX && ( size_t )len < sizeof( line ); ++p )
+	{
+		uint32_t *const s = &samples[ p * N_ITER ];
+		qsort( s, n, sizeof( *s ), cmp_u32 );
+		len += snprintf(
+			line + len,
+			sizeof( line ) - len,
+			",\"%s\":{\"p50\":%" PRIu32 ",\"p95\":%" PRIu32 ",\"p99\":%" PRIu32 "}",
+			phase_names[ p ],
+			n ? s[ ( n - 1 ) * 50 / 100 ] : 0,
+			n ? s[ ( n - 1 ) * 95 / 100 ] : 0,
+			n ? s[ ( n - 1 ) * 99 / 100 ] : 0 );
+	}
+	// Machine readable, one line per scenario: grep HTTP_BENCH and strip the prefix
+	printf( "HTTP_BENCH %s}\n", line );
+}
+
+#if SESSIONS
+/** Room for one more session, a record buffer off the heap included in case the pool has no slot for it */
+static bool heap_has_room( void )
+{
+	return esp_get_free_heap_size() >= CONFIG_EXAMPLE_HTTP_BENCH_HEAP_RESERVE
+		   && heap_caps_get_largest_free_block( MALLOC_CAP_8BIT ) >= RECORD_BUF_SIZE;
+}
+
+/** How many HTTPS sessions can be held open at once, and whether each still serves a request with all of them up */
+static void bench_sessions( void )
+{
+	esp_http_client_handle_t clients[ SESSIONS ];
+	const esp_http_client_config_t config = {
+		.host = CONFIG_EXAMPLE_HTTP_ENDPOINT,
+		.path = "/get",
+		.transport_type = HTTP_TRANSPORT_OVER_SSL,
+		.crt_bundle_attach = esp_crt_bundle_attach,
+		.keep_alive_enable = true,
+		.timeout_ms = 10000,
+	};
+	const uint32_t free_before = esp_get_free_heap_size();
+	const char *stopped_by = "max";
+	int n = 0, served = 0;
+
+	for ( ; n < SESSIONS; ++n )
+	{
+		if ( !heap_has_room() )
+		{
+			stopped_by = "heap";
+			break;
+		}
+		if ( !( clients[ n ] = esp_http_client_init( &config ) ) )
+		{
+			stopped_by = "init";
+			break;
+		}
+		if ( esp_http_client_perform( clients[ n ] ) != ESP_OK )
+		{
+			esp_http_client_cleanup( clients[ n ] );
+			stopped_by = "connect";
+			break;
+		}
+	}
+	const uint32_t free_held = esp_get_free_heap_size();
+
+	// With every session up, each one idle until its turn
+	for ( int i = 0; i < n; ++i )
+		served += esp_http_client_perform( clients[ i ] ) == ESP_OK;
+	for ( int i = 0; i < n; ++i )
+		esp_http_client_cleanup( clients[ i ] );
+
+#if CONFIG_TLS_BUFFER_POOL
+	const bool pooled = true;
+	struct tls_buffer_pool_stats pool;
+	tls_buffer_pool_get_stats( &pool );
+#else
+	const bool pooled = false;
+	const struct tls_buffer_pool_stats pool = { 0 };
+#endif
+#if CONFIG_MBEDTLS_DYNAMIC_BUFFER
+	const bool dynamic = true;
+#else
+	const bool dynamic = false;
+#endif
+	printf(
+		"HTTP_BENCH {\"scenario\":\"tls_sessions\",\"sessions\":%d,\"stopped_by\":\"%s\",\"served\":%d"
+		",\"heap_per_session\":%" PRIu32 ",\"free_heap\":%" PRIu32 ",\"min_free_heap\":%" PRIu32
+		",\"pool\":%s,\"dynamic_buffer\":%s,\"pool_peak_slots\":%" PRIu32 ",\"pool_fallbacks\":%" PRIu32 "}\n",
+		n,
+		stopped_by,
+		served,
+		n && free_before > free_held ? ( free_before - free_held ) / n : 0,
+		free_held,
+		esp_get_minimum_free_heap_size(),
+		pooled ? "true" : "false",
+		dynamic ? "true" : "false",
+		pool.peak,
+		pool.fallbacks );
+}
+#endif
+
+void http_bench( void )
+{
+	uint32_t *const samples = malloc( PHASE_MAX * N_ITER * sizeof( uint32_t ) );
+	char *const body = malloc( BODY_SIZE );
+
+	if ( !samples || !body )
+	{
+		ESP_LOGE( TAG, "out of memory" );
+		goto out;
+	}
+	memset( body, 'x', BODY_SIZE );
+
+	for ( size_t i = 0; i < sizeof( scenarios ) / sizeof( scenarios[ 0 ] ); ++i )
+	{
+		const struct scenario *const sc = &scenarios[ i ];
+		uint32_t phases[ PHASE_MAX ];
+		uint64_t bytes = 0;
+		int n = 0, errors = 0;
+
+		ESP_LOGI( TAG, "%s: %d warmup, %d measured", sc->name, CONFIG_EXAMPLE_HTTP_BENCH_WARMUP, N_ITER );
+		for ( int w = 0; w < CONFIG_EXAMPLE_HTTP_BENCH_WARMUP; ++w )
+			run_once( sc, body, phases );
+		for ( int it = 0; it < N_ITER; ++it )
+		{
+			const int got = run_once( sc, body, phases );
+			if ( got < 0 )
+			{
+				++errors;
+				continue;
+			}
+			bytes += got;
+			for ( enum phase p = 0; p < PHASE_MAX; ++p )
+				samples[ p * N_ITER + n ] = phases[ p ];
+			++n;
+		}
+		report( sc, samples, n, errors, bytes );
+	}
+#if SESSIONS
+	bench_sessions();
+#endif
+	ESP_LOGI( TAG, "done" );
+
+out:
+	free( samples );
+	free( body );
+}
+
+#endif
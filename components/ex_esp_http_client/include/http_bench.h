@@ -0,0 +1,5 @@
+
+#pragma once
+
+/** Runs every scenario in turn, blocking until done */
+void http_bench( void );
@@ -0,0 +1,5 @@
+
+#pragma once
+
+/** Runs every configured size/QoS combination in turn, blocking until done */
+void mqtt_bench( void );
@@ -0,0 +1,416 @@
+
+#include "mqtt_bench.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "mqtt_batch.h"
+#include "mqtt_client.h"
+#include "mqtt_stream.h"
+#include "sdkconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#ifdef CONFIG_BROKER_BENCHMARK
+
+#define BENCH_TOPIC	   "/bench/w5100"
+#define PENDING_MAX	   256
+#define HDR_LEN		   ( sizeof( uint32_t ) + sizeof( int64_t ) )
+#define DRAIN_US	   3000000LL
+#define CONNECTED_BIT  BIT0
+#define SUBSCRIBED_BIT BIT1
+
+struct samples
+{
+	uint32_t *us;
+	uint32_t n;		// Recorded so far, may exceed the capacity
+	uint32_t max_us;
+};
+
+struct run
+{
+	uint32_t id;
+	int qos;
+	size_t size;
+	uint32_t sent;
+	uint32_t acked;
+	uint32_t echoed;
+	int64_t sent_at[ PENDING_MAX ];	 // By msg_id, for the PUBACK latency
+	struct samples puback;
+	struct samples echo;
+};
+
+static const char *TAG = "mqtt_bench";
+
+static EventGroupHandle_t events;
+static struct run run;
+static portMUX_TYPE run_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void sample_add( struct samples *const s, const uint32_t us )
+{
+	// Once full, newer samples overwrite older ones round-robin
+	s->us[ s->n++ % CONFIG_BROKER_BENCH_SAMPLES ] = us;
+	if ( us > s->max_us )
+		s->max_us = us;
+}
+
+static int cmp_u32( const void *a, const void *b )
+{
+	const uint32_t x = *( const uint32_t * )a, y = *( const uint32_t * )b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile( const struct samples *const s, const uint32_t pct )
+{
+	const uint32_t n = s->n < CONFIG_BROKER_BENCH_SAMPLES ? s->n : CONFIG_BROKER_BENCH_SAMPLES;
+	return n ? s->us[ ( n - 1 ) * pct / 100 ] : 0;
+}
+
+static void event_handler( void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data )
+{
+	const esp_mqtt_event_handle_t event = event_data;
+	const int64_t now = esp_timer_get_time();
+
+	switch ( ( esp_mqtt_event_id_t )event_id )
+	{
+		case MQTT_EVENT_CONNECTED:
+			xEventGroupSetBits( events, CONNECTED_BIT );
+			break;
+		case MQTT_EVENT_DISCONNECTED:
+			xEventGroupClearBits( events, CONNECTED_BIT | SUBSCRIBED_BIT );
+			break;
+		case MQTT_EVENT_SUBSCRIBED:
+			xEventGroupSetBits( events, SUBSCRIBED_BIT );
+			break;
+		case MQTT_EVENT_PUBLISHED:
+			portENTER_CRITICAL( &run_mux );
+			{
+				int64_t *const at = &run.sent_at[ event->msg_id % PENDING_MAX ];
+				if ( run.id && *at )
+				{
+					sample_add( &run.puback, now - *at );
+					++run.acked;
+					*at = 0;
+				}
+			}
+			portEXIT_CRITICAL( &run_mux );
+			break;
+		case MQTT_EVENT_DATA:
+		{
+			uint32_t id;
+			int64_t at;
+			// Only the first fragment of a message carries the header
+			if ( event->current_data_offset || event->data_len < ( int )HDR_LEN )
+				break;
+			memcpy( &id, event->data, sizeof( id ) );
+			memcpy( &at, event->data + sizeof( id ), sizeof( at ) );
+			portENTER_CRITICAL( &run_mux );
+			// Messages from an earlier run may still be arriving
+			if ( id == run.id )
+			{
+				sample_add( &run.echo, now - at );
+				++run.echoed;
+			}
+			portEXIT_CRITICAL( &run_mux );
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+static void report( const uint32_t elapsed_ms, const uint32_t heap_min_run )
+{
+	qsort( run.puback.us, MIN( run.puback.n, CONFIG_BROKER_BENCH_SAMPLES ), sizeof( uint32_t ), cmp_u32 );
+	qsort( run.echo.us, MIN( run.echo.n, CONFIG_BROKER_BENCH_SAMPLES ), sizeof( uint32_t ), cmp_u32 );
+
+	const uint32_t delivered = run.qos ? run.acked : run.sent;
+	// Machine readable, one line per run: grep MQTT_BENCH and strip the prefix
+	printf(
+		"MQTT_BENCH {\"size\":%u,\"qos\":%d,\"rate\":%d,\"duration_ms\":%" PRIu32 ",\"sent\":%" PRIu32
+		",\"acked\":%" PRIu32 ",\"echoed\":%" PRIu32 ",\"msgs_per_s\":%" PRIu32 ",\"bytes_per_s\":%" PRIu32
+		",\"puback_us\":{\"p50\":%" PRIu32 ",\"p90\":%" PRIu32 ",\"p99\":%" PRIu32 ",\"max\":%" PRIu32
+		"},\"echo_us\":{\"p50\":%" PRIu32 ",\"p90\":%" PRIu32 ",\"p99\":%" PRIu32 ",\"max\":%" PRIu32
+		"},\"heap_min_run\":%" PRIu32 ",\"heap_min_boot\":%" PRIu32 "}\n",
+		( unsigned )run.size,
+		run.qos,
+		CONFIG_BROKER_BENCH_RATE,
+		elapsed_ms,
+		run.sent,
+		run.acked,
+		run.echoed,
+		( uint32_t )( delivered * 1000ULL / elapsed_ms ),
+		( uint32_t )( ( uint64_t )delivered * run.size * 1000 / elapsed_ms ),
+		percentile( &run.puback, 50 ),
+		percentile( &run.puback, 90 ),
+		percentile( &run.puback, 99 ),
+		run.puback.max_us,
+		percentile( &run.echo, 50 ),
+		percentile( &run.echo, 90 ),
+		percentile( &run.echo, 99 ),
+		run.echo.max_us,
+		heap_min_run,
+		esp_get_minimum_free_heap_size() );
+}
+
+static void bench_one( esp_mqtt_client_handle_t client, uint8_t *const payload, const size_t size, const int qos )
+{
+	static uint32_t next_id;
+	uint32_t *const puback_us = run.puback.us, *const echo_us = run.echo.us;
+
+	portENTER_CRITICAL( &run_mux );
+	run = ( struct run ) {
+		.id = ++next_id,
+		.qos = qos,
+		.size = size,
+		.puback = { .us = puback_us },
+		.echo = { .us = echo_us },
+	};
+	portEXIT_CRITICAL( &run_mux );
+
+	esp_mqtt_client_subscribe( client, BENCH_TOPIC, qos );
+	xEventGroupWaitBits( events, SUBSCRIBED_BIT, pdTRUE, pdTRUE, pdMS_TO_TICKS( 5000 ) );
+	ESP_LOGI( TAG, "run %" PRIu32 ": %u bytes, qos %d", run.id, ( unsigned )size, qos );
+
+	const int64_t start = esp_timer_get_time(), end = start + CONFIG_BROKER_BENCH_DURATION_S * 1000000LL;
+	uint32_t heap_min = heap_caps_get_free_size( MALLOC_CAP_DEFAULT );
+	int64_t now;
+#if CONFIG_BROKER_BENCH_RATE
+	int64_t next_at = start;
+#endif
+
+	memcpy( payload, &run.id, sizeof( run.id ) );
+	while ( ( now = esp_timer_get_time() ) < end )
+	{
+#if CONFIG_BROKER_BENCH_RATE
+		// Paced against the clock rather than the tick, rates above the tick rate go out in small bursts
+		if ( now < next_at )
+		{
+			vTaskDelay( 1 );
+			continue;
+		}
+		next_at += 1000000 / CONFIG_BROKER_BENCH_RATE;
+#else
+		if ( esp_mqtt_client_get_outbox_size( client ) > CONFIG_BROKER_BENCH_OUTBOX_LIMIT )
+		{
+			vTaskDelay( 1 );
+			continue;
+		}
+#endif
+		memcpy( payload + sizeof( run.id ), &now, sizeof( now ) );
+		const int msg_id = esp_mqtt_client_publish( client, BENCH_TOPIC, ( const char * )payload, size, qos, 0 );
+		if ( msg_id >= 0 )
+		{
+			portENTER_CRITICAL( &run_mux );
+			++run.sent;
+			if ( qos )
+				run.sent_at[ msg_id % PENDING_MAX ] = now;
+			portEXIT_CRITICAL( &run_mux );
+		}
+
+		const uint32_t heap = heap_caps_get_free_size( MALLOC_CAP_DEFAULT );
+		if ( heap < heap_min )
+			heap_min = heap;
+		if ( msg_id < 0 )
+			vTaskDelay( 1 );
+	}
+	const uint32_t elapsed_ms = ( now - start ) / 1000;
+
+	// Let PUBACKs and echoes still in flight land, they count against the run they belong to
+	while ( esp_timer_get_time() - now < DRAIN_US && ( qos ? run.acked < run.sent : run.echoed < run.sent ) )
+		vTaskDelay( pdMS_TO_TICKS( 10 ) );
+	esp_mqtt_client_unsubscribe( client, BENCH_TOPIC );
+
+	portENTER_CRITICAL( &run_mux );
+	run.id = 0;	 // Stop recording
+	portEXIT_CRITICAL( &run_mux );
+	report( elapsed_ms, heap_min );
+}
+
+/** Next number from a comma separated Kconfig list, NULL when there are none left */
+static const char *next_int( const char *p, int *const out )
+{
+	char *end;
+
+	while ( *p == ',' || *p == ' ' )
+		++p;
+	if ( !*p )
+		return NULL;
+	*out = strtol( p, &end, 10 );
+	return end == p ? NULL : end;
+}
+
+#ifdef CONFIG_BROKER_BENCH_BATCH
+/** Returns when the next message is due, straight away when unpaced */
+static int64_t pace( int64_t *const next_at )
+{
+#if CONFIG_BROKER_BENCH_RATE
+	while ( esp_timer_get_time() < *next_at )
+		vTaskDelay( 1 );
+	*next_at += 1000000 / CONFIG_BROKER_BENCH_RATE;
+#endif
+	return esp_timer_get_time();
+}
+
+static void batch_report(
+	const char *const mode,
+	const size_t size,
+	const int qos,
+	const struct mqtt_batch_stats *const s,
+	const uint32_t elapsed_ms )
+{
+	const uint32_t n = s->messages ? s->messages : 1;
+
+	printf(
+		"MQTT_BENCH {\"mode\":\"%s\",\"size\":%u,\"qos\":%d,\"rate\":%d,\"window_ms\":%d,\"msgs\":%" PRIu32
+		",\"failed\":%" PRIu32 ",\"packets\":%" PRIu32 ",\"writes\":%" PRIu32
+		",\"wire_bytes_per_msg\":%.1f,\"writes_per_msg\":%.3f,\"latency_us\":{\"avg\":%" PRIu32
+		",\"max\":%" PRIu32 "},\"msgs_per_s\":%" PRIu32 "}\n",
+		mode,
+		( unsigned )size,
+		qos,
+		CONFIG_BROKER_BENCH_RATE,
+		CONFIG_MQTT_BATCH_WINDOW_MS,
+		s->messages,
+		s->failed,
+		s->packets,
+		s->writes,
+		( double )s->wire_bytes / n,
+		( double )s->writes / n,
+		( uint32_t )( s->latency_us_sum / n ),
+		s->latency_us_max,
+		( uint32_t )( s->messages * 1000ULL / ( elapsed_ms ? elapsed_ms : 1 ) ) );
+}
+
+/** The same messages once as one PUBLISH per write, once through a batcher, both on stream */
+static void bench_batch_one(
+	mqtt_stream_handle_t stream,
+	const uint8_t *const payload,
+	const size_t size,
+	const int qos )
+{
+	const struct mqtt_stream_source src = { .data = payload, .len = size };
+	struct mqtt_stream_stats before, after;
+	struct mqtt_batch_stats single = { 0 }, batched;
+	int64_t start, next_at;
+
+	mqtt_stream_get_stats( stream, &before );
+	start = next_at = esp_timer_get_time();
+	for ( uint32_t i = 0; i < CONFIG_BROKER_BENCH_BATCH_COUNT; ++i )
+	{
+		const int64_t at = pace( &next_at );
+		single.failed += mqtt_stream_publish( stream, BENCH_TOPIC, &src, qos, false ) != ESP_OK;
+		const uint32_t us = esp_timer_get_time() - at;
+		single.latency_us_sum += us;
+		single.latency_us_max = MAX( single.latency_us_max, us );
+	}
+	mqtt_stream_get_stats( stream, &after );
+	single.messages = single.packets = CONFIG_BROKER_BENCH_BATCH_COUNT;
+	single.batches = CONFIG_BROKER_BENCH_BATCH_COUNT;
+	single.writes = after.writes - before.writes;
+	single.wire_bytes = after.wire_bytes - before.wire_bytes;
+	batch_report( "single", size, qos, &single, ( esp_timer_get_time() - start ) / 1000 );
+
+	mqtt_batch_handle_t batch = mqtt_batch_create( stream, qos );
+	if ( !batch )
+		return;
+	start = next_at = esp_timer_get_time();
+	for ( uint32_t i = 0; i < CONFIG_BROKER_BENCH_BATCH_COUNT; ++i )
+	{
+		pace( &next_at );
+		mqtt_batch_publish( batch, BENCH_TOPIC, payload, size );
+	}
+	mqtt_batch_flush( batch );
+	const uint32_t elapsed_ms = ( esp_timer_get_time() - start ) / 1000;
+	mqtt_batch_get_stats( batch, &batched );
+	mqtt_batch_destroy( batch );
+	batch_report( "batch", size, qos, &batched, elapsed_ms );
+}
+
+static void bench_batch( const uint8_t *const payload )
+{
+	mqtt_stream_handle_t stream = mqtt_stream_connect( &( const struct mqtt_stream_config ) {
+		.uri = CONFIG_BROKER_URI,
+		.client_id = "w5100-bench-batch",
+		.keepalive_s = 60,
+	} );
+	int size, qos;
+
+	if ( !stream )
+	{
+		ESP_LOGE( TAG, "no session for the batching runs" );
+		return;
+	}
+	for ( const char *q = CONFIG_BROKER_BENCH_QOS; ( q = next_int( q, &qos ) ); )
+		for ( const char *p = CONFIG_BROKER_BENCH_SIZES; ( p = next_int( p, &size ) ); )
+		{
+			// Topic and headers have to fit alongside
+			if ( size + sizeof( BENCH_TOPIC ) + 8 > CONFIG_MQTT_BATCH_MAX_BYTES )
+				continue;
+			ESP_LOGI( TAG, "batching: %d bytes, qos %d", size, qos );
+			bench_batch_one( stream, payload, size, qos );
+		}
+	mqtt_stream_disconnect( stream );
+}
+#endif
+
+void mqtt_bench( void )
+{
+	const esp_mqtt_client_config_t mqtt_cfg = {
+		.broker.address.uri = CONFIG_BROKER_URI,
+		.buffer.size = 4096,
+	};
+	int max_size = 0, size, qos;
+
+	for ( const char *p = CONFIG_BROKER_BENCH_SIZES; ( p = next_int( p, &size ) ); )
+		max_size = MAX( max_size, size );
+	max_size = MAX( max_size, ( int )HDR_LEN );
+
+	uint8_t *const payload = calloc( 1, max_size );
+	run.puback.us = calloc( CONFIG_BROKER_BENCH_SAMPLES, sizeof( uint32_t ) );
+	run.echo.us = calloc( CONFIG_BROKER_BENCH_SAMPLES, sizeof( uint32_t ) );
+	events = xEventGroupCreate();
+	if ( !payload || !run.puback.us || !run.echo.us || !events )
+	{
+		ESP_LOGE( TAG, "out of memory" );
+		goto out;
+	}
+
+	esp_mqtt_client_handle_t client = esp_mqtt_client_init( &mqtt_cfg );
+	esp_mqtt_client_register_event( client, ESP_EVENT_ANY_ID, event_handler, NULL );
+	esp_mqtt_client_start( client );
+	if ( !( xEventGroupWaitBits( events, CONNECTED_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS( 30000 ) ) & CONNECTED_BIT ) )
+	{
+		ESP_LOGE( TAG, "no connection to %s", CONFIG_BROKER_URI );
+		esp_mqtt_client_destroy( client );
+		goto out;
+	}
+
+	for ( const char *q = CONFIG_BROKER_BENCH_QOS; ( q = next_int( q, &qos ) ); )
+		for ( const char *p = CONFIG_BROKER_BENCH_SIZES; ( p = next_int( p, &size ) ); )
+			bench_one( client, payload, MAX( size, ( int )HDR_LEN ), qos );
+
+	esp_mqtt_client_stop( client );
+	esp_mqtt_client_destroy( client );
+#ifdef CONFIG_BROKER_BENCH_BATCH
+	bench_batch( payload );
+#endif
+	ESP_LOGI( TAG, "done" );
+
+out:
+	if ( events )
+		vEventGroupDelete( events );
+	free( run.puback.us );
+	free( run.echo.us );
+	free( payload );
+	run.puback.us = run.echo.us = NULL;
+}
+
+#endif
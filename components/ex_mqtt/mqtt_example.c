@@ -19,11 +19,20 @@
 // #include "esp_netif.h"
 // #include "protocol_examples_common.h"
 
+#include "cert_registry.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_timer.h"
 #include "esp_tls.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "link_coordinator.h"
+#include "metrics_export.h"
+#include "mqtt_bench.h"
 #include "mqtt_client.h"
 #include "mqtt_example.h"
+#include "mqtt_outbox.h"
+#include "mqtt_stream.h"
 
 #include <sys/param.h>
 
@@ -37,20 +46,96 @@ extern const uint8_t mqtt_eclipseprojects_io_pem_start[] asm( "_binary_mqtt_ecli
 #endif
 extern const uint8_t mqtt_eclipseprojects_io_pem_end[] asm( "_binary_mqtt_eclipseprojects_io_pem_end" );
 
+/*
+ * The client and the streaming sessions share one parsed copy of the broker's CA. The client holds its reference for as
+ * long as it exists, each stream for as long as it is connected.
+ */
+#if CONFIG_CERT_REGISTRY
+#define STREAM_TRUST( pem ) .crt_bundle_attach = cert_registry_get( ( const char * )pem )
+#define CLIENT_TRUST( pem ) .crt_bundle_attach = cert_registry_get( ( const char * )pem )
+#define UNTRUST( pem )		cert_registry_put( ( const char * )pem )
+#else
+#define STREAM_TRUST( pem ) .cert_pem = ( const char * )pem
+#define CLIENT_TRUST( pem ) .certificate = ( const char * )pem
+#define UNTRUST( pem )
+#endif
+
+#ifdef CONFIG_LINK_COORDINATOR
+static int link_id = -1;
+
+/**
+ * Cuts the reconnect backoff short. The client is in its wait state by now, its socket aborted along with the address,
+ * unless a static address kept the connection through a flap, in which case the call does nothing.
+ */
+static void on_link_up( void *ctx )
+{
+	esp_mqtt_client_reconnect( ctx );
+}
+#endif
+
+#ifdef CONFIG_METRICS_EXPORT
+/** Bytes of messages the client holds until they are sent or acknowledged */
+static uint32_t read_queue_bytes( void *ctx )
+{
+	const int n = esp_mqtt_client_get_outbox_size( ctx );
+	return n > 0 ? n : 0;
+}
+
+#ifdef CONFIG_MQTT_OUTBOX
+static uint32_t read_outbox_pending( void *ctx )
+{
+	struct mqtt_outbox_stats s;
+
+	mqtt_outbox_get_stats( &s );
+	return s.pending;
+}
+#endif
+#endif
+
+#define BINARY_STACK 6144  // Room for the stream's TLS handshake
+
+static volatile bool binary_busy;
+
 //
 // Note: this function is for testing purposes only publishing part of the active partition
 //       (to be checked against the original binary)
 //
-static void send_binary( esp_mqtt_client_handle_t client )
+// Runs as a task of its own: the stream's handshake and the wait for the PUBACK would otherwise hold up the client's
+// task, keepalive and all, for the whole transfer.
+//
+static void send_binary( void *p )
 {
 	esp_partition_mmap_handle_t out_handle;
 	const void *binary_address;
 	const esp_partition_t *partition = esp_ota_get_running_partition();
-	esp_partition_mmap( partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &binary_address, &out_handle );
+	esp_err_t err
+		= esp_partition_mmap( partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &binary_address, &out_handle );
 	// sending only the configured portion of the partition (if it's less than the partition size)
 	int binary_size = MIN( CONFIG_BROKER_BIN_SIZE_TO_SEND, partition->size );
-	int msg_id = esp_mqtt_client_publish( client, "/topic/binary", binary_address, binary_size, 0, 0 );
-	ESP_LOGI( TAG, "binary sent with msg_id=%d", msg_id );
+
+	// Streamed over a session of its own, straight out of the mmapped flash instead of through the client's outbox
+	if ( err == ESP_OK )
+	{
+		mqtt_stream_handle_t stream = mqtt_stream_connect( &( const struct mqtt_stream_config ) {
+			.uri = CONFIG_BROKER_URI,
+			STREAM_TRUST( mqtt_eclipseprojects_io_pem_start ),
+			.client_id = "esp32-w5100-stream",
+			.keepalive_s = 60,
+		} );
+		err = stream ? mqtt_stream_publish(
+						   stream,
+						   "/topic/binary",
+						   &( const struct mqtt_stream_source ) { .data = binary_address, .len = binary_size },
+						   1,
+						   false )
+					 : ESP_FAIL;
+		mqtt_stream_disconnect( stream );
+		UNTRUST( mqtt_eclipseprojects_io_pem_start );
+		esp_partition_munmap( out_handle );
+	}
+	ESP_LOGI( TAG, "binary sent: %s", esp_err_to_name( err ) );
+	binary_busy = false;
+	vTaskDelete( NULL );
 }
 
 /*
@@ -73,6 +158,9 @@ static void mqtt_event_handler( void *handler_args, esp_event_base_t base, int32
 	{
 		case MQTT_EVENT_CONNECTED:
 			ESP_LOGI( TAG, "MQTT_EVENT_CONNECTED" );
+#ifdef CONFIG_LINK_COORDINATOR
+			link_coordinator_resumed( link_id );
+#endif
 			msg_id = esp_mqtt_client_subscribe( client, ( char * )"/topic/qos0", 0 );
 			ESP_LOGI( TAG, "sent subscribe successful, msg_id=%d", msg_id );
 
@@ -104,7 +192,14 @@ static void mqtt_event_handler( void *handler_args, esp_event_base_t base, int32
 			if ( strncmp( event->data, "send binary please", event->data_len ) == 0 )
 			{
 				ESP_LOGI( TAG, "Sending the binary" );
-				send_binary( client );
+				if ( binary_busy )
+					ESP_LOGW( TAG, "Still sending the last one" );
+				else
+				{
+					binary_busy = true;
+					if ( xTaskCreate( send_binary, "mqtt_binary", BINARY_STACK, NULL, 5, NULL ) != pdPASS )
+						binary_busy = false;
+				}
 			}
 			break;
 		case MQTT_EVENT_ERROR:
@@ -137,17 +232,62 @@ static void mqtt_event_handler( void *handler_args, esp_event_base_t base, int32
 	}
 }
 
+#ifdef CONFIG_MQTT_OUTBOX
+#define TELEMETRY_PERIOD_MS 5000
+
+/** Keeps publishing through link loss, whatever the broker missed arrives in order once it is reachable again */
+static void telemetry_task( void *p )
+{
+	char json[ 96 ];
+
+	for ( ;; )
+	{
+		const int len = snprintf(
+			json,
+			sizeof( json ),
+			"{\"uptime_ms\":%" PRId64 ",\"free_heap\":%" PRIu32 "}",
+			esp_timer_get_time() / 1000,
+			esp_get_free_heap_size() );
+		const esp_err_t err = mqtt_outbox_publish( "/topic/telemetry", json, len, 1, false );
+		if ( err != ESP_OK )
+			ESP_LOGW( TAG, "Telemetry dropped: %s", esp_err_to_name( err ) );
+		vTaskDelay( pdMS_TO_TICKS( TELEMETRY_PERIOD_MS ) );
+	}
+}
+#endif
+
 static void mqtt_app_start( void )
 {
 	const esp_mqtt_client_config_t mqtt_cfg = {
 		.broker = { .address.uri = CONFIG_BROKER_URI,
-					.verification.certificate = ( const char * )mqtt_eclipseprojects_io_pem_start },
+					.verification = { CLIENT_TRUST( mqtt_eclipseprojects_io_pem_start ) } },
 	};
 
 	ESP_LOGI( TAG, "[APP] Free memory: %" PRIu32 " bytes", esp_get_free_heap_size() );
 	esp_mqtt_client_handle_t client = esp_mqtt_client_init( &mqtt_cfg );
+	if ( !client )
+	{
+		ESP_LOGE( TAG, "client init failed" );
+		UNTRUST( mqtt_eclipseprojects_io_pem_start );
+		return;
+	}
 	/* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
 	esp_mqtt_client_register_event( client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL );
+#ifdef CONFIG_LINK_COORDINATOR
+	link_id = link_coordinator_register(
+		&( const struct link_client ) { .name = "mqtt", .on_up = on_link_up, .ctx = client } );
+#endif
+#ifdef CONFIG_METRICS_EXPORT
+	metrics_export_register( "mqtt.queue_bytes", METRICS_GAUGE, read_queue_bytes, client );
+#ifdef CONFIG_MQTT_OUTBOX
+	metrics_export_register( "mqtt.outbox_pending", METRICS_GAUGE, read_outbox_pending, NULL );
+#endif
+#endif
+#ifdef CONFIG_MQTT_OUTBOX
+	// Before starting, so the outbox sees the first connect
+	if ( mqtt_outbox_init( client ) == ESP_OK )
+		xTaskCreate( telemetry_task, "telemetry", 3072, NULL, 5, NULL );
+#endif
 	esp_mqtt_client_start( client );
 }
 
@@ -157,5 +297,9 @@ void mqtt_example( void )
 	ESP_LOGI( TAG, "[APP] Free memory: %" PRIu32 " bytes", esp_get_free_heap_size() );
 	ESP_LOGI( TAG, "[APP] IDF version: %s", esp_get_idf_version() );
 
+#ifdef CONFIG_BROKER_BENCHMARK
+	mqtt_bench();
+	return;
+#endif
 	mqtt_app_start();
 }
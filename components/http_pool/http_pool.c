@@ -0,0 +1,423 @@
+
+#include "http_pool.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "link_coordinator.h"
+#include "sdkconfig.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HOST_MAX  64
+#define URL_MAX	  256
+#define IDLE_US	  ( CONFIG_HTTP_POOL_IDLE_TIMEOUT_MS * 1000LL )
+#define POOL_SIZE CONFIG_HTTP_POOL_MAX_CONNECTIONS
+
+struct key
+{
+	bool tls;
+	char host[ HOST_MAX ];
+	uint16_t port;
+	http_event_handle_cb handler;
+};
+
+struct conn
+{
+	struct key key;
+	esp_http_client_handle_t client;
+	bool busy;
+	uint32_t requests;	// Served on this client so far, the first one pays for connecting
+	int64_t idle_since;
+};
+
+static const char *TAG = "http_pool";
+
+static struct conn conns[ POOL_SIZE ];
+static struct http_pool_stats stats;
+
+static StaticSemaphore_t lock_buf;
+static SemaphoreHandle_t lock;
+// One count per socket the pool may hold, taken for as long as a caller has a client
+static StaticSemaphore_t slots_buf;
+static SemaphoreHandle_t slots;
+static volatile bool drop_pending;	// The link went down, idle connections go before the next one is handed out
+static int link_id = -1;
+
+/** Scheme, host and port from either the URL or the host/port/transport_type fields, like esp_http_client does */
+static bool key_of( const esp_http_client_config_t *const config, struct key *const key )
+{
+	const char *host = config->host, *end;
+	size_t len;
+
+	memset( key, 0, sizeof( *key ) );
+	key->handler = config->event_handler;
+	key->port = config->port;
+
+	if ( host )
+	{
+		key->tls = config->transport_type == HTTP_TRANSPORT_OVER_SSL;
+		len = strlen( host );
+	}
+	else if ( config->url )
+	{
+		const char *const sep = strstr( config->url, "://" );
+		if ( !sep )
+			return false;
+		key->tls = !strncasecmp( config->url, "https", sep - config->url );
+		host = sep + 3;
+		end = host + strcspn( host, "/?#" );
+		// Credentials are not part of the key, the connection is the same
+		for ( const char *at = host; at < end; ++at )
+			if ( *at == '@' )
+				host = at + 1;
+		const char *const colon = memchr( host, ':', end - host );
+		if ( colon )
+		{
+			key->port = atoi( colon + 1 );
+			end = colon;
+		}
+		len = end - host;
+	}
+	else
+		return false;
+
+	if ( !len || len >= HOST_MAX )
+		return false;
+	for ( size_t i = 0; i < len; ++i )
+		key->host[ i ] = tolower( ( unsigned char )host[ i ] );
+	if ( !key->port )
+		key->port = key->tls ? 443 : 80;
+	return true;
+}
+
+static bool key_equal( const struct key *const a, const struct key *const b )
+{
+	return a->tls == b->tls && a->port == b->port && a->handler == b->handler && !strcmp( a->host, b->host );
+}
+
+/** Points a warm client at the request in config without touching its connection */
+static esp_err_t rearm( esp_http_client_handle_t client, const esp_http_client_config_t *const config )
+{
+	esp_err_t err;
+
+	if ( config->host )
+	{
+		char url[ URL_MAX ];
+		const int n = snprintf(
+			url,
+			sizeof( url ),
+			"%s://%s:%u%s%s%s",
+			config->transport_type == HTTP_TRANSPORT_OVER_SSL ? "https" : "http",
+			config->host,
+			config->port ? config->port : config->transport_type == HTTP_TRANSPORT_OVER_SSL ? 443 : 80,
+			config->path ? config->path : "/",
+			config->query ? "?" : "",
+			config->query ? config->query : "" );
+		if ( n < 0 || ( size_t )n >= sizeof( url ) )
+			return ESP_ERR_INVALID_SIZE;
+		err = esp_http_client_set_url( client, url );
+	}
+	else
+		err = esp_http_client_set_url( client, config->url );
+	if ( err != ESP_OK )
+		return err;
+
+	esp_http_client_set_method( client, config->method );
+	esp_http_client_set_post_field( client, NULL, 0 );
+	esp_http_client_set_user_data( client, config->user_data );
+	if ( config->timeout_ms )
+		esp_http_client_set_timeout_ms( client, config->timeout_ms );
+	return ESP_OK;
+}
+
+static struct conn *find_client( const esp_http_client_handle_t client )
+{
+	for ( size_t i = 0; i < POOL_SIZE; ++i )
+		if ( conns[ i ].client == client )
+			return &conns[ i ];
+	return NULL;
+}
+
+/** Closes idle connections idle for longer than max_idle_us, sockets are closed outside the lock */
+static uint32_t close_idle( const int64_t max_idle_us )
+{
+	esp_http_client_handle_t expired[ POOL_SIZE ];
+	const int64_t now = esp_timer_get_time();
+	size_t n = 0;
+
+	xSemaphoreTake( lock, portMAX_DELAY );
+	for ( size_t i = 0; i < POOL_SIZE; ++i )
+	{
+		struct conn *const c = &conns[ i ];
+		if ( c->client && !c->busy && now - c->idle_since > max_idle_us )
+		{
+			expired[ n++ ] = c->client;
+			memset( c, 0, sizeof( *c ) );
+		}
+	}
+	xSemaphoreGive( lock );
+
+	for ( size_t i = 0; i < n; ++i )
+		esp_http_client_cleanup( expired[ i ] );
+	return n;
+}
+
+/**
+ * Closes what has been idle too long, or everything idle once the link was lost. Done by whoever acquires next rather
+ * than from a timer: each close is a TLS close_notify and a socket close, which have no business in the esp_timer task.
+ */
+static void reap( void )
+{
+	const bool drop = drop_pending;
+
+	drop_pending = false;
+	const uint32_t n = close_idle( drop ? -1 : IDLE_US );
+
+	xSemaphoreTake( lock, portMAX_DELAY );
+	if ( drop )
+		stats.dropped += n;
+	else
+		stats.retired += n;
+	xSemaphoreGive( lock );
+}
+
+void http_pool_drop_idle( void )
+{
+	if ( !lock )
+		return;
+
+	const uint32_t n = close_idle( -1 );
+
+	xSemaphoreTake( lock, portMAX_DELAY );
+	stats.dropped += n;
+	xSemaphoreGive( lock );
+}
+
+#ifdef CONFIG_LINK_COORDINATOR
+/**
+ * Idle sockets died with the link, the next request would only find out after a failed write. Called from the
+ * coordinator's timer, so the closing is left to the next acquire.
+ */
+static void on_link_down( void *ctx )
+{
+	drop_pending = true;
+}
+#endif
+
+esp_err_t http_pool_init( void )
+{
+	if ( lock )
+		return ESP_OK;
+
+	lock = xSemaphoreCreateMutexStatic( &lock_buf );
+	slots = xSemaphoreCreateCountingStatic( POOL_SIZE, POOL_SIZE, &slots_buf );
+#ifdef CONFIG_LINK_COORDINATOR
+	if ( link_id < 0 )
+		link_id = link_coordinator_register( &( const struct link_client ) { .name = TAG, .on_down = on_link_down } );
+#endif
+	return ESP_OK;
+}
+
+esp_err_t http_pool_deinit( void )
+{
+	if ( !lock )
+		return ESP_OK;
+
+	// Every slot back means no caller holds a client, and none can take one until the next init
+	for ( size_t i = 0; i < POOL_SIZE; ++i )
+		if ( xSemaphoreTake( slots, 0 ) != pdTRUE )
+		{
+			while ( i-- )
+				xSemaphoreGive( slots );
+			ESP_LOGW( TAG, "clients still in use" );
+			return ESP_ERR_INVALID_STATE;
+		}
+
+	for ( size_t i = 0; i < POOL_SIZE; ++i )
+	{
+		if ( conns[ i ].client )
+			esp_http_client_cleanup( conns[ i ].client );
+		memset( &conns[ i ], 0, sizeof( conns[ i ] ) );
+	}
+	vSemaphoreDelete( slots );
+	vSemaphoreDelete( lock );
+	lock = NULL;
+	return ESP_OK;
+}
+
+esp_http_client_handle_t http_pool_acquire( const esp_http_client_config_t *const config )
+{
+	struct conn *c = NULL, *empty = NULL, *oldest = NULL;
+	esp_http_client_handle_t evicted = NULL;
+	struct key key;
+
+	if ( !lock || !key_of( config, &key ) )
+		return NULL;
+	reap();
+	if ( xSemaphoreTake( slots, pdMS_TO_TICKS( CONFIG_HTTP_POOL_ACQUIRE_TIMEOUT_MS ) ) != pdTRUE )
+	{
+		xSemaphoreTake( lock, portMAX_DELAY );
+		++stats.timeouts;
+		xSemaphoreGive( lock );
+		ESP_LOGW( TAG, "no free connection for %s:%u", key.host, key.port );
+		return NULL;
+	}
+
+	xSemaphoreTake( lock, portMAX_DELAY );
+	for ( size_t i = 0; i < POOL_SIZE && !c; ++i )
+	{
+		struct conn *const e = &conns[ i ];
+		if ( !e->client )
+			empty = empty ? empty : e;
+		else if ( e->busy )
+			continue;
+		else if ( key_equal( &e->key, &key ) )
+			c = e;
+		else if ( !oldest || e->idle_since < oldest->idle_since )
+			oldest = e;
+	}
+	if ( c )
+		c->busy = true;
+	else
+	{
+		// Holding a slot guarantees an empty entry or an idle one to another server
+		c = empty ? empty : oldest;
+		if ( c->client )
+		{
+			evicted = c->client;
+			++stats.evicted;
+		}
+		memset( c, 0, sizeof( *c ) );
+		c->key = key;
+		c->busy = true;
+		++stats.misses;
+	}
+	xSemaphoreGive( lock );
+
+	if ( evicted )
+		esp_http_client_cleanup( evicted );
+
+	if ( c->client )
+	{
+		if ( rearm( c->client, config ) != ESP_OK )
+		{
+			http_pool_release( c->client, false );
+			return NULL;
+		}
+		xSemaphoreTake( lock, portMAX_DELAY );
+		++stats.hits;
+		xSemaphoreGive( lock );
+		return c->client;
+	}
+
+	// HTTP/1.1 keeps the connection by default, keep_alive_enable would only add TCP keepalive probes
+	esp_http_client_handle_t client = esp_http_client_init( config );
+
+	xSemaphoreTake( lock, portMAX_DELAY );
+	c->client = client;
+	if ( !client )
+		memset( c, 0, sizeof( *c ) );
+	xSemaphoreGive( lock );
+	if ( !client )
+		xSemaphoreGive( slots );
+	return client;
+}
+
+void http_pool_release( esp_http_client_handle_t client, const bool reusable )
+{
+	if ( !lock || !client )
+		return;
+
+	xSemaphoreTake( lock, portMAX_DELAY );
+	struct conn *const c = find_client( client );
+	if ( c && reusable )
+	{
+		c->busy = false;
+		c->idle_since = esp_timer_get_time();
+	}
+	else if ( c )
+		memset( c, 0, sizeof( *c ) );
+	xSemaphoreGive( lock );
+
+	if ( !c )
+	{
+		ESP_LOGE( TAG, "release of a client not from the pool" );
+		return;
+	}
+	if ( !reusable )
+		esp_http_client_cleanup( client );
+	xSemaphoreGive( slots );
+}
+
+esp_err_t http_pool_perform( esp_http_client_handle_t client )
+{
+	const int64_t start = esp_timer_get_time();
+	const esp_err_t err = esp_http_client_perform( client );
+	const uint32_t elapsed = esp_timer_get_time() - start;
+
+	if ( !lock )
+		return err;
+#ifdef CONFIG_LINK_COORDINATOR
+	if ( err == ESP_OK )
+		link_coordinator_resumed( link_id );
+#endif
+	xSemaphoreTake( lock, portMAX_DELAY );
+	struct conn *const c = find_client( client );
+	if ( c && err == ESP_OK )
+	{
+		if ( c->requests++ )
+		{
+			++stats.pooled_requests;
+			stats.pooled_us += elapsed;
+		}
+		else
+		{
+			++stats.fresh_requests;
+			stats.fresh_us += elapsed;
+		}
+	}
+	xSemaphoreGive( lock );
+	return err;
+}
+
+void http_pool_get_stats( struct http_pool_stats *const out )
+{
+	if ( !lock )
+	{
+		memset( out, 0, sizeof( *out ) );
+		return;
+	}
+	xSemaphoreTake( lock, portMAX_DELAY );
+	*out = stats;
+	xSemaphoreGive( lock );
+}
+
+void http_pool_log_stats( void )
+{
+	struct http_pool_stats s;
+
+	http_pool_get_stats( &s );
+	ESP_LOGI(
+		TAG,
+		"hits %" PRIu32 ", misses %" PRIu32 ", evicted %" PRIu32 ", retired %" PRIu32 ", dropped %" PRIu32
+		", timeouts %" PRIu32,
+		s.hits,
+		s.misses,
+		s.evicted,
+		s.retired,
+		s.dropped,
+		s.timeouts );
+	ESP_LOGI(
+		TAG,
+		"pooled requests %" PRIu32 " avg %" PRIu32 " ms, fresh %" PRIu32 " avg %" PRIu32 " ms",
+		s.pooled_requests,
+		s.pooled_requests ? ( uint32_t )( s.pooled_us / s.pooled_requests / 1000 ) : 0,
+		s.fresh_requests,
+		s.fresh_requests ? ( uint32_t )( s.fresh_us / s.fresh_requests / 1000 ) : 0 );
+}
@@ -0,0 +1,45 @@
+
+#pragma once
+
+#include "esp_http_client.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct http_pool_stats
+{
+	uint32_t hits;		 // Acquired a warm connection to the same scheme, host and port
+	uint32_t misses;	 // Had to create a client
+	uint32_t evicted;	 // Idle connection to another server closed to make room
+	uint32_t retired;	 // Idle connection closed for outliving CONFIG_HTTP_POOL_IDLE_TIMEOUT_MS
+	uint32_t dropped;	 // Idle connection closed by http_pool_drop_idle() or for the link going down
+	uint32_t timeouts;	 // Every connection stayed busy for the whole acquire timeout
+	uint32_t pooled_requests;
+	uint32_t fresh_requests;
+	uint64_t pooled_us;
+	uint64_t fresh_us;
+};
+
+esp_err_t http_pool_init( void );
+/** Closes every connection, ESP_ERR_INVALID_STATE while any client is still acquired */
+esp_err_t http_pool_deinit( void );
+
+/**
+ * Hands out a keep-alive client for the scheme, host and port in config, reusing an idle one if there is one. The
+ * client is reset to config's URL (or host/path/query), method and user_data; its event handler must match the one
+ * it was created with, so different handlers get different connections. Headers set by an earlier borrower stay on
+ * the client, delete them before releasing it. Returns NULL on timeout.
+ */
+esp_http_client_handle_t http_pool_acquire( const esp_http_client_config_t *const config );
+
+/** Gives the client back. Pass reusable = false after a failed request so the connection gets closed. */
+void http_pool_release( esp_http_client_handle_t client, const bool reusable );
+
+/** Closes every idle connection, for when they are known to be dead such as after the link went down */
+void http_pool_drop_idle( void );
+
+/** esp_http_client_perform() with the request timed against whether the connection was warm */
+esp_err_t http_pool_perform( esp_http_client_handle_t client );
+
+void http_pool_get_stats( struct http_pool_stats *const out );
+void http_pool_log_stats( void );
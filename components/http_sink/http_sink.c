@@ -0,0 +1,441 @@
+
+#include "http_sink.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#include <stdio.h>
+#include <string.h>
+
+enum json_state
+{
+	J_VALUE,
+	J_KEY,
+	J_COLON,
+	J_STRING,
+	J_ESCAPE,
+	J_LITERAL,
+	J_AFTER,
+	J_DONE,
+	J_ERROR,
+};
+
+static const char *TAG = "http_sink";
+
+static char arena[ CONFIG_HTTP_SINK_ARENA_SLOTS ][ CONFIG_HTTP_SINK_ARENA_SLOT_SIZE ];
+static bool arena_used[ CONFIG_HTTP_SINK_ARENA_SLOTS ];
+
+static struct
+{
+	esp_http_client_handle_t client;
+	struct http_sink sink;
+} bound[ CONFIG_HTTP_SINK_ARENA_SLOTS ];
+
+static portMUX_TYPE sink_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static int arena_take( void )
+{
+	int slot = -1;
+
+	portENTER_CRITICAL( &sink_mux );
+	for ( int i = 0; i < CONFIG_HTTP_SINK_ARENA_SLOTS; ++i )
+		if ( !arena_used[ i ] )
+		{
+			arena_used[ i ] = true;
+			slot = i;
+			break;
+		}
+	portEXIT_CRITICAL( &sink_mux );
+	return slot;
+}
+
+static void arena_give( const int slot )
+{
+	portENTER_CRITICAL( &sink_mux );
+	arena_used[ slot ] = false;
+	portEXIT_CRITICAL( &sink_mux );
+}
+
+/* Streaming JSON */
+
+static void json_reset( struct http_sink_json *const j )
+{
+	j->state = J_VALUE;
+	j->depth = 0;
+	j->path_len = 0;
+	j->path[ 0 ] = '\0';
+	j->tok_len = 0;
+}
+
+static void tok_add( struct http_sink_json *const j, const char c )
+{
+	if ( j->tok_len < sizeof( j->tok ) - 1 )
+		j->tok[ j->tok_len++ ] = c;
+	else
+		j->truncated = true;
+}
+
+static void tok_start( struct http_sink_json *const j )
+{
+	j->tok_len = 0;
+	j->truncated = false;
+}
+
+/** Replaces the last path component, a path that no longer fits keeps its parent */
+static void path_set(
+	struct http_sink_json *const j,
+	const char *const fmt,
+	const char *const sep,
+	const char *const s )
+{
+	const uint16_t mark = j->path_mark[ j->depth - 1 ];
+	const size_t room = sizeof( j->path ) - mark;
+	const int n = snprintf( j->path + mark, room, fmt, mark ? sep : "", s );
+
+	j->path_len = n >= 0 && ( size_t )n < room ? mark + n : mark;
+	j->path[ j->path_len ] = '\0';
+}
+
+static void json_emit( struct http_sink *const sink, const enum http_sink_json_type type )
+{
+	struct http_sink_json *const j = &sink->json;
+
+	j->tok[ j->tok_len ] = '\0';
+	if ( sink->on_value )
+		sink->on_value( sink->ctx, j->path, type, j->tok, j->tok_len, j->truncated );
+}
+
+static void json_after_value( struct http_sink_json *const j )
+{
+	j->state = j->depth ? J_AFTER : J_DONE;
+}
+
+static bool json_push( struct http_sink_json *const j, const char type )
+{
+	if ( j->depth == CONFIG_HTTP_SINK_JSON_DEPTH )
+		return false;
+	j->stack[ j->depth ] = type;
+	j->index[ j->depth ] = 0;
+	j->path_mark[ j->depth ] = j->path_len;
+	++j->depth;
+	j->state = type == '{' ? J_KEY : J_VALUE;
+	return true;
+}
+
+static void json_pop( struct http_sink_json *const j )
+{
+	--j->depth;
+	j->path_len = j->path_mark[ j->depth ];
+	j->path[ j->path_len ] = '\0';
+	json_after_value( j );
+}
+
+static void json_flush_literal( struct http_sink *const sink )
+{
+	struct http_sink_json *const j = &sink->json;
+	const char c = j->tok[ 0 ];
+
+	json_emit(
+		sink,
+		c == 't' || c == 'f' ? HTTP_SINK_JSON_BOOL
+		: c == 'n'			 ? HTTP_SINK_JSON_NULL
+							 : HTTP_SINK_JSON_NUMBER );
+	json_after_value( j );
+}
+
+static bool is_space( const char c )
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool json_char( struct http_sink *const sink, const char c )
+{
+	struct http_sink_json *const j = &sink->json;
+	char index[ 8 ];
+
+	switch ( j->state )
+	{
+		case J_VALUE:
+			if ( is_space( c ) )
+				return true;
+			if ( j->depth && j->stack[ j->depth - 1 ] == '[' )
+			{
+				if ( c == ']' && !j->index[ j->depth - 1 ] )
+				{
+					json_pop( j );
+					return true;
+				}
+				snprintf( index, sizeof( index ), "%u", j->index[ j->depth - 1 ] );
+				path_set( j, "%s[%s]", "", index );
+			}
+			if ( c == '{' || c == '[' )
+				return json_push( j, c );
+			tok_start( j );
+			if ( c == '"' )
+			{
+				j->key = false;
+				j->state = J_STRING;
+				return true;
+			}
+			if ( c == '-' || ( c >= '0' && c <= '9' ) || c == 't' || c == 'f' || c == 'n' )
+			{
+				tok_add( j, c );
+				j->state = J_LITERAL;
+				return true;
+			}
+			return false;
+
+		case J_KEY:
+			if ( is_space( c ) )
+				return true;
+			if ( c == '}' )
+			{
+				json_pop( j );
+				return true;
+			}
+			if ( c != '"' )
+				return false;
+			tok_start( j );
+			j->key = true;
+			j->state = J_STRING;
+			return true;
+
+		case J_COLON:
+			if ( is_space( c ) )
+				return true;
+			j->state = J_VALUE;
+			return c == ':';
+
+		case J_STRING:
+			if ( c == '\\' )
+			{
+				j->state = J_ESCAPE;
+				return true;
+			}
+			if ( c == '"' )
+			{
+				j->tok[ j->tok_len ] = '\0';
+				if ( j->key )
+				{
+					path_set( j, "%s%s", ".", j->tok );
+					j->state = J_COLON;
+				}
+				else
+				{
+					json_emit( sink, HTTP_SINK_JSON_STRING );
+					json_after_value( j );
+				}
+				return true;
+			}
+			tok_add( j, c );
+			return true;
+
+		case J_ESCAPE:
+			// Kept as sent, see http_sink_json_cb
+			tok_add( j, '\\' );
+			tok_add( j, c );
+			j->state = J_STRING;
+			return true;
+
+		case J_LITERAL:
+			if ( ( c >= '0' && c <= '9' ) || ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || c == '.'
+				 || c == '+' || c == '-' )
+			{
+				tok_add( j, c );
+				return true;
+			}
+			json_flush_literal( sink );
+			return json_char( sink, c );
+
+		case J_AFTER:
+			if ( is_space( c ) )
+				return true;
+			if ( c == ',' )
+			{
+				if ( j->stack[ j->depth - 1 ] == '{' )
+					j->state = J_KEY;
+				else
+				{
+					++j->index[ j->depth - 1 ];
+					j->state = J_VALUE;
+				}
+				return true;
+			}
+			if ( ( c == '}' || c == ']' ) && c == ( j->stack[ j->depth - 1 ] == '{' ? '}' : ']' ) )
+			{
+				json_pop( j );
+				return true;
+			}
+			return false;
+
+		case J_DONE:
+			return is_space( c );
+
+		default:
+			return false;
+	}
+}
+
+/* Sink */
+
+void http_sink_init_arena( struct http_sink *const sink )
+{
+	*sink = ( struct http_sink ) { .mode = HTTP_SINK_ARENA, .slot = -1 };
+}
+
+void http_sink_init_json( struct http_sink *const sink, const http_sink_json_cb on_value, void *const ctx )
+{
+	*sink = ( struct http_sink ) { .mode = HTTP_SINK_JSON, .slot = -1, .on_value = on_value, .ctx = ctx };
+	json_reset( &sink->json );
+}
+
+void http_sink_release( struct http_sink *const sink )
+{
+	if ( sink->slot >= 0 )
+		arena_give( sink->slot );
+	sink->slot = -1;
+	sink->len = 0;
+}
+
+void http_sink_reset( struct http_sink *const sink )
+{
+	sink->err = ESP_OK;
+	sink->received = 0;
+	sink->len = 0;
+	sink->truncated = false;
+	if ( sink->slot >= 0 )
+		arena[ sink->slot ][ 0 ] = '\0';
+	if ( sink->mode == HTTP_SINK_JSON )
+		json_reset( &sink->json );
+}
+
+esp_err_t http_sink_feed( struct http_sink *const sink, const char *const data, const size_t len )
+{
+	sink->received += len;
+	if ( sink->err )
+		return sink->err;
+
+	if ( sink->mode == HTTP_SINK_JSON )
+	{
+		for ( size_t i = 0; i < len; ++i )
+			if ( !json_char( sink, data[ i ] ) )
+			{
+				ESP_LOGW( TAG, "Malformed JSON at byte %u", ( unsigned )( sink->received - len + i ) );
+				sink->json.state = J_ERROR;
+				return sink->err = ESP_ERR_INVALID_RESPONSE;
+			}
+		return ESP_OK;
+	}
+
+	if ( sink->slot < 0 && ( sink->slot = arena_take() ) < 0 )
+	{
+		ESP_LOGW( TAG, "No free arena slot, body dropped" );
+		return sink->err = ESP_ERR_NO_MEM;
+	}
+
+	const size_t room = CONFIG_HTTP_SINK_ARENA_SLOT_SIZE - 1 - sink->len;
+	const size_t n = len < room ? len : room;
+	char *const buf = arena[ sink->slot ];
+
+	memcpy( buf + sink->len, data, n );
+	sink->len += n;
+	buf[ sink->len ] = '\0';
+	if ( n < len )
+		sink->truncated = true;
+	return ESP_OK;
+}
+
+esp_err_t http_sink_finish( struct http_sink *const sink )
+{
+	if ( sink->mode != HTTP_SINK_JSON || sink->err )
+		return sink->err;
+	if ( sink->json.state == J_LITERAL )
+		json_flush_literal( sink );
+	if ( sink->received && sink->json.state != J_DONE )
+		return sink->err = ESP_ERR_INVALID_SIZE;
+	return ESP_OK;
+}
+
+const char *http_sink_body( const struct http_sink *const sink, size_t *const len )
+{
+	if ( len )
+		*len = sink->len;
+	return sink->slot >= 0 ? arena[ sink->slot ] : NULL;
+}
+
+esp_err_t http_sink_on_event( struct http_sink *const sink, esp_http_client_event_t *const evt )
+{
+	switch ( evt->event_id )
+	{
+		// Also seen again for every redirect, whose body is not wanted
+		case HTTP_EVENT_HEADERS_SENT:
+			http_sink_reset( sink );
+			break;
+		// Chunked bodies arrive here already decoded
+		case HTTP_EVENT_ON_DATA:
+			http_sink_feed( sink, evt->data, evt->data_len );
+			break;
+		case HTTP_EVENT_ON_FINISH:
+			http_sink_finish( sink );
+			break;
+		default:
+			break;
+	}
+	return ESP_OK;
+}
+
+esp_err_t http_sink_event_handler( esp_http_client_event_t *evt )
+{
+	return evt->user_data ? http_sink_on_event( evt->user_data, evt ) : ESP_OK;
+}
+
+struct http_sink *http_sink_find( esp_http_client_handle_t client )
+{
+	struct http_sink *sink = NULL;
+
+	portENTER_CRITICAL( &sink_mux );
+	for ( size_t i = 0; i < CONFIG_HTTP_SINK_ARENA_SLOTS; ++i )
+		if ( bound[ i ].client == client )
+		{
+			sink = &bound[ i ].sink;
+			break;
+		}
+	portEXIT_CRITICAL( &sink_mux );
+	return sink;
+}
+
+struct http_sink *http_sink_bind( esp_http_client_handle_t client )
+{
+	struct http_sink *sink = http_sink_find( client );
+
+	if ( sink )
+		return sink;
+
+	portENTER_CRITICAL( &sink_mux );
+	for ( size_t i = 0; i < CONFIG_HTTP_SINK_ARENA_SLOTS; ++i )
+		if ( !bound[ i ].client )
+		{
+			bound[ i ].client = client;
+			sink = &bound[ i ].sink;
+			break;
+		}
+	portEXIT_CRITICAL( &sink_mux );
+
+	if ( sink )
+		http_sink_init_arena( sink );
+	return sink;
+}
+
+void http_sink_unbind( esp_http_client_handle_t client )
+{
+	struct http_sink *const sink = http_sink_find( client );
+
+	if ( !sink )
+		return;
+	http_sink_release( sink );
+	portENTER_CRITICAL( &sink_mux );
+	for ( size_t i = 0; i < CONFIG_HTTP_SINK_ARENA_SLOTS; ++i )
+		if ( &bound[ i ].sink == sink )
+			bound[ i ].client = NULL;
+	portEXIT_CRITICAL( &sink_mux );
+}
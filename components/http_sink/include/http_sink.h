@@ -0,0 +1,95 @@
+
+#pragma once
+
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum http_sink_mode
+{
+	HTTP_SINK_ARENA,  // Accumulate the body in a reusable arena slot
+	HTTP_SINK_JSON,	  // Parse the body as it arrives, nothing is kept
+};
+
+enum http_sink_json_type
+{
+	HTTP_SINK_JSON_STRING,
+	HTTP_SINK_JSON_NUMBER,
+	HTTP_SINK_JSON_BOOL,
+	HTTP_SINK_JSON_NULL,
+};
+
+/**
+ * Called for every scalar in the document. path is dotted for object members and indexed for array elements, e.g.
+ * "headers.Host" or "items[2].id". Strings are NUL terminated and not decoded: escapes come as sent, backslash
+ * included, so "a\"b" is delivered as the 4 characters a\"b. Keys in path are kept the same way.
+ */
+typedef void ( *http_sink_json_cb )(
+	void *ctx,
+	const char *path,
+	const enum http_sink_json_type type,
+	const char *value,
+	const size_t len,
+	const bool truncated );
+
+struct http_sink_json
+{
+	uint8_t state;
+	uint8_t depth;
+	bool key;
+	bool truncated;
+	char stack[ CONFIG_HTTP_SINK_JSON_DEPTH ];
+	uint16_t index[ CONFIG_HTTP_SINK_JSON_DEPTH ];
+	uint16_t path_mark[ CONFIG_HTTP_SINK_JSON_DEPTH ];
+	uint16_t path_len;
+	uint16_t tok_len;
+	char path[ CONFIG_HTTP_SINK_JSON_PATH_MAX ];
+	char tok[ CONFIG_HTTP_SINK_JSON_TOKEN_MAX ];
+};
+
+/** One per client, may live on the caller's stack. Nothing in here is shared, so clients can run concurrently. */
+struct http_sink
+{
+	enum http_sink_mode mode;
+	esp_err_t err;	// First error since the last reset, ESP_ERR_NO_MEM when no arena slot was free
+	size_t received;
+	// HTTP_SINK_ARENA
+	int slot;
+	size_t len;
+	bool truncated;
+	// HTTP_SINK_JSON
+	http_sink_json_cb on_value;
+	void *ctx;
+	struct http_sink_json json;
+};
+
+void http_sink_init_arena( struct http_sink *const sink );
+void http_sink_init_json( struct http_sink *const sink, const http_sink_json_cb on_value, void *const ctx );
+/** Gives the arena slot back, the body is gone afterwards */
+void http_sink_release( struct http_sink *const sink );
+
+/** Starts over for the next response, keeping the arena slot */
+void http_sink_reset( struct http_sink *const sink );
+esp_err_t http_sink_feed( struct http_sink *const sink, const char *const data, const size_t len );
+/** End of body: delivers a number or literal still pending at the top level */
+esp_err_t http_sink_finish( struct http_sink *const sink );
+
+/** Body accumulated in arena mode, NUL terminated. NULL before any data arrived. */
+const char *http_sink_body( const struct http_sink *const sink, size_t *const len );
+
+/** Feeds the sink from a client's events, for use in an existing event handler. Chunked bodies included. */
+esp_err_t http_sink_on_event( struct http_sink *const sink, esp_http_client_event_t *const evt );
+/** Ready-made event handler for clients whose user_data is a struct http_sink */
+esp_err_t http_sink_event_handler( esp_http_client_event_t *evt );
+
+/**
+ * Arena sinks bound to a client handle, for handlers that have no user_data to put a sink in. Returns NULL when every
+ * slot is in use.
+ */
+struct http_sink *http_sink_bind( esp_http_client_handle_t client );
+struct http_sink *http_sink_find( esp_http_client_handle_t client );
+void http_sink_unbind( esp_http_client_handle_t client );
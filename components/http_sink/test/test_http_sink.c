@@ -0,0 +1,188 @@
+
+#include "http_sink.h"
+
+#include "sdkconfig.h"
+#include "unity.h"
+
+#include <string.h>
+
+#define MAX_VALUES 8
+
+struct seen
+{
+	size_t n;
+	struct
+	{
+		char path[ CONFIG_HTTP_SINK_JSON_PATH_MAX ];
+		char value[ CONFIG_HTTP_SINK_JSON_TOKEN_MAX ];
+		enum http_sink_json_type type;
+		bool truncated;
+	} v[ MAX_VALUES ];
+};
+
+struct expected
+{
+	const char *path;
+	const char *value;
+	enum http_sink_json_type type;
+};
+
+static void collect(
+	void *ctx,
+	const char *path,
+	const enum http_sink_json_type type,
+	const char *value,
+	const size_t len,
+	const bool truncated )
+{
+	struct seen *const s = ctx;
+
+	TEST_ASSERT_LESS_THAN( MAX_VALUES, s->n );
+	TEST_ASSERT_EQUAL( strlen( value ), len );
+	strcpy( s->v[ s->n ].path, path );
+	strcpy( s->v[ s->n ].value, value );
+	s->v[ s->n ].type = type;
+	s->v[ s->n ].truncated = truncated;
+	++s->n;
+}
+
+/** Feeds doc in two pieces split at every position in turn, each run has to deliver the same values */
+static void check_every_split( const char *const doc, const struct expected *const expected, const size_t n )
+{
+	const size_t len = strlen( doc );
+
+	for ( size_t at = 0; at <= len; ++at )
+	{
+		struct seen seen = { 0 };
+		struct http_sink sink;
+
+		http_sink_init_json( &sink, collect, &seen );
+		TEST_ASSERT_EQUAL( ESP_OK, http_sink_feed( &sink, doc, at ) );
+		TEST_ASSERT_EQUAL( ESP_OK, http_sink_feed( &sink, doc + at, len - at ) );
+		TEST_ASSERT_EQUAL( ESP_OK, http_sink_finish( &sink ) );
+		TEST_ASSERT_EQUAL( n, seen.n );
+		for ( size_t i = 0; i < n; ++i )
+		{
+			TEST_ASSERT_EQUAL_STRING( expected[ i ].path, seen.v[ i ].path );
+			TEST_ASSERT_EQUAL_STRING( expected[ i ].value, seen.v[ i ].value );
+			TEST_ASSERT_EQUAL( expected[ i ].type, seen.v[ i ].type );
+			TEST_ASSERT_FALSE( seen.v[ i ].truncated );
+		}
+	}
+}
+
+TEST_CASE( "json escapes are kept as sent, in keys and values, across chunk splits", "[http_sink]" )
+{
+	static const char doc[] =
+		"{\"q\":\"say \\\"hi\\\"\",\"path\":\"C:\\\\tmp\",\"u\":\"\\u00e9\",\"a\\\"b\":\"x\"}";
+	static const struct expected expected[] = {
+		{ "q", "say \\\"hi\\\"", HTTP_SINK_JSON_STRING },
+		{ "path", "C:\\\\tmp", HTTP_SINK_JSON_STRING },
+		{ "u", "\\u00e9", HTTP_SINK_JSON_STRING },
+		{ "a\\\"b", "x", HTTP_SINK_JSON_STRING },
+	};
+
+	check_every_split( doc, expected, sizeof( expected ) / sizeof( expected[ 0 ] ) );
+}
+
+TEST_CASE( "json literals and numbers survive chunk splits", "[http_sink]" )
+{
+	static const char doc[] = "{\"n\":-12.5e+3,\"t\":true,\"f\":false,\"z\":null,\"a\":[1,{\"b\":22}]}";
+	static const struct expected expected[] = {
+		{ "n", "-12.5e+3", HTTP_SINK_JSON_NUMBER }, { "t", "true", HTTP_SINK_JSON_BOOL },
+		{ "f", "false", HTTP_SINK_JSON_BOOL },		{ "z", "null", HTTP_SINK_JSON_NULL },
+		{ "a[0]", "1", HTTP_SINK_JSON_NUMBER },		{ "a[1].b", "22", HTTP_SINK_JSON_NUMBER },
+	};
+
+	check_every_split( doc, expected, sizeof( expected ) / sizeof( expected[ 0 ] ) );
+}
+
+TEST_CASE( "json number at the top level is delivered by finish", "[http_sink]" )
+{
+	static const struct expected expected[] = { { "", "42", HTTP_SINK_JSON_NUMBER } };
+
+	check_every_split( "42", expected, 1 );
+}
+
+TEST_CASE( "json value longer than the token buffer is cut short and flagged", "[http_sink]" )
+{
+	char doc[ CONFIG_HTTP_SINK_JSON_TOKEN_MAX + 16 ];
+	struct seen seen = { 0 };
+	struct http_sink sink;
+
+	strcpy( doc, "[\"" );
+	memset( doc + 2, 'x', CONFIG_HTTP_SINK_JSON_TOKEN_MAX );
+	strcpy( doc + 2 + CONFIG_HTTP_SINK_JSON_TOKEN_MAX, "\"]" );
+
+	http_sink_init_json( &sink, collect, &seen );
+	TEST_ASSERT_EQUAL( ESP_OK, http_sink_feed( &sink, doc, strlen( doc ) ) );
+	TEST_ASSERT_EQUAL( ESP_OK, http_sink_finish( &sink ) );
+	TEST_ASSERT_EQUAL( 1, seen.n );
+	TEST_ASSERT_TRUE( seen.v[ 0 ].truncated );
+	TEST_ASSERT_EQUAL( CONFIG_HTTP_SINK_JSON_TOKEN_MAX - 1, strlen( seen.v[ 0 ].value ) );
+}
+
+TEST_CASE( "json malformed document fails the sink", "[http_sink]" )
+{
+	struct seen seen = { 0 };
+	struct http_sink sink;
+
+	http_sink_init_json( &sink, collect, &seen );
+	TEST_ASSERT_EQUAL( ESP_ERR_INVALID_RESPONSE, http_sink_feed( &sink, "{\"a\" 1}", 7 ) );
+	TEST_ASSERT_EQUAL( ESP_ERR_INVALID_RESPONSE, http_sink_finish( &sink ) );
+
+	// Cut off mid document
+	http_sink_init_json( &sink, collect, &seen );
+	TEST_ASSERT_EQUAL( ESP_OK, http_sink_feed( &sink, "{\"a\":[1,", 8 ) );
+	TEST_ASSERT_EQUAL( ESP_ERR_INVALID_SIZE, http_sink_finish( &sink ) );
+}
+
+TEST_CASE( "arena body longer than a slot is cut short and flagged", "[http_sink]" )
+{
+	static char chunk[ 100 ];
+	struct http_sink sink;
+	size_t fed = 0;
+	size_t len;
+
+	for ( size_t i = 0; i < sizeof( chunk ); ++i )
+		chunk[ i ] = 'a' + i % 26;
+	http_sink_init_arena( &sink );
+	while ( fed < CONFIG_HTTP_SINK_ARENA_SLOT_SIZE + sizeof( chunk ) )
+	{
+		TEST_ASSERT_EQUAL( ESP_OK, http_sink_feed( &sink, chunk, sizeof( chunk ) ) );
+		fed += sizeof( chunk );
+	}
+
+	const char *const body = http_sink_body( &sink, &len );
+	TEST_ASSERT_NOT_NULL( body );
+	TEST_ASSERT_TRUE( sink.truncated );
+	TEST_ASSERT_EQUAL( fed, sink.received );
+	TEST_ASSERT_EQUAL( CONFIG_HTTP_SINK_ARENA_SLOT_SIZE - 1, len );
+	TEST_ASSERT_EQUAL( '\0', body[ len ] );
+	for ( size_t i = 0; i < len; ++i )
+		TEST_ASSERT_EQUAL( chunk[ i % sizeof( chunk ) ], body[ i ] );
+
+	// The slot is kept across a reset and starts over empty
+	http_sink_reset( &sink );
+	TEST_ASSERT_EQUAL( ESP_OK, http_sink_feed( &sink, "ok", 2 ) );
+	TEST_ASSERT_EQUAL_STRING( "ok", http_sink_body( &sink, &len ) );
+	TEST_ASSERT_FALSE( sink.truncated );
+	http_sink_release( &sink );
+}
+
+TEST_CASE( "arena sink without a free slot drops the body", "[http_sink]" )
+{
+	struct http_sink sinks[ CONFIG_HTTP_SINK_ARENA_SLOTS + 1 ];
+
+	for ( size_t i = 0; i < CONFIG_HTTP_SINK_ARENA_SLOTS; ++i )
+	{
+		http_sink_init_arena( &sinks[ i ] );
+		TEST_ASSERT_EQUAL( ESP_OK, http_sink_feed( &sinks[ i ], "x", 1 ) );
+	}
+	http_sink_init_arena( &sinks[ CONFIG_HTTP_SINK_ARENA_SLOTS ] );
+	TEST_ASSERT_EQUAL( ESP_ERR_NO_MEM, http_sink_feed( &sinks[ CONFIG_HTTP_SINK_ARENA_SLOTS ], "x", 1 ) );
+	TEST_ASSERT_NULL( http_sink_body( &sinks[ CONFIG_HTTP_SINK_ARENA_SLOTS ], NULL ) );
+
+	for ( size_t i = 0; i < CONFIG_HTTP_SINK_ARENA_SLOTS; ++i )
+		http_sink_release( &sinks[ i ] );
+}
@@ -0,0 +1,48 @@
+
+#pragma once
+
+#include "esp_err.h"
+
+#include <stdint.h>
+
+/**
+ * Callbacks run in the esp_timer task (on_down) and the default event loop task (on_up), neither may block for long.
+ * on_down follows a link loss that outlasted the grace period, with TCP connections already aborted. on_up follows
+ * the link being back with an address after any loss of the link or the address, flaps within the grace period
+ * included, as DHCP gives the address up at link down and lwIP aborts its connections then.
+ */
+struct link_client
+{
+	const char *name;
+	void ( *on_down )( void *ctx );
+	void ( *on_up )( void *ctx );
+	void *ctx;
+};
+
+struct link_coordinator_stats
+{
+	uint32_t downs;
+	uint32_t flaps;	  // Back within the grace period, connections not aborted
+	uint32_t aborted;  // TCP connections aborted
+	uint32_t last_outage_ms;  // Link down to link up
+	uint32_t last_address_ms;  // Link up to the address being (re)acquired
+};
+
+struct link_client_stats
+{
+	uint32_t resumes;
+	uint32_t last_resume_ms;  // Link up to the client's first traffic after it
+	uint32_t max_resume_ms;
+};
+
+/** Starts watching the link, call once the interface is up */
+esp_err_t link_coordinator_start( void );
+
+/** Returns the client's id, < 0 when every slot is taken. client is copied. */
+int link_coordinator_register( const struct link_client *const client );
+
+/** Reports traffic flowing again for the client, timing its recovery if one is pending. Cheap otherwise. */
+void link_coordinator_resumed( const int id );
+
+void link_coordinator_get_stats( struct link_coordinator_stats *const out );
+void link_coordinator_get_client_stats( const int id, struct link_client_stats *const out );
@@ -0,0 +1,249 @@
+
+#include "link_coordinator.h"
+
+#include "esp_eth.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "lwip/ip_addr.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/tcpip.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef CONFIG_LINK_COORDINATOR
+
+struct slot
+{
+	struct link_client client;
+	bool used;
+	bool waiting;  // Notified of the link coming back, has not reported traffic since
+	struct link_client_stats stats;
+};
+
+static const char *TAG = "link_coordinator";
+
+static struct slot slots[ CONFIG_LINK_COORDINATOR_MAX_CLIENTS ];
+static struct link_coordinator_stats stats;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;	 // slots, stats and the state below
+
+static esp_timer_handle_t grace_timer;
+static bool link_up;
+static bool failed;	 // The last loss outlasted the grace period and clients were told
+static bool lost;	 // Link or address gone since the last address, clients reconnect once one is back
+static int64_t down_at;
+static int64_t up_at;
+static uint32_t address;  // Last one the interface got, network order
+
+#ifdef CONFIG_LINK_COORDINATOR_ABORT_TCP
+/**
+ * Runs in the tcpip thread. Aborting calls each connection's error callback, so a socket blocked in recv() or send()
+ * returns ECONNABORTED right away. Listeners are not bound to the lost address and stay.
+ */
+static void abort_tcp( void *ctx )
+{
+	const ip_addr_t old = IPADDR4_INIT( ( uint32_t )( uintptr_t )ctx );
+	uint32_t n = 0;
+
+	for ( const struct tcp_pcb *pcb = tcp_active_pcbs; pcb; pcb = pcb->next )
+		n += ip_addr_cmp( &pcb->local_ip, &old );
+	tcp_netif_ip_addr_changed( &old, NULL );
+
+	portENTER_CRITICAL( &mux );
+	stats.aborted += n;
+	portEXIT_CRITICAL( &mux );
+	if ( n )
+		ESP_LOGI( TAG, "aborted %" PRIu32 " TCP connections", n );
+}
+#endif
+
+/** The link stayed down past the grace period */
+static void grace_expired( void *arg )
+{
+	portENTER_CRITICAL( &mux );
+	const bool down = !link_up;
+	const uint32_t lost = address;
+	failed |= down;
+	portEXIT_CRITICAL( &mux );
+	if ( !down )
+		return;
+
+#ifdef CONFIG_LINK_COORDINATOR_ABORT_TCP
+	if ( lost && tcpip_callback( abort_tcp, ( void * )( uintptr_t )lost ) != ERR_OK )
+		ESP_LOGW( TAG, "could not queue the TCP abort" );
+#endif
+	for ( size_t i = 0; i < CONFIG_LINK_COORDINATOR_MAX_CLIENTS; ++i )
+		if ( slots[ i ].used && slots[ i ].client.on_down )
+			slots[ i ].client.on_down( slots[ i ].client.ctx );
+}
+
+static void eth_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
+{
+	const int64_t now = esp_timer_get_time();
+	bool was_up;
+
+	switch ( event_id )
+	{
+		case ETHERNET_EVENT_DISCONNECTED:
+			portENTER_CRITICAL( &mux );
+			was_up = link_up;
+			link_up = false;
+			if ( was_up )
+			{
+				down_at = now;
+				lost = true;
+				++stats.downs;
+			}
+			portEXIT_CRITICAL( &mux );
+			if ( was_up )
+			{
+				esp_timer_stop( grace_timer );
+				esp_timer_start_once( grace_timer, CONFIG_LINK_COORDINATOR_GRACE_MS * 1000ULL );
+			}
+			break;
+		case ETHERNET_EVENT_CONNECTED:
+			esp_timer_stop( grace_timer );
+			portENTER_CRITICAL( &mux );
+			link_up = true;
+			up_at = now;
+			if ( down_at )
+			{
+				stats.last_outage_ms = ( now - down_at ) / 1000;
+				if ( !failed )
+					++stats.flaps;
+			}
+			portEXIT_CRITICAL( &mux );
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+ * Any loss counts, not only one past the grace period: with DHCP the address goes at link down and lwIP aborts the
+ * connections on it however short the flap, and their clients would otherwise sit out their backoff
+ */
+static void got_ip_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
+{
+	const ip_event_got_ip_t *const event = event_data;
+	const int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL( &mux );
+	address = event->ip_info.ip.addr;
+	const bool recover = lost && link_up;
+	if ( recover )
+	{
+		lost = false;
+		failed = false;
+		stats.last_address_ms = ( now - up_at ) / 1000;
+		for ( size_t i = 0; i < CONFIG_LINK_COORDINATOR_MAX_CLIENTS; ++i )
+			slots[ i ].waiting = slots[ i ].used;
+	}
+	const struct link_coordinator_stats s = stats;
+	portEXIT_CRITICAL( &mux );
+	if ( !recover )
+		return;
+
+	ESP_LOGI(
+		TAG,
+		"link back after %" PRIu32 " ms down, address in %" PRIu32 " ms",
+		s.last_outage_ms,
+		s.last_address_ms );
+	// Straight to reconnecting, whatever backoff the clients were sitting in. Ones whose connection lived through a
+	// flap on a static address find it still up.
+	for ( size_t i = 0; i < CONFIG_LINK_COORDINATOR_MAX_CLIENTS; ++i )
+		if ( slots[ i ].used && slots[ i ].client.on_up )
+			slots[ i ].client.on_up( slots[ i ].client.ctx );
+}
+
+static void lost_ip_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
+{
+	portENTER_CRITICAL( &mux );
+	lost = true;
+	portEXIT_CRITICAL( &mux );
+}
+
+esp_err_t link_coordinator_start( void )
+{
+	esp_err_t err;
+
+	if ( grace_timer )
+		return ESP_ERR_INVALID_STATE;
+	if ( ( err = esp_timer_create(
+			   &( const esp_timer_create_args_t ) { .callback = grace_expired, .name = "link_grace" }, &grace_timer ) )
+			 != ESP_OK
+		 || ( err = esp_event_handler_register( ETH_EVENT, ESP_EVENT_ANY_ID, eth_event_handler, NULL ) ) != ESP_OK
+		 || ( err = esp_event_handler_register( IP_EVENT, IP_EVENT_ETH_GOT_IP, got_ip_event_handler, NULL ) )
+				!= ESP_OK
+		 || ( err = esp_event_handler_register( IP_EVENT, IP_EVENT_ETH_LOST_IP, lost_ip_event_handler, NULL ) )
+				!= ESP_OK )
+		ESP_LOGE( TAG, "start failed: %s", esp_err_to_name( err ) );
+	return err;
+}
+
+int link_coordinator_register( const struct link_client *const client )
+{
+	int id = -1;
+
+	if ( !client )
+		return -1;
+	portENTER_CRITICAL( &mux );
+	for ( size_t i = 0; i < CONFIG_LINK_COORDINATOR_MAX_CLIENTS && id < 0; ++i )
+		if ( !slots[ i ].used )
+		{
+			slots[ i ] = ( struct slot ) { .client = *client, .used = true };
+			id = i;
+		}
+	portEXIT_CRITICAL( &mux );
+	if ( id < 0 )
+		ESP_LOGW( TAG, "no slot for %s", client->name );
+	return id;
+}
+
+void link_coordinator_resumed( const int id )
+{
+	struct link_client_stats *s;
+	uint32_t ms = 0;
+	bool timed = false;
+
+	if ( id < 0 || id >= CONFIG_LINK_COORDINATOR_MAX_CLIENTS )
+		return;
+	portENTER_CRITICAL( &mux );
+	s = &slots[ id ].stats;
+	if ( slots[ id ].waiting )
+	{
+		slots[ id ].waiting = false;
+		timed = true;
+		ms = ( esp_timer_get_time() - up_at ) / 1000;
+		++s->resumes;
+		s->last_resume_ms = ms;
+		if ( ms > s->max_resume_ms )
+			s->max_resume_ms = ms;
+	}
+	portEXIT_CRITICAL( &mux );
+	if ( timed )
+		ESP_LOGI( TAG, "%s resumed %" PRIu32 " ms after link up", slots[ id ].client.name, ms );
+}
+
+void link_coordinator_get_stats( struct link_coordinator_stats *const out )
+{
+	portENTER_CRITICAL( &mux );
+	*out = stats;
+	portEXIT_CRITICAL( &mux );
+}
+
+void link_coordinator_get_client_stats( const int id, struct link_client_stats *const out )
+{
+	*out = ( struct link_client_stats ) { 0 };
+	if ( id < 0 || id >= CONFIG_LINK_COORDINATOR_MAX_CLIENTS )
+		return;
+	portENTER_CRITICAL( &mux );
+	*out = slots[ id ].stats;
+	portEXIT_CRITICAL( &mux );
+}
+
+#endif
@@ -0,0 +1,64 @@
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum mem_budget_subsys
+{
+	MEM_BUDGET_OTHER,
+	MEM_BUDGET_W5100,
+	MEM_BUDGET_LWIP,
+	MEM_BUDGET_TLS,
+	MEM_BUDGET_HTTP,
+	MEM_BUDGET_MQTT,
+	MEM_BUDGET_APP,
+	MEM_BUDGET_MAX
+};
+
+struct mem_budget_usage
+{
+	uint32_t current;  // Bytes
+	uint32_t peak;
+	uint32_t allocs;
+	uint32_t frees;
+};
+
+#ifdef CONFIG_MEM_BUDGET
+
+/** Charges task's allocations to s from now on, NULL for the calling task */
+void mem_budget_tag_task( TaskHandle_t task, const enum mem_budget_subsys s );
+
+/** Charges the calling task's allocations to s until mem_budget_pop() is given what this returned */
+int mem_budget_push( const enum mem_budget_subsys s );
+void mem_budget_pop( const int prev );
+
+/** Brackets code that must not allocate, nestable */
+void mem_budget_hot_begin( void );
+void mem_budget_hot_end( void );
+
+/** Records every subsystem's current usage under label, which must outlive it (a literal) */
+void mem_budget_snapshot( const char *const label );
+
+void mem_budget_get( const enum mem_budget_subsys s, struct mem_budget_usage *const out );
+
+/** Logs usage, snapshots and hot path allocations as a table */
+void mem_budget_dump( void );
+
+#define MEM_BUDGET_HOT_BEGIN()		 mem_budget_hot_begin()
+#define MEM_BUDGET_HOT_END()		 mem_budget_hot_end()
+#define MEM_BUDGET_SNAPSHOT( label ) mem_budget_snapshot( label )
+#define MEM_BUDGET_TAG( s )			 mem_budget_tag_task( NULL, s )
+
+#else
+
+#define MEM_BUDGET_HOT_BEGIN()
+#define MEM_BUDGET_HOT_END()
+#define MEM_BUDGET_SNAPSHOT( label )
+#define MEM_BUDGET_TAG( s )
+
+#endif
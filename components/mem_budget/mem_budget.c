@@ -0,0 +1,389 @@
+
+#include "mem_budget.h"
+
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef CONFIG_MEM_BUDGET
+
+#define TRACKED		CONFIG_MEM_BUDGET_TRACKED
+#define TRACKED_MAX ( TRACKED - TRACKED / 8 )  // Keeps probe sequences short
+#define SIZE_LIMIT	0xffffff				   // What fits in struct tracked
+#define SNAPSHOTS	CONFIG_MEM_BUDGET_SNAPSHOTS
+#define NO_OVERRIDE 0xff
+
+/* The heap calls these on every allocation and free with CONFIG_HEAP_USE_HOOKS */
+void esp_heap_trace_alloc_hook( void *ptr, size_t size, uint32_t caps );
+void esp_heap_trace_free_hook( void *ptr );
+
+/* The W5100 driver's weak hooks around its RX and TX paths, it knows nothing of us otherwise */
+void w5100_hot_begin( void );
+void w5100_hot_end( void );
+
+struct tracked
+{
+	uint32_t ptr;  // 0 when the entry is empty
+	uint32_t size : 24;
+	uint32_t subsys : 8;
+};
+
+struct task_tag
+{
+	TaskHandle_t task;
+	char name[ configMAX_TASK_NAME_LEN ];  // A TCB freed and handed to a new task keeps its address, not its name
+	uint8_t subsys;
+	uint8_t override;  // Set by mem_budget_push(), NO_OVERRIDE otherwise
+	uint8_t hot;	   // Nesting depth of mem_budget_hot_begin()
+};
+
+struct snapshot
+{
+	const char *label;
+	uint32_t free_heap;
+	uint32_t current[ MEM_BUDGET_MAX ];
+};
+
+struct hot_allocs
+{
+	uint32_t count;
+	uint32_t last_size;
+	char last_task[ configMAX_TASK_NAME_LEN ];
+};
+
+/** Task name prefixes and whom their allocations are charged to, first match wins */
+static const struct
+{
+	const char *prefix;
+	uint8_t subsys;
+} rules[] = {
+	{ "w5100", MEM_BUDGET_W5100 },
+	{ "tiT", MEM_BUDGET_LWIP },	 // The tcpip thread
+	{ "dns_", MEM_BUDGET_LWIP },
+	{ "mqtt", MEM_BUDGET_MQTT },  // esp-mqtt's task and the batcher's
+	{ "soak_mqtt", MEM_BUDGET_MQTT },
+	{ "telemetry", MEM_BUDGET_MQTT },
+	{ "http", MEM_BUDGET_HTTP },
+	{ "soak_http", MEM_BUDGET_HTTP },
+	{ "ota_", MEM_BUDGET_HTTP },
+	{ "tasklol", MEM_BUDGET_APP },
+};
+
+static const char *const names[ MEM_BUDGET_MAX ] = { "other", "w5100", "lwip", "tls", "http", "mqtt", "app" };
+
+static const char *TAG = "mem_budget";
+
+// All under mux, which the hooks take from inside the heap: nothing below may allocate or log while holding it
+static struct tracked table[ TRACKED ];
+static uint32_t tracked;
+static uint32_t untracked;
+static struct task_tag tasks[ CONFIG_MEM_BUDGET_TASKS ];
+static uint32_t next_task;	// Replaced next once tasks is full
+static struct mem_budget_usage usage[ MEM_BUDGET_MAX ];
+static struct snapshot snapshots[ SNAPSHOTS ];
+static uint32_t n_snapshots;
+static struct hot_allocs hot;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t classify( const char *const name )
+{
+	for ( size_t i = 0; i < sizeof( rules ) / sizeof( rules[ 0 ] ); ++i )
+		if ( !strncmp( name, rules[ i ].prefix, strlen( rules[ i ].prefix ) ) )
+			return rules[ i ].subsys;
+	return MEM_BUDGET_OTHER;
+}
+
+static void tag_init( struct task_tag *const t, TaskHandle_t task, const char *const name )
+{
+	*t = ( struct task_tag ) { .task = task, .subsys = classify( name ), .override = NO_OVERRIDE };
+	strncpy( t->name, name, sizeof( t->name ) - 1 );
+}
+
+/** task's entry, made from its name the first time it is seen or when a new task has taken over its TCB */
+static struct task_tag *tag_of( TaskHandle_t task )
+{
+	const char *const name = pcTaskGetName( task );
+	struct task_tag *empty = NULL;
+
+	for ( size_t i = 0; i < CONFIG_MEM_BUDGET_TASKS; ++i )
+		if ( tasks[ i ].task == task )
+		{
+			if ( strncmp( tasks[ i ].name, name, sizeof( tasks[ i ].name ) ) )
+				tag_init( &tasks[ i ], task, name );
+			return &tasks[ i ];
+		}
+		else if ( !tasks[ i ].task && !empty )
+			empty = &tasks[ i ];
+
+	// Full, likely with tasks long deleted; a live one losing its tag falls back to its name
+	struct task_tag *const t = empty ? empty : &tasks[ next_task++ % CONFIG_MEM_BUDGET_TASKS ];
+	tag_init( t, task, name );
+	return t;
+}
+
+/** The calling task's entry, NULL before the scheduler runs */
+static struct task_tag *current( void )
+{
+	TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+	return self ? tag_of( self ) : NULL;
+}
+
+static size_t home( const uint32_t ptr )
+{
+	return ( ptr >> 2 ) * 2654435761u % TRACKED;
+}
+
+static struct tracked *find( const uint32_t ptr )
+{
+	for ( size_t i = home( ptr ), n = 0; n < TRACKED && table[ i ].ptr; i = ( i + 1 ) % TRACKED, ++n )
+		if ( table[ i ].ptr == ptr )
+			return &table[ i ];
+	return NULL;
+}
+
+/** Linear probing with backward shift deletion, so lookups never wade through tombstones */
+static void uncharge( struct tracked *const e )
+{
+	size_t i = e - table;
+	size_t j = i;
+
+	--tracked;
+	usage[ e->subsys ].current -= e->size;
+	++usage[ e->subsys ].frees;
+	for ( ;; )
+	{
+		table[ i ].ptr = 0;
+		for ( ;; )
+		{
+			j = ( j + 1 ) % TRACKED;
+			if ( !table[ j ].ptr )
+				return;
+			// The entry at j may fill the hole at i unless its home lies cyclically in ( i, j ]
+			const size_t h = home( table[ j ].ptr );
+			if ( i <= j ? h <= i || h > j : h <= i && h > j )
+				break;
+		}
+		table[ i ] = table[ j ];
+		i = j;
+	}
+}
+
+static void charge( const uint32_t ptr, const size_t size, const uint8_t s )
+{
+	size_t i = home( ptr );
+
+	while ( table[ i ].ptr )
+		i = ( i + 1 ) % TRACKED;
+	table[ i ] = ( struct tracked ) { .ptr = ptr, .size = size, .subsys = s };
+	++tracked;
+	usage[ s ].current += size;
+	++usage[ s ].allocs;
+	if ( usage[ s ].current > usage[ s ].peak )
+		usage[ s ].peak = usage[ s ].current;
+}
+
+void esp_heap_trace_alloc_hook( void *ptr, size_t size, uint32_t caps )
+{
+	uint32_t hot_count = 0;
+
+	if ( !ptr )
+		return;
+
+	portENTER_CRITICAL( &mux );
+	const struct task_tag *const t = current();
+	const uint8_t s = !t ? MEM_BUDGET_OTHER : t->override != NO_OVERRIDE ? t->override : t->subsys;
+	if ( t && t->hot )
+	{
+		hot_count = ++hot.count;
+		hot.last_size = size;
+		strncpy( hot.last_task, pcTaskGetName( t->task ), sizeof( hot.last_task ) - 1 );
+	}
+	// realloc() in place reports the same pointer again
+	struct tracked *const e = find( ( uintptr_t )ptr );
+	if ( e )
+		uncharge( e );
+	if ( tracked < TRACKED_MAX && size <= SIZE_LIMIT )
+		charge( ( uintptr_t )ptr, size, s );
+	else
+		++untracked;
+	portEXIT_CRITICAL( &mux );
+
+	// From the ROM, which does not allocate; only the 1st, 2nd, 4th, ... to keep the hot path from drowning in it
+	if ( hot_count && !( hot_count & ( hot_count - 1 ) ) )
+		ESP_DRAM_LOGW(
+			DRAM_STR( "mem_budget" ),
+			"%u bytes allocated on the hot path (%" PRIu32 " so far)",
+			( unsigned )size,
+			hot_count );
+}
+
+void esp_heap_trace_free_hook( void *ptr )
+{
+	if ( !ptr )
+		return;
+
+	portENTER_CRITICAL( &mux );
+	struct tracked *const e = find( ( uintptr_t )ptr );
+	if ( e )
+		uncharge( e );
+	portEXIT_CRITICAL( &mux );
+}
+
+void mem_budget_tag_task( TaskHandle_t task, const enum mem_budget_subsys s )
+{
+	if ( s >= MEM_BUDGET_MAX )
+		return;
+	if ( !task )
+		task = xTaskGetCurrentTaskHandle();
+
+	portENTER_CRITICAL( &mux );
+	tag_of( task )->subsys = s;
+	portEXIT_CRITICAL( &mux );
+}
+
+int mem_budget_push( const enum mem_budget_subsys s )
+{
+	int prev = NO_OVERRIDE;
+
+	portENTER_CRITICAL( &mux );
+	struct task_tag *const t = current();
+	if ( t && s < MEM_BUDGET_MAX )
+	{
+		prev = t->override;
+		t->override = s;
+	}
+	portEXIT_CRITICAL( &mux );
+	return prev;
+}
+
+void mem_budget_pop( const int prev )
+{
+	portENTER_CRITICAL( &mux );
+	struct task_tag *const t = current();
+	if ( t )
+		t->override = prev;
+	portEXIT_CRITICAL( &mux );
+}
+
+void mem_budget_hot_begin( void )
+{
+	portENTER_CRITICAL( &mux );
+	struct task_tag *const t = current();
+	if ( t )
+		++t->hot;
+	portEXIT_CRITICAL( &mux );
+}
+
+void mem_budget_hot_end( void )
+{
+	portENTER_CRITICAL( &mux );
+	struct task_tag *const t = current();
+	if ( t && t->hot )
+		--t->hot;
+	portEXIT_CRITICAL( &mux );
+}
+
+void w5100_hot_begin( void )
+{
+	mem_budget_hot_begin();
+}
+
+void w5100_hot_end( void )
+{
+	mem_budget_hot_end();
+}
+
+void mem_budget_snapshot( const char *const label )
+{
+	// Takes the heap's own lock, so not under mux
+	const uint32_t free_heap = heap_caps_get_free_size( MALLOC_CAP_DEFAULT );
+
+	portENTER_CRITICAL( &mux );
+	// Once full, the last one is overwritten
+	struct snapshot *const snap = &snapshots[ n_snapshots < SNAPSHOTS ? n_snapshots++ : SNAPSHOTS - 1 ];
+	snap->label = label;
+	snap->free_heap = free_heap;
+	for ( size_t i = 0; i < MEM_BUDGET_MAX; ++i )
+		snap->current[ i ] = usage[ i ].current;
+	portEXIT_CRITICAL( &mux );
+}
+
+void mem_budget_get( const enum mem_budget_subsys s, struct mem_budget_usage *const out )
+{
+	*out = ( struct mem_budget_usage ) { 0 };
+	if ( s >= MEM_BUDGET_MAX )
+		return;
+	portENTER_CRITICAL( &mux );
+	*out = usage[ s ];
+	portEXIT_CRITICAL( &mux );
+}
+
+void mem_budget_dump( void )
+{
+	struct mem_budget_usage u[ MEM_BUDGET_MAX ];
+	struct snapshot snaps[ SNAPSHOTS ];
+	struct hot_allocs h;
+	uint32_t n, n_tracked, n_untracked;
+	char line[ 64 + SNAPSHOTS * 11 ];
+	int len;
+
+	portENTER_CRITICAL( &mux );
+	memcpy( u, usage, sizeof( u ) );
+	memcpy( snaps, snapshots, sizeof( snaps ) );
+	n = n_snapshots;
+	h = hot;
+	n_tracked = tracked;
+	n_untracked = untracked;
+	portEXIT_CRITICAL( &mux );
+
+	len = snprintf( line, sizeof( line ), "%-9s %9s %9s %8s %8s", "subsys", "current", "peak", "allocs", "frees" );
+	for ( size_t k = 0; k < n; ++k )
+		len += snprintf( line + len, sizeof( line ) - len, " %10.10s", snaps[ k ].label );
+	ESP_LOGI( TAG, "%s", line );
+
+	for ( size_t i = 0; i < MEM_BUDGET_MAX; ++i )
+	{
+		len = snprintf(
+			line,
+			sizeof( line ),
+			"%-9s %9" PRIu32 " %9" PRIu32 " %8" PRIu32 " %8" PRIu32,
+			names[ i ],
+			u[ i ].current,
+			u[ i ].peak,
+			u[ i ].allocs,
+			u[ i ].frees );
+		for ( size_t k = 0; k < n; ++k )
+			len += snprintf( line + len, sizeof( line ) - len, " %10" PRIu32, snaps[ k ].current[ i ] );
+		ESP_LOGI( TAG, "%s", line );
+	}
+
+	len = snprintf(
+		line,
+		sizeof( line ),
+		"%-9s %9" PRIu32 " %9s %8s %8s",
+		"free",
+		( uint32_t )heap_caps_get_free_size( MALLOC_CAP_DEFAULT ),
+		"",
+		"",
+		"" );
+	for ( size_t k = 0; k < n; ++k )
+		len += snprintf( line + len, sizeof( line ) - len, " %10" PRIu32, snaps[ k ].free_heap );
+	ESP_LOGI( TAG, "%s", line );
+
+	ESP_LOGI( TAG, "%" PRIu32 " allocations live, %" PRIu32 " not tracked", n_tracked, n_untracked );
+	if ( h.count )
+		ESP_LOGW(
+			TAG,
+			"%" PRIu32 " allocations on the hot path, the last %" PRIu32 " bytes by %s",
+			h.count,
+			h.last_size,
+			h.last_task );
+}
+
+#endif
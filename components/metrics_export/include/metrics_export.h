@@ -0,0 +1,39 @@
+
+#pragma once
+
+#include "esp_err.h"
+
+#include <stdint.h>
+
+enum metrics_kind
+{
+	METRICS_COUNTER,  // Only grows, wrapping at 2^32
+	METRICS_GAUGE,
+};
+
+/** Called from the exporter's task every interval, must not block for long */
+typedef uint32_t ( *metrics_read_t )( void *ctx );
+
+struct metrics_export_stats
+{
+	uint32_t datagrams;
+	uint32_t failed;   // Collector not resolved or sendto() failed
+	uint32_t skipped;  // Metrics left out of a datagram for lack of room
+	uint32_t last_bytes;
+	uint32_t max_bytes;
+	uint64_t bytes;
+	uint32_t last_sample_us;  // Reading and encoding every metric
+	uint32_t max_sample_us;
+};
+
+/** Registers a metric, also once the exporter runs. name must outlive it (a literal) */
+esp_err_t metrics_export_register(
+	const char *const name,
+	const enum metrics_kind kind,
+	metrics_read_t read,
+	void *ctx );
+
+/** Registers the built-in metrics and starts sending to CONFIG_METRICS_EXPORT_HOST */
+esp_err_t metrics_export_start( void );
+
+void metrics_export_get_stats( struct metrics_export_stats *const out );
@@ -0,0 +1,357 @@
+
+#include "metrics_export.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "eth-w5100-spi.h"
+#include "eth-w5100-txsched.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "lwip/stats.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <netdb.h>
+
+#ifdef CONFIG_METRICS_EXPORT
+
+#define STR_( x )	  #x
+#define STR( x )	  STR_( x )
+#define MAX_METRICS	  CONFIG_METRICS_EXPORT_MAX_METRICS
+#define DATAGRAM_SIZE CONFIG_METRICS_EXPORT_DATAGRAM_SIZE
+#define NAME_MAX	  48
+#define TASK_STACK	  4096
+
+/* TLV header: magic, version, seq and uptime in ms, all big endian */
+#define TLV_MAGIC_0	   'M'
+#define TLV_MAGIC_1	   'X'
+#define TLV_VERSION	   1
+#define TLV_COUNTER	   1
+#define TLV_GAUGE	   2
+#define TLV_VALUE_SIZE 4
+
+struct metric
+{
+	const char *name;
+	enum metrics_kind kind;
+	metrics_read_t read;
+	void *ctx;
+	uint32_t last;	// Value in the last datagram it made it into, for counter deltas
+};
+
+static const char *TAG = "metrics_export";
+
+// Entries are filled before n_metrics covers them and never change after, but for last, which only the task touches
+static struct metric metrics[ MAX_METRICS ];
+static size_t n_metrics;
+static struct metrics_export_stats stats;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;	// n_metrics and stats
+static TaskHandle_t task;
+
+#ifdef CONFIG_METRICS_EXPORT_FORMAT_TLV
+static uint8_t *put_u32( uint8_t *p, const uint32_t v )
+{
+	*p++ = v >> 24;
+	*p++ = v >> 16;
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+static size_t header( uint8_t *const buf, const uint32_t seq )
+{
+	uint8_t *p = buf;
+
+	*p++ = TLV_MAGIC_0;
+	*p++ = TLV_MAGIC_1;
+	*p++ = TLV_VERSION;
+	*p++ = 0;  // Reserved
+	p = put_u32( p, seq );
+	p = put_u32( p, esp_timer_get_time() / 1000 );
+	return p - buf;
+}
+
+/** Bytes taken at buf, 0 if the record does not fit in room */
+static size_t record( uint8_t *const buf, const size_t room, const struct metric *const m, const uint32_t value )
+{
+	const size_t name_len = strlen( m->name );
+	const size_t len = 2 + name_len + TLV_VALUE_SIZE;
+
+	if ( len > room )
+		return 0;
+	buf[ 0 ] = m->kind == METRICS_COUNTER ? TLV_COUNTER : TLV_GAUGE;
+	buf[ 1 ] = name_len + TLV_VALUE_SIZE;
+	memcpy( buf + 2, m->name, name_len );
+	put_u32( buf + 2 + name_len, value );
+	return len;
+}
+#else
+static size_t header( uint8_t *const buf, const uint32_t seq )
+{
+	return 0;
+}
+
+static size_t record( uint8_t *const buf, const size_t room, const struct metric *const m, const uint32_t value )
+{
+	const char *const prefix = CONFIG_METRICS_EXPORT_PREFIX;
+	const int len = snprintf(
+		( char * )buf,
+		room,
+		"%s%s%s:%" PRIu32 "|%c\n",
+		prefix,
+		*prefix ? "." : "",
+		m->name,
+		value,
+		m->kind == METRICS_COUNTER ? 'c' : 'g' );
+
+	return len > 0 && ( size_t )len < room ? len : 0;
+}
+#endif
+
+/** Reads every metric into buf, returns the datagram's length */
+static size_t encode( uint8_t *const buf, const uint32_t seq, uint32_t *const skipped )
+{
+	size_t len = header( buf, seq );
+
+	portENTER_CRITICAL( &mux );
+	const size_t n = n_metrics;
+	portEXIT_CRITICAL( &mux );
+
+	for ( size_t i = 0; i < n; ++i )
+	{
+		struct metric *const m = &metrics[ i ];
+		const uint32_t now = m->read( m->ctx );
+#ifdef CONFIG_METRICS_EXPORT_FORMAT_TLV
+		const uint32_t value = now;
+#else
+		// statsd adds up counter values, so each is the change since the last one sent
+		const uint32_t value = m->kind == METRICS_COUNTER ? now - m->last : now;
+#endif
+		const size_t taken = record( buf + len, DATAGRAM_SIZE - len, m, value );
+		if ( !taken )
+		{
+			// A counter left out keeps its last, its change goes in the next datagram with room
+			++*skipped;
+			continue;
+		}
+		len += taken;
+		m->last = now;
+	}
+	return len;
+}
+
+static void export_task( void *arg )
+{
+	const struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+	static uint8_t datagram[ DATAGRAM_SIZE ];
+	struct addrinfo *res = NULL;
+	TickType_t wake = xTaskGetTickCount();
+	const int sock = socket( AF_INET, SOCK_DGRAM, 0 );
+
+	if ( sock < 0 )
+	{
+		ESP_LOGE( TAG, "no socket" );
+		task = NULL;
+		vTaskDelete( NULL );
+	}
+
+	for ( uint32_t seq = 0;; ++seq )
+	{
+		vTaskDelayUntil( &wake, pdMS_TO_TICKS( CONFIG_METRICS_EXPORT_INTERVAL_MS ) );
+
+		uint32_t skipped = 0;
+		const int64_t start = esp_timer_get_time();
+		const size_t len = encode( datagram, seq, &skipped );
+		const uint32_t us = esp_timer_get_time() - start;
+
+		// Resolved again after a failure, in case the collector moved
+		if ( !res
+			 && ( getaddrinfo( CONFIG_METRICS_EXPORT_HOST, STR( CONFIG_METRICS_EXPORT_PORT ), &hints, &res ) || !res ) )
+			res = NULL;
+		const bool sent = res && sendto( sock, datagram, len, 0, res->ai_addr, res->ai_addrlen ) == ( ssize_t )len;
+		if ( !sent && res )
+		{
+			freeaddrinfo( res );
+			res = NULL;
+		}
+
+		portENTER_CRITICAL( &mux );
+		stats.skipped += skipped;
+		stats.last_sample_us = us;
+		if ( us > stats.max_sample_us )
+			stats.max_sample_us = us;
+		if ( sent )
+		{
+			++stats.datagrams;
+			stats.bytes += len;
+			stats.last_bytes = len;
+			if ( len > stats.max_bytes )
+				stats.max_bytes = len;
+		}
+		else
+			++stats.failed;
+		portEXIT_CRITICAL( &mux );
+	}
+}
+
+static uint32_t read_heap_free( void *ctx )
+{
+	return heap_caps_get_free_size( MALLOC_CAP_DEFAULT );
+}
+
+static uint32_t read_heap_min( void *ctx )
+{
+	return heap_caps_get_minimum_free_size( MALLOC_CAP_DEFAULT );
+}
+
+#if CONFIG_LWIP_STATS
+static uint32_t read_rx_frames( void *ctx )
+{
+	return lwip_stats.link.recv;
+}
+
+static uint32_t read_tx_frames( void *ctx )
+{
+	return lwip_stats.link.xmit;
+}
+#endif
+
+/** Everything dropped on the way in or out, as the soak test counts it */
+static uint32_t read_drops( void *ctx )
+{
+	uint32_t n = 0;
+#if CONFIG_LWIP_STATS
+	n += lwip_stats.link.drop + lwip_stats.link.memerr + lwip_stats.ip.drop;
+#endif
+#ifdef CONFIG_W5100_TX_SCHEDULER
+	struct w5100_txq_stats txq[ W5100_TXQ_MAX ];
+	w5100_txsched_get_stats( txq );
+	for ( int q = 0; q < W5100_TXQ_MAX; ++q )
+		n += txq[ q ].dropped;
+#endif
+	return n;
+}
+
+#ifdef CONFIG_W5100_TX_SCHEDULER
+static uint32_t read_txq_depth( void *ctx )
+{
+	struct w5100_txq_stats txq[ W5100_TXQ_MAX ];
+	uint32_t n = 0;
+
+	w5100_txsched_get_stats( txq );
+	for ( int q = 0; q < W5100_TXQ_MAX; ++q )
+		n += txq[ q ].depth;
+	return n;
+}
+#endif
+
+#ifdef CONFIG_W5100_LL_LOCK_STATS
+static uint32_t read_lock_contended( void *ctx )
+{
+	struct w5100_ll_lock_stats s;
+
+	w5100_ll_get_lock_stats( &s );
+	return s.contended;
+}
+
+static uint32_t read_lock_wait_us( void *ctx )
+{
+	struct w5100_ll_lock_stats s;
+
+	w5100_ll_get_lock_stats( &s );
+	return s.wait_us;
+}
+#endif
+
+/** The exporter's own cost, as of the previous datagram */
+static uint32_t read_own( void *ctx )
+{
+	portENTER_CRITICAL( &mux );
+	const uint32_t v = *( const uint32_t * )ctx;
+	portEXIT_CRITICAL( &mux );
+	return v;
+}
+
+esp_err_t metrics_export_register(
+	const char *const name,
+	const enum metrics_kind kind,
+	metrics_read_t read,
+	void *ctx )
+{
+	esp_err_t err = ESP_OK;
+
+	if ( !name || !read || !*name || strlen( name ) > NAME_MAX )
+		return ESP_ERR_INVALID_ARG;
+
+	portENTER_CRITICAL( &mux );
+	if ( n_metrics < MAX_METRICS )
+	{
+		// Counters start from 0, their first change sent is everything counted so far
+		metrics[ n_metrics ] = ( struct metric ) { .name = name, .kind = kind, .read = read, .ctx = ctx };
+		++n_metrics;
+	}
+	else
+		err = ESP_ERR_NO_MEM;
+	portEXIT_CRITICAL( &mux );
+
+	if ( err != ESP_OK )
+		ESP_LOGW( TAG, "no room for %s", name );
+	return err;
+}
+
+esp_err_t metrics_export_start( void )
+{
+	if ( task )
+		return ESP_ERR_INVALID_STATE;
+	if ( !*CONFIG_METRICS_EXPORT_HOST )
+	{
+		ESP_LOGW( TAG, "no collector host configured" );
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	metrics_export_register( "heap.free", METRICS_GAUGE, read_heap_free, NULL );
+	metrics_export_register( "heap.min", METRICS_GAUGE, read_heap_min, NULL );
+#if CONFIG_LWIP_STATS
+	metrics_export_register( "net.rx_frames", METRICS_COUNTER, read_rx_frames, NULL );
+	metrics_export_register( "net.tx_frames", METRICS_COUNTER, read_tx_frames, NULL );
+#endif
+	metrics_export_register( "net.drops", METRICS_COUNTER, read_drops, NULL );
+#ifdef CONFIG_W5100_TX_SCHEDULER
+	metrics_export_register( "w5100.txq_depth", METRICS_GAUGE, read_txq_depth, NULL );
+#endif
+#ifdef CONFIG_W5100_LL_LOCK_STATS
+	metrics_export_register( "w5100.lock_contended", METRICS_COUNTER, read_lock_contended, NULL );
+	metrics_export_register( "w5100.lock_wait_us", METRICS_COUNTER, read_lock_wait_us, NULL );
+#endif
+	metrics_export_register( "metrics.bytes", METRICS_GAUGE, read_own, &stats.last_bytes );
+	metrics_export_register( "metrics.sample_us", METRICS_GAUGE, read_own, &stats.last_sample_us );
+
+	if ( pdPASS
+		 != xTaskCreate( export_task, "metrics", TASK_STACK, NULL, CONFIG_METRICS_EXPORT_TASK_PRIORITY, &task ) )
+	{
+		ESP_LOGE( TAG, "out of memory" );
+		return ESP_ERR_NO_MEM;
+	}
+	ESP_LOGI(
+		TAG,
+		"%s:%d every %d ms, at most %d bytes",
+		CONFIG_METRICS_EXPORT_HOST,
+		CONFIG_METRICS_EXPORT_PORT,
+		CONFIG_METRICS_EXPORT_INTERVAL_MS,
+		DATAGRAM_SIZE );
+	return ESP_OK;
+}
+
+void metrics_export_get_stats( struct metrics_export_stats *const out )
+{
+	portENTER_CRITICAL( &mux );
+	*out = stats;
+	portEXIT_CRITICAL( &mux );
+}
+
+#endif
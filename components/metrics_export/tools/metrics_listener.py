@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Receives the metrics exporter's datagrams and prints one JSON line per datagram, "METRICS {...}".
+
+Both formats are understood, told apart by the TLV magic. TLV counters arrive as totals and are printed as the change
+since the previous datagram from the same sender, the way statsd counters arrive; sequence gaps are reported as lost.
+"""
+
+import argparse
+import json
+import socket
+import struct
+import time
+
+TLV_MAGIC = b'MX'
+TLV_VERSION = 1
+TLV_HEADER = struct.Struct('>2sBxII')
+KINDS = {1: 'c', 2: 'g'}
+
+
+def decode_statsd(data):
+    metrics = {}
+    for line in data.decode('ascii', 'replace').splitlines():
+        if not line:
+            continue
+        name, _, rest = line.partition(':')
+        value, _, kind = rest.partition('|')
+        metrics[name] = (kind, int(value))
+    return None, None, metrics
+
+
+def decode_tlv(data):
+    magic, version, seq, uptime_ms = TLV_HEADER.unpack_from(data)
+    if magic != TLV_MAGIC or version != TLV_VERSION:
+        raise ValueError('not a version %d datagram' % TLV_VERSION)
+    metrics = {}
+    pos = TLV_HEADER.size
+    while pos < len(data):
+        kind, length = data[pos], data[pos + 1]
+        value = data[pos + 2:pos + 2 + length]
+        if len(value) != length or length < 4:
+            raise ValueError('record at %d truncated' % pos)
+        name = value[:-4].decode('ascii', 'replace')
+        metrics[name] = (KINDS.get(kind, '?'), struct.unpack('>I', value[-4:])[0])
+        pos += 2 + length
+    return seq, uptime_ms, metrics
+
+
+def decode(data):
+    return decode_tlv(data) if data[:2] == TLV_MAGIC else decode_statsd(data)
+
+
+class Sender:
+    """What the previous datagram from one device said, for TLV counter deltas and lost datagrams"""
+
+    def __init__(self):
+        self.seq = None
+        self.totals = {}
+        self.lost = 0
+
+    def update(self, seq, metrics):
+        if seq is None:
+            return {name: value for name, (_, value) in metrics.items()}
+        # A sequence going backwards is a reboot, its totals start over
+        if self.seq is not None and seq > self.seq:
+            self.lost += seq - self.seq - 1
+        elif self.seq is not None:
+            self.totals = {}
+        self.seq = seq
+        out = {}
+        for name, (kind, value) in metrics.items():
+            if kind == 'c':
+                prev = self.totals.get(name)
+                self.totals[name] = value
+                value = (value - prev) & 0xffffffff if prev is not None else None
+            out[name] = value
+        return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--bind', default='0.0.0.0')
+    parser.add_argument('--port', type=int, default=8125)
+    parser.add_argument('--count', type=int, default=0, help='exit after this many datagrams, 0 to run until killed')
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((args.bind, args.port))
+    senders = {}
+    received = 0
+
+    while not args.count or received < args.count:
+        data, addr = sock.recvfrom(2048)
+        received += 1
+        try:
+            seq, uptime_ms, metrics = decode(data)
+        except (ValueError, IndexError, struct.error) as e:
+            print('METRICS ' + json.dumps({'from': addr[0], 'bytes': len(data), 'error': str(e)}), flush=True)
+            continue
+        sender = senders.setdefault(addr[0], Sender())
+        values = sender.update(seq, metrics)
+        line = {'from': addr[0], 'at': round(time.time(), 3), 'bytes': len(data)}
+        if seq is not None:
+            line.update({'seq': seq, 'uptime_ms': uptime_ms, 'lost': sender.lost})
+        line['metrics'] = values
+        print('METRICS ' + json.dumps(line), flush=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,43 @@
+
+#pragma once
+
+#include "esp_err.h"
+#include "mqtt_stream.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct mqtt_batch *mqtt_batch_handle_t;
+
+struct mqtt_batch_stats
+{
+	uint32_t messages;	// Published through the batcher
+	uint32_t batches;
+	uint32_t packets;  // PUBLISH packets sent, fewer than messages when coalescing
+	uint32_t failed;   // Messages in batches that could not be delivered
+	uint32_t writes;   // Transport writes the batches took
+	uint64_t payload_bytes;
+	uint64_t wire_bytes;  // Estimated bytes on the wire, see mqtt_stream_stats
+	uint64_t latency_us_sum;  // Publish call to batch delivered (written, or acknowledged at QoS 1)
+	uint32_t latency_us_max;
+};
+
+/**
+ * Collects small publishes for up to CONFIG_MQTT_BATCH_WINDOW_MS or CONFIG_MQTT_BATCH_MAX_BYTES and sends them through
+ * stream in one write. The stream belongs to the batcher from here on, nothing else may publish on it.
+ */
+mqtt_batch_handle_t mqtt_batch_create( mqtt_stream_handle_t stream, const int qos );
+
+/** Sends whatever is still waiting, then stops */
+void mqtt_batch_destroy( mqtt_batch_handle_t batch );
+
+/**
+ * Copies the message into the current batch and returns. When the batch is full it is sent from the calling task
+ * first, which blocks until delivered. Fails with ESP_ERR_INVALID_SIZE for a message that fits no batch.
+ */
+esp_err_t mqtt_batch_publish( mqtt_batch_handle_t batch, const char *const topic, const void *data, const size_t len );
+
+/** Sends the current batch now, blocking until delivered */
+esp_err_t mqtt_batch_flush( mqtt_batch_handle_t batch );
+
+void mqtt_batch_get_stats( mqtt_batch_handle_t batch, struct mqtt_batch_stats *const out );
@@ -0,0 +1,306 @@
+
+#include "mqtt_batch.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUDGET                                                                                                         \
+	( CONFIG_MQTT_BATCH_MAX_BYTES < CONFIG_MQTT_STREAM_CHUNK_SIZE ? CONFIG_MQTT_BATCH_MAX_BYTES                        \
+																  : CONFIG_MQTT_STREAM_CHUNK_SIZE )
+#define MAX_MSGS	CONFIG_MQTT_BATCH_MAX_MSGS
+#define WINDOW_US	( CONFIG_MQTT_BATCH_WINDOW_MS * 1000LL )
+#define FLUSH_STACK 6144  // Room for a TLS handshake when the stream reconnects
+
+struct entry
+{
+	uint16_t topic;	 // Offsets into the arena, the topic NUL terminated
+	uint16_t data;
+	uint16_t len;
+	int64_t at;
+};
+
+/** One batch, filled by publishers while the previous one is being sent */
+struct staging
+{
+	struct entry entries[ MAX_MSGS ];
+	size_t n;
+	size_t used;	 // Arena bytes
+	size_t encoded;	 // Bytes on the stream once encoded, at most BUDGET
+	uint8_t arena[ BUDGET ];
+};
+
+struct mqtt_batch
+{
+	mqtt_stream_handle_t stream;
+	int qos;
+	SemaphoreHandle_t lock;		  // fill and stats
+	SemaphoreHandle_t send_lock;  // The stream and out, taken before lock
+	SemaphoreHandle_t stopped;
+	TaskHandle_t task;
+	volatile bool stop;
+	struct staging *fill;
+	struct staging *out;
+	struct staging bufs[ 2 ];
+	struct mqtt_stream_msg msgs[ MAX_MSGS ];
+#ifdef CONFIG_MQTT_BATCH_COALESCE
+	uint8_t joined[ BUDGET + MAX_MSGS ];
+#endif
+	struct mqtt_batch_stats stats;
+};
+
+static const char *TAG = "mqtt_batch";
+
+/** PUBLISH packet size, remaining length bytes counted for the largest a batch can hold when it may still grow */
+static size_t packet_size( const size_t topic_len, const size_t len, const int qos, const bool may_grow )
+{
+	const size_t remaining = 2 + topic_len + ( qos ? 2 : 0 ) + len;
+	return 1 + ( may_grow || remaining >= 16384 ? 3 : remaining >= 128 ? 2 : 1 ) + remaining;
+}
+
+#ifdef CONFIG_MQTT_BATCH_COALESCE
+static const struct entry *find_topic( const struct staging *const st, const char *const topic )
+{
+	for ( size_t i = 0; i < st->n; ++i )
+		if ( !strcmp( ( const char * )st->arena + st->entries[ i ].topic, topic ) )
+			return &st->entries[ i ];
+	return NULL;
+}
+
+/** One message per topic, in order of first appearance, payloads joined in publish order */
+static size_t build_msgs( struct mqtt_batch *const b, const struct staging *const st )
+{
+	uint8_t *p = b->joined;
+	size_t count = 0;
+
+	for ( size_t i = 0; i < st->n; ++i )
+	{
+		const uint16_t topic = st->entries[ i ].topic;
+		bool seen = false;
+		for ( size_t k = 0; k < i && !seen; ++k )
+			seen = st->entries[ k ].topic == topic;
+		if ( seen )
+			continue;
+
+		struct mqtt_stream_msg *const m = &b->msgs[ count++ ];
+		*m = ( struct mqtt_stream_msg ) { .topic = ( const char * )st->arena + topic, .data = p };
+		for ( size_t j = i; j < st->n; ++j )
+		{
+			const struct entry *const e = &st->entries[ j ];
+			if ( e->topic != topic )
+				continue;
+			if ( p != m->data )
+				*p++ = CONFIG_MQTT_BATCH_SEPARATOR;
+			memcpy( p, st->arena + e->data, e->len );
+			p += e->len;
+		}
+		m->len = p - ( const uint8_t * )m->data;
+	}
+	return count;
+}
+#else
+static size_t build_msgs( struct mqtt_batch *const b, const struct staging *const st )
+{
+	for ( size_t i = 0; i < st->n; ++i )
+		b->msgs[ i ] = ( struct mqtt_stream_msg ) {
+			.topic = ( const char * )st->arena + st->entries[ i ].topic,
+			.data = st->arena + st->entries[ i ].data,
+			.len = st->entries[ i ].len,
+		};
+	return st->n;
+}
+#endif
+
+esp_err_t mqtt_batch_flush( mqtt_batch_handle_t b )
+{
+	struct mqtt_stream_stats before, after;
+	esp_err_t err = ESP_OK;
+
+	if ( !b )
+		return ESP_ERR_INVALID_ARG;
+
+	xSemaphoreTake( b->send_lock, portMAX_DELAY );
+	xSemaphoreTake( b->lock, portMAX_DELAY );
+	struct staging *const st = b->fill;
+	b->fill = b->out;
+	b->out = st;
+	xSemaphoreGive( b->lock );
+
+	if ( st->n )
+	{
+		const size_t count = build_msgs( b, st );
+		mqtt_stream_get_stats( b->stream, &before );
+		err = mqtt_stream_publish_batch( b->stream, b->msgs, count, b->qos );
+		mqtt_stream_get_stats( b->stream, &after );
+		const int64_t now = esp_timer_get_time();
+
+		xSemaphoreTake( b->lock, portMAX_DELAY );
+		++b->stats.batches;
+		b->stats.packets += count;
+		b->stats.writes += after.writes - before.writes;
+		b->stats.wire_bytes += after.wire_bytes - before.wire_bytes;
+		if ( err != ESP_OK )
+			b->stats.failed += st->n;
+		for ( size_t i = 0; i < st->n; ++i )
+		{
+			const uint32_t us = now - st->entries[ i ].at;
+			b->stats.payload_bytes += st->entries[ i ].len;
+			b->stats.latency_us_sum += us;
+			if ( us > b->stats.latency_us_max )
+				b->stats.latency_us_max = us;
+		}
+		xSemaphoreGive( b->lock );
+
+		if ( err != ESP_OK )
+			ESP_LOGW( TAG, "batch of %u lost: %s", ( unsigned )st->n, esp_err_to_name( err ) );
+		st->n = st->used = st->encoded = 0;
+	}
+	xSemaphoreGive( b->send_lock );
+	return err;
+}
+
+/** Sends a batch once its first message has waited out the window */
+static void flush_task( void *p )
+{
+	struct mqtt_batch *const b = p;
+
+	while ( !b->stop )
+	{
+		TickType_t wait = portMAX_DELAY;
+		bool due = false;
+
+		xSemaphoreTake( b->lock, portMAX_DELAY );
+		if ( b->fill->n )
+		{
+			const int64_t left = b->fill->entries[ 0 ].at + WINDOW_US - esp_timer_get_time();
+			due = left <= 0;
+			// Rounded up to the tick, never 0 or this would spin
+			wait = pdMS_TO_TICKS( left / 1000 ) + 1;
+		}
+		xSemaphoreGive( b->lock );
+
+		if ( due )
+			mqtt_batch_flush( b );
+		else
+			ulTaskNotifyTake( pdTRUE, wait );
+	}
+	mqtt_batch_flush( b );
+	xSemaphoreGive( b->stopped );
+	vTaskDelete( NULL );
+}
+
+esp_err_t mqtt_batch_publish( mqtt_batch_handle_t b, const char *const topic, const void *data, const size_t len )
+{
+	if ( !b || !topic || ( !data && len ) )
+		return ESP_ERR_INVALID_ARG;
+
+	const size_t topic_len = strlen( topic );
+#ifdef CONFIG_MQTT_BATCH_COALESCE
+	const bool may_grow = true;
+#else
+	const bool may_grow = false;
+#endif
+	const size_t alone = packet_size( topic_len, len, b->qos, may_grow );
+	if ( alone > BUDGET )
+		return ESP_ERR_INVALID_SIZE;
+
+	xSemaphoreTake( b->lock, portMAX_DELAY );
+	for ( ;; )
+	{
+		struct staging *const st = b->fill;
+		const struct entry *same = NULL;
+#ifdef CONFIG_MQTT_BATCH_COALESCE
+		same = find_topic( st, topic );
+#endif
+		// Joining a topic already in the batch costs the payload and a separator
+		const size_t cost = same ? len + 1 : alone;
+		const size_t arena = ( same ? 0 : topic_len + 1 ) + len;
+
+		if ( st->n < MAX_MSGS && st->encoded + cost <= BUDGET && st->used + arena <= BUDGET )
+		{
+			struct entry *const e = &st->entries[ st->n++ ];
+			e->at = esp_timer_get_time();
+			if ( same )
+				e->topic = same->topic;
+			else
+			{
+				e->topic = st->used;
+				memcpy( st->arena + st->used, topic, topic_len + 1 );
+				st->used += topic_len + 1;
+			}
+			e->data = st->used;
+			e->len = len;
+			memcpy( st->arena + st->used, data, len );
+			st->used += len;
+			st->encoded += cost;
+			++b->stats.messages;
+			break;
+		}
+
+		// Full, send it from here and try again with the other buffer
+		xSemaphoreGive( b->lock );
+		mqtt_batch_flush( b );
+		xSemaphoreTake( b->lock, portMAX_DELAY );
+	}
+	const bool first = b->fill->n == 1;
+	xSemaphoreGive( b->lock );
+
+	// The window starts with the first message
+	if ( first )
+		xTaskNotifyGive( b->task );
+	return ESP_OK;
+}
+
+mqtt_batch_handle_t mqtt_batch_create( mqtt_stream_handle_t stream, const int qos )
+{
+	struct mqtt_batch *b;
+
+	if ( !stream || qos < 0 || qos > 1 || !( b = calloc( 1, sizeof( *b ) ) ) )
+		return NULL;
+	b->stream = stream;
+	b->qos = qos;
+	b->fill = &b->bufs[ 0 ];
+	b->out = &b->bufs[ 1 ];
+	if ( !( b->lock = xSemaphoreCreateMutex() ) || !( b->send_lock = xSemaphoreCreateMutex() )
+		 || !( b->stopped = xSemaphoreCreateBinary() )
+		 || pdPASS
+				!= xTaskCreate( flush_task, "mqtt_batch", FLUSH_STACK, b, CONFIG_MQTT_BATCH_TASK_PRIORITY, &b->task ) )
+	{
+		ESP_LOGE( TAG, "out of memory" );
+		if ( b->lock )
+			vSemaphoreDelete( b->lock );
+		if ( b->send_lock )
+			vSemaphoreDelete( b->send_lock );
+		if ( b->stopped )
+			vSemaphoreDelete( b->stopped );
+		free( b );
+		return NULL;
+	}
+	return b;
+}
+
+void mqtt_batch_destroy( mqtt_batch_handle_t b )
+{
+	if ( !b )
+		return;
+	b->stop = true;
+	xTaskNotifyGive( b->task );
+	xSemaphoreTake( b->stopped, portMAX_DELAY );
+	vSemaphoreDelete( b->lock );
+	vSemaphoreDelete( b->send_lock );
+	vSemaphoreDelete( b->stopped );
+	free( b );
+}
+
+void mqtt_batch_get_stats( mqtt_batch_handle_t b, struct mqtt_batch_stats *const out )
+{
+	xSemaphoreTake( b->lock, portMAX_DELAY );
+	*out = b->stats;
+	xSemaphoreGive( b->lock );
+}
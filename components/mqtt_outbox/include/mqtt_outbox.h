@@ -0,0 +1,46 @@
+
+#pragma once
+
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct mqtt_outbox_stats
+{
+	uint32_t direct;	 // Published straight away, nothing was queued
+	uint32_t stored;	 // Appended to flash
+	uint32_t drained;	 // Acknowledged (QoS 1) or sent (QoS 0) from flash
+	uint32_t rejected;	 // Log still full after CONFIG_MQTT_OUTBOX_FULL_WAIT_MS
+	uint32_t corrupt;	 // Records skipped at mount for a bad CRC
+	uint32_t erases;
+	uint32_t pending;
+	uint32_t used_bytes;
+	uint32_t capacity_bytes;
+	// Last time the log went from non-empty to empty while connected
+	uint32_t last_drain_msgs;
+	uint64_t last_drain_bytes;
+	uint32_t last_drain_ms;
+};
+
+/**
+ * Mounts the log in CONFIG_MQTT_OUTBOX_PARTITION, replaying whatever a previous boot left unacknowledged, and starts
+ * draining it through client whenever the client is connected.
+ */
+esp_err_t mqtt_outbox_init( esp_mqtt_client_handle_t client );
+
+/**
+ * Publishes directly when connected and nothing is queued, otherwise appends to the log so order is kept. Blocks for up
+ * to CONFIG_MQTT_OUTBOX_FULL_WAIT_MS when the log is full. len is the payload length, 0 is an empty payload.
+ * Not for the client's own event handler, the acknowledgements that free space are delivered by that same task.
+ */
+esp_err_t mqtt_outbox_publish(
+	const char *const topic,
+	const void *const data,
+	const size_t len,
+	const int qos,
+	const bool retain );
+
+void mqtt_outbox_get_stats( struct mqtt_outbox_stats *const stats );
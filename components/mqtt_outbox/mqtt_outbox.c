@@ -0,0 +1,603 @@
+
+#include "mqtt_outbox.h"
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CONFIG_MQTT_OUTBOX
+
+#define SECTOR		  4096
+#define SECTOR_MAGIC  0x424F514D  // "MQOB"
+#define QUEUE_LEN	  ( CONFIG_MQTT_OUTBOX_INFLIGHT + 8 )
+#define DRAIN_STACK	  3072
+#define FLAG_QOS_MASK 0x03
+#define FLAG_RETAIN	  0x04
+
+/*
+ * The partition is a ring of sectors, appended to at the head and released from the tail once every record in a sector
+ * has been acknowledged. A sector is only erased right before it becomes the head again, so each one is erased once
+ * per trip around the ring. Records are committed and retired by clearing bits of their state byte in place.
+ */
+enum rec_state
+{
+	REC_ERASED = 0xFF,	// Header written, data possibly torn
+	REC_VALID = 0x7F,	// Fully written, not acknowledged
+	REC_DONE = 0x3F,
+};
+
+struct sector_hdr
+{
+	uint32_t magic;
+	uint32_t seq;
+};
+
+struct rec_hdr
+{
+	uint8_t state;
+	uint8_t flags;
+	uint16_t topic_len;	 // Including the NUL
+	uint32_t len;
+	uint32_t crc;  // Over flags, both lengths, topic and payload
+};
+
+struct pos
+{
+	uint16_t sector;
+	uint16_t off;
+};
+
+struct inflight
+{
+	int msg_id;
+	struct pos at;
+};
+
+enum event_type
+{
+	EV_KICK,
+	EV_CONNECTED,
+	EV_DISCONNECTED,
+	EV_ACKED,
+	EV_DELETED,
+};
+
+struct event
+{
+	enum event_type type;
+	int msg_id;
+};
+
+static const char *TAG = "mqtt_outbox";
+
+static esp_mqtt_client_handle_t client;
+static const esp_partition_t *part;
+static esp_partition_mmap_handle_t map_handle;
+static const uint8_t *map;
+static uint16_t n_sectors;
+static uint16_t *live;	// Unacknowledged records per sector
+
+/* All of the below under lock */
+static uint16_t tail;
+static uint16_t head;
+static uint16_t head_off;
+static uint32_t head_seq;
+static struct pos cursor;  // Next record to send
+static struct inflight inflight[ CONFIG_MQTT_OUTBOX_INFLIGHT ];
+static size_t n_inflight;
+static int64_t drain_started_at;
+static uint32_t drain_msgs;
+static uint64_t drain_bytes;
+static struct mqtt_outbox_stats stats;
+
+// Set by the client's event handler, which must never block on the drain
+static volatile bool connected;
+static volatile bool resync;
+
+static SemaphoreHandle_t lock;
+static SemaphoreHandle_t space;
+static QueueHandle_t events;
+
+static inline size_t align4( const size_t n )
+{
+	return ( n + 3 ) & ~( size_t )3;
+}
+
+static inline const struct rec_hdr *rec_at( const struct pos p )
+{
+	return ( const struct rec_hdr * )( map + p.sector * SECTOR + p.off );
+}
+
+static inline size_t rec_size( const struct rec_hdr *const h )
+{
+	return align4( sizeof( *h ) + h->topic_len + h->len );
+}
+
+static inline uint16_t next_sector( const uint16_t s )
+{
+	return s + 1 < n_sectors ? s + 1 : 0;
+}
+
+/** How many sectors past the tail, in_use() when no further than the head */
+static inline uint16_t from_tail( const uint16_t s )
+{
+	return ( s + n_sectors - tail ) % n_sectors;
+}
+
+static inline bool in_use( const uint16_t s )
+{
+	return from_tail( s ) <= from_tail( head );
+}
+
+static uint32_t rec_crc( const uint8_t flags, const char *const topic, const uint16_t topic_len, const void *data,
+						 const uint32_t len )
+{
+	// No padding, every byte hashed is set
+	const struct
+	{
+		uint32_t len;
+		uint16_t topic_len;
+		uint8_t flags;
+		uint8_t zero;
+	} meta = { len, topic_len, flags, 0 };
+	uint32_t crc = esp_rom_crc32_le( 0, ( const uint8_t * )&meta, sizeof( meta ) );
+
+	crc = esp_rom_crc32_le( crc, ( const uint8_t * )topic, topic_len );
+	return esp_rom_crc32_le( crc, data, len );
+}
+
+static bool rec_intact( const struct rec_hdr *const h )
+{
+	const char *const topic = ( const char * )( h + 1 );
+	return h->crc == rec_crc( h->flags, topic, h->topic_len, topic + h->topic_len, h->len );
+}
+
+static esp_err_t set_state( const struct pos p, const enum rec_state state )
+{
+	const uint8_t b = state;
+	return esp_partition_write( part, p.sector * SECTOR + p.off + offsetof( struct rec_hdr, state ), &b, 1 );
+}
+
+static esp_err_t start_sector( const uint16_t s, const uint32_t seq )
+{
+	const struct sector_hdr hdr = { .magic = SECTOR_MAGIC, .seq = seq };
+	esp_err_t err;
+
+	if ( ( err = esp_partition_erase_range( part, s * SECTOR, SECTOR ) ) != ESP_OK )
+		return err;
+	++stats.erases;
+	if ( ( err = esp_partition_write( part, s * SECTOR, &hdr, sizeof( hdr ) ) ) != ESP_OK )
+		return err;
+	head = s;
+	head_seq = seq;
+	head_off = sizeof( hdr );
+	live[ s ] = 0;
+	return ESP_OK;
+}
+
+static esp_err_t append(
+	const char *const topic,
+	const uint16_t topic_len,
+	const void *const data,
+	const uint32_t len,
+	const uint8_t flags )
+{
+	const struct rec_hdr hdr = {
+		.state = REC_ERASED,
+		.flags = flags,
+		.topic_len = topic_len,
+		.len = len,
+		.crc = rec_crc( flags, topic, topic_len, data, len ),
+	};
+	const size_t size = rec_size( &hdr );
+	esp_err_t err;
+
+	if ( size > SECTOR - sizeof( struct sector_hdr ) )
+		return ESP_ERR_INVALID_SIZE;
+	if ( head_off + size > SECTOR )
+	{
+		if ( next_sector( head ) == tail )
+			return ESP_ERR_NO_MEM;
+		if ( ( err = start_sector( next_sector( head ), head_seq + 1 ) ) != ESP_OK )
+			return err;
+	}
+
+	const uint32_t at = head * SECTOR + head_off;
+	if ( ( err = esp_partition_write( part, at, &hdr, sizeof( hdr ) ) ) != ESP_OK
+		 || ( err = esp_partition_write( part, at + sizeof( hdr ), topic, topic_len ) ) != ESP_OK
+		 || ( len && ( err = esp_partition_write( part, at + sizeof( hdr ) + topic_len, data, len ) ) != ESP_OK )
+		 || ( err = set_state( ( struct pos ) { head, head_off }, REC_VALID ) ) != ESP_OK )
+	{
+		// Whatever made it to flash is skipped for its state, the space is lost until the sector comes round again
+		head_off = SECTOR;
+		return err;
+	}
+	head_off += size;
+	++live[ head ];
+	++stats.pending;
+	++stats.stored;
+	return ESP_OK;
+}
+
+/** Advances p to the next record still to be acknowledged, false at the head */
+static bool next_live( struct pos *const p )
+{
+	for ( ;; )
+	{
+		if ( p->sector == head && p->off >= head_off )
+			return false;
+		const struct rec_hdr *const h = rec_at( *p );
+		if ( p->off + sizeof( *h ) > SECTOR || ( h->state == REC_ERASED && h->topic_len == UINT16_MAX )
+			 || p->off + rec_size( h ) > SECTOR )
+		{
+			if ( p->sector == head )
+				return false;
+			*p = ( struct pos ) { next_sector( p->sector ), sizeof( struct sector_hdr ) };
+			continue;
+		}
+		if ( h->state == REC_VALID )
+			return true;
+		p->off += rec_size( h );
+	}
+}
+
+static void rewind_cursor( void )
+{
+	cursor = ( struct pos ) { tail, sizeof( struct sector_hdr ) };
+	n_inflight = 0;
+}
+
+static void retire( const struct pos p )
+{
+	const struct rec_hdr *const h = rec_at( p );
+
+	// Resent after a rewind and acknowledged twice
+	if ( h->state != REC_VALID || set_state( p, REC_DONE ) != ESP_OK )
+		return;
+	--live[ p.sector ];
+	--stats.pending;
+	++stats.drained;
+	++drain_msgs;
+	drain_bytes += h->len;
+
+	if ( tail != head && !live[ tail ] )
+	{
+		while ( tail != head && !live[ tail ] )
+			tail = next_sector( tail );
+		if ( !in_use( cursor.sector ) )
+			cursor = ( struct pos ) { tail, sizeof( struct sector_hdr ) };
+		xSemaphoreGive( space );
+	}
+}
+
+/* Mount */
+
+static uint16_t scan_sector( const uint16_t s )
+{
+	struct pos p = { s, sizeof( struct sector_hdr ) };
+	uint16_t n = 0;
+
+	while ( p.off + sizeof( struct rec_hdr ) <= SECTOR )
+	{
+		const struct rec_hdr *const h = rec_at( p );
+		if ( h->state == REC_ERASED && h->topic_len == UINT16_MAX )
+			break;
+		if ( p.off + rec_size( h ) > SECTOR )
+		{
+			p.off = SECTOR;
+			break;
+		}
+		if ( h->state == REC_VALID )
+		{
+			if ( rec_intact( h ) )
+				++n;
+			else
+			{
+				++stats.corrupt;
+				set_state( p, REC_DONE );
+			}
+		}
+		p.off += rec_size( h );
+	}
+	if ( s == head )
+		head_off = p.off;
+	return n;
+}
+
+static esp_err_t mount( void )
+{
+	const struct sector_hdr *newest = NULL;
+
+	for ( uint16_t s = 0; s < n_sectors; ++s )
+	{
+		const struct sector_hdr *const h = ( const struct sector_hdr * )( map + s * SECTOR );
+		if ( h->magic == SECTOR_MAGIC && ( !newest || ( int32_t )( h->seq - newest->seq ) > 0 ) )
+		{
+			newest = h;
+			head = s;
+		}
+	}
+	if ( !newest )
+		return start_sector( 0, 1 );
+
+	// The sectors in use are the unbroken run of sequence numbers ending at the head
+	head_seq = newest->seq;
+	tail = head;
+	for ( uint16_t back = 1; back < n_sectors; ++back )
+	{
+		const uint16_t s = ( head + n_sectors - back ) % n_sectors;
+		const struct sector_hdr *const h = ( const struct sector_hdr * )( map + s * SECTOR );
+		if ( h->magic != SECTOR_MAGIC || h->seq != head_seq - back )
+			break;
+		tail = s;
+	}
+	for ( uint16_t s = tail;; s = next_sector( s ) )
+	{
+		live[ s ] = scan_sector( s );
+		stats.pending += live[ s ];
+		if ( s == head )
+			break;
+	}
+	while ( tail != head && !live[ tail ] )
+		tail = next_sector( tail );
+	return ESP_OK;
+}
+
+/* Drain */
+
+static void drain_finished( void )
+{
+	stats.last_drain_msgs = drain_msgs;
+	stats.last_drain_bytes = drain_bytes;
+	stats.last_drain_ms = ( esp_timer_get_time() - drain_started_at ) / 1000;
+	drain_started_at = 0;
+	ESP_LOGI(
+		TAG,
+		"Drained %" PRIu32 " messages, %" PRIu64 " bytes in %" PRIu32 " ms (%" PRIu32 " msg/s, %" PRIu32 " B/s)",
+		stats.last_drain_msgs,
+		stats.last_drain_bytes,
+		stats.last_drain_ms,
+		stats.last_drain_ms ? stats.last_drain_msgs * 1000 / stats.last_drain_ms : stats.last_drain_msgs,
+		( uint32_t )( stats.last_drain_ms ? stats.last_drain_bytes * 1000 / stats.last_drain_ms
+										  : stats.last_drain_bytes ) );
+}
+
+static void handle_event( const struct event *const ev )
+{
+	switch ( ev->type )
+	{
+		case EV_CONNECTED:
+			rewind_cursor();
+			break;
+		case EV_DISCONNECTED:
+			n_inflight = 0;
+			drain_started_at = 0;
+			break;
+		case EV_ACKED:
+		case EV_DELETED:
+			for ( size_t i = 0; i < n_inflight; ++i )
+				if ( inflight[ i ].msg_id == ev->msg_id )
+				{
+					const struct pos at = inflight[ i ].at;
+					inflight[ i ] = inflight[ --n_inflight ];
+					if ( ev->type == EV_ACKED )
+						retire( at );
+					else
+						rewind_cursor();  // Dropped by the client unacknowledged, everything from the tail goes again
+					break;
+				}
+			break;
+		default:
+			break;
+	}
+}
+
+/** Hands records to the client until the window is full, dropping the lock around each publish */
+static void drain( void )
+{
+	struct pos at;
+
+	while ( connected && n_inflight < CONFIG_MQTT_OUTBOX_INFLIGHT && next_live( &cursor ) )
+	{
+		at = cursor;
+		const struct rec_hdr *const h = rec_at( at );
+		const char *const topic = ( const char * )( h + 1 );
+		const int qos = h->flags & FLAG_QOS_MASK;
+
+		if ( !drain_started_at )
+		{
+			drain_started_at = esp_timer_get_time();
+			drain_msgs = 0;
+			drain_bytes = 0;
+		}
+		cursor.off += rec_size( h );
+		xSemaphoreGive( lock );
+		// A zero length would have the client take strlen() of the payload
+		const int msg_id = esp_mqtt_client_publish(
+			client,
+			topic,
+			h->len ? topic + h->topic_len : "",
+			h->len,
+			qos,
+			h->flags & FLAG_RETAIN );
+		xSemaphoreTake( lock, portMAX_DELAY );
+
+		if ( msg_id < 0 )
+		{
+			cursor = at;
+			break;
+		}
+		if ( qos )
+			inflight[ n_inflight++ ] = ( struct inflight ) { .msg_id = msg_id, .at = at };
+		else
+			retire( at );
+	}
+	if ( drain_started_at && !stats.pending )
+		drain_finished();
+}
+
+static void drain_task( void *p )
+{
+	struct event ev;
+
+	for ( ;; )
+	{
+		xQueueReceive( events, &ev, portMAX_DELAY );
+		xSemaphoreTake( lock, portMAX_DELAY );
+		do
+			handle_event( &ev );
+		while ( xQueueReceive( events, &ev, 0 ) );
+		if ( resync )
+		{
+			resync = false;
+			rewind_cursor();
+		}
+		drain();
+		xSemaphoreGive( lock );
+	}
+}
+
+static void post( const enum event_type type, const int msg_id )
+{
+	/*
+	 * The client's task may hold its own lock while dispatching, which a drain blocked in publish is waiting for. So
+	 * nothing waits here: a lost kick is harmless, any other lost event sends everything from the tail again.
+	 */
+	if ( !xQueueSend( events, &( const struct event ) { .type = type, .msg_id = msg_id }, 0 ) && type != EV_KICK )
+		resync = true;
+}
+
+static void mqtt_event_handler( void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data )
+{
+	const esp_mqtt_event_handle_t event = event_data;
+
+	switch ( ( esp_mqtt_event_id_t )event_id )
+	{
+		case MQTT_EVENT_CONNECTED:
+			connected = true;
+			post( EV_CONNECTED, 0 );
+			break;
+		case MQTT_EVENT_DISCONNECTED:
+			connected = false;
+			post( EV_DISCONNECTED, 0 );
+			break;
+		case MQTT_EVENT_PUBLISHED:
+			post( EV_ACKED, event->msg_id );
+			break;
+		case MQTT_EVENT_DELETED:
+			post( EV_DELETED, event->msg_id );
+			break;
+		default:
+			break;
+	}
+}
+
+/* API */
+
+esp_err_t mqtt_outbox_init( esp_mqtt_client_handle_t mqtt_client )
+{
+	const void *addr;
+	esp_err_t err;
+
+	part = esp_partition_find_first( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_MQTT_OUTBOX_PARTITION );
+	if ( !part || part->size < 2 * SECTOR )
+	{
+		ESP_LOGE( TAG, "No partition \"%s\" of at least two sectors", CONFIG_MQTT_OUTBOX_PARTITION );
+		return ESP_ERR_NOT_FOUND;
+	}
+	if ( ( err = esp_partition_mmap( part, 0, part->size, ESP_PARTITION_MMAP_DATA, &addr, &map_handle ) ) != ESP_OK )
+		return err;
+	map = addr;
+	n_sectors = part->size / SECTOR;
+	if ( !( live = calloc( n_sectors, sizeof( *live ) ) ) || !( lock = xSemaphoreCreateMutex() )
+		 || !( space = xSemaphoreCreateBinary() ) || !( events = xQueueCreate( QUEUE_LEN, sizeof( struct event ) ) ) )
+		return ESP_ERR_NO_MEM;
+	if ( ( err = mount() ) != ESP_OK )
+		return err;
+	stats.capacity_bytes = n_sectors * ( SECTOR - sizeof( struct sector_hdr ) );
+	rewind_cursor();
+	ESP_LOGI(
+		TAG,
+		"%" PRIu32 " messages pending in %u sectors, %" PRIu32 " corrupt skipped",
+		stats.pending,
+		n_sectors,
+		stats.corrupt );
+
+	client = mqtt_client;
+	if ( pdPASS
+		 != xTaskCreate( drain_task, "mqtt_outbox", DRAIN_STACK, NULL, CONFIG_MQTT_OUTBOX_DRAIN_PRIORITY, NULL ) )
+		return ESP_ERR_NO_MEM;
+	return esp_mqtt_client_register_event( client, MQTT_EVENT_ANY, mqtt_event_handler, NULL );
+}
+
+esp_err_t mqtt_outbox_publish(
+	const char *const topic,
+	const void *const data,
+	const size_t len,
+	const int qos,
+	const bool retain )
+{
+	const size_t topic_len = strlen( topic ) + 1;
+	const TickType_t until = xTaskGetTickCount() + pdMS_TO_TICKS( CONFIG_MQTT_OUTBOX_FULL_WAIT_MS );
+	esp_err_t err;
+
+	if ( qos < 0 || qos > 1 || topic_len > UINT16_MAX )
+		return ESP_ERR_INVALID_ARG;
+
+	xSemaphoreTake( lock, portMAX_DELAY );
+	const bool direct = connected && !stats.pending;
+	xSemaphoreGive( lock );
+	if ( direct && esp_mqtt_client_publish( client, topic, len ? data : "", len, qos, retain ) >= 0 )
+	{
+		xSemaphoreTake( lock, portMAX_DELAY );
+		++stats.direct;
+		xSemaphoreGive( lock );
+		return ESP_OK;
+	}
+
+	for ( ;; )
+	{
+		xSemaphoreTake( lock, portMAX_DELAY );
+		err = append( topic, topic_len, data, len, qos | ( retain ? FLAG_RETAIN : 0 ) );
+		if ( err == ESP_ERR_NO_MEM && ( int32_t )( until - xTaskGetTickCount() ) <= 0 )
+			++stats.rejected;
+		xSemaphoreGive( lock );
+
+		// Back pressure: hold the caller until the drain releases a sector
+		const TickType_t left = until - xTaskGetTickCount();
+		if ( err != ESP_ERR_NO_MEM || ( int32_t )left <= 0 )
+			break;
+		if ( !xSemaphoreTake( space, left ) )
+		{
+			xSemaphoreTake( lock, portMAX_DELAY );
+			++stats.rejected;
+			xSemaphoreGive( lock );
+			break;
+		}
+	}
+	if ( err == ESP_OK )
+		post( EV_KICK, 0 );
+	return err;
+}
+
+void mqtt_outbox_get_stats( struct mqtt_outbox_stats *const out )
+{
+	xSemaphoreTake( lock, portMAX_DELAY );
+	*out = stats;
+	out->used_bytes = from_tail( head ) * ( SECTOR - sizeof( struct sector_hdr ) ) + head_off
+					  - sizeof( struct sector_hdr );
+	xSemaphoreGive( lock );
+}
+
+#endif
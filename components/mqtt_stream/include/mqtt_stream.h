@@ -0,0 +1,85 @@
+
+#pragma once
+
+#include "esp_err.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct mqtt_stream *mqtt_stream_handle_t;
+
+/** Reads len bytes of payload starting at offset into buf. Returns how many were read, < 0 on error. */
+typedef int ( *mqtt_stream_reader_t )( void *ctx, size_t offset, uint8_t *buf, size_t len );
+
+/** Payload either in addressable memory (RAM or an mmapped flash region) or behind a reader */
+struct mqtt_stream_source
+{
+	const void *data;
+	mqtt_stream_reader_t reader;  // Used when data is NULL
+	void *ctx;
+	size_t len;
+};
+
+struct mqtt_stream_config
+{
+	const char *uri;  // mqtt://host[:port] or mqtts://host[:port]
+	const char *cert_pem;
+	esp_err_t ( *crt_bundle_attach )( void *conf );
+	const char *client_id;
+	const char *username;
+	const char *password;
+	uint16_t keepalive_s;
+};
+
+/** One message of a batch, its payload in addressable memory */
+struct mqtt_stream_msg
+{
+	const char *topic;
+	const void *data;
+	size_t len;
+	bool retain;
+};
+
+struct mqtt_stream_stats
+{
+	uint32_t published;
+	uint32_t failed;
+	uint32_t retransmits;
+	uint32_t reconnects;
+	uint32_t writes;  // Calls into the transport, each one TLS record
+	uint64_t payload_bytes;
+	uint64_t tx_bytes;	  // MQTT bytes written
+	uint64_t wire_bytes;  // tx_bytes plus estimated TLS, TCP, IP and Ethernet overhead
+};
+
+/**
+ * Opens a separate MQTT session for publishing large payloads. Unlike esp_mqtt_client_publish(), nothing is copied
+ * into an outbox: the header goes out first and the payload follows in chunks straight from its source.
+ */
+mqtt_stream_handle_t mqtt_stream_connect( const struct mqtt_stream_config *const config );
+void mqtt_stream_disconnect( mqtt_stream_handle_t stream );
+
+/**
+ * Publishes at QoS 0 or 1, blocking until the PUBACK for QoS 1. Unacknowledged publishes are retransmitted from the
+ * source, reconnecting first if the session dropped. Calls on one handle must not overlap.
+ */
+esp_err_t mqtt_stream_publish(
+	mqtt_stream_handle_t stream,
+	const char *const topic,
+	const struct mqtt_stream_source *const src,
+	const int qos,
+	const bool retain );
+
+/**
+ * Publishes up to 32 messages at one QoS, encoded back to back so as many as fit in CONFIG_MQTT_STREAM_CHUNK_SIZE leave
+ * in a single write. For QoS 1 blocks until every PUBACK is in, retransmitting only the unacknowledged ones. Each
+ * message must fit in a chunk on its own.
+ */
+esp_err_t mqtt_stream_publish_batch(
+	mqtt_stream_handle_t stream,
+	const struct mqtt_stream_msg *const msgs,
+	const size_t n,
+	const int qos );
+
+void mqtt_stream_get_stats( mqtt_stream_handle_t stream, struct mqtt_stream_stats *const out );
@@ -0,0 +1,541 @@
+
+#include "mqtt_stream.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_transport.h"
+#include "esp_transport_ssl.h"
+#include "esp_transport_tcp.h"
+#include "sdkconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define CHUNK	   CONFIG_MQTT_STREAM_CHUNK_SIZE
+#define TIMEOUT_MS CONFIG_MQTT_STREAM_NETWORK_TIMEOUT_MS
+#define HOST_MAX   64
+#define FIXED_MAX  5  // Packet type plus up to four remaining length bytes
+#define BATCH_MAX  32 // One bit each in the PUBACK mask
+
+/* Per-write overhead for stats.wire_bytes, TCP ACKs from the peer are not counted */
+#define SEGMENT_PAYLOAD	  1460	// Ethernet MSS
+#define SEGMENT_OVERHEAD  54	// Ethernet, IPv4 and TCP headers without options
+#define RECORD_OVERHEAD	  29	// TLS record header, explicit nonce and AES-GCM tag
+
+#define MQTT_CONNECT   0x10
+#define MQTT_CONNACK   0x20
+#define MQTT_PUBLISH   0x30
+#define MQTT_PUBACK	   0x40
+#define MQTT_PINGREQ   0xC0
+#define MQTT_PINGRESP  0xD0
+#define MQTT_DISCONN   0xE0
+#define MQTT_DUP	   0x08
+#define MQTT_RETAIN	   0x01
+#define MQTT_CLEAN	   0x02
+#define MQTT_PASSWORD  0x40
+#define MQTT_USERNAME  0x80
+
+struct mqtt_stream
+{
+	struct mqtt_stream_config config;
+	esp_transport_handle_t transport;
+	char host[ HOST_MAX ];
+	uint16_t port;
+	bool tls;
+	bool connected;
+	uint16_t next_id;
+	int64_t last_tx;
+	struct mqtt_stream_stats stats;
+	uint8_t buf[ CHUNK ];
+};
+
+static const char *TAG = "mqtt_stream";
+
+static int encode_length( uint8_t *const out, size_t len )
+{
+	int n = 0;
+
+	do
+	{
+		out[ n ] = len & 0x7F;
+		len >>= 7;
+		if ( len )
+			out[ n ] |= 0x80;
+	} while ( ++n < 4 && len );
+	return n;
+}
+
+static uint8_t *put_string( uint8_t *p, const char *const s )
+{
+	const size_t len = strlen( s );
+
+	*p++ = len >> 8;
+	*p++ = len;
+	memcpy( p, s, len );
+	return p + len;
+}
+
+static esp_err_t write_all( struct mqtt_stream *const s, const void *const data, size_t len )
+{
+	const char *p = data;
+
+	while ( len )
+	{
+		const int n = esp_transport_write( s->transport, p, len, TIMEOUT_MS );
+		if ( n <= 0 )
+		{
+			s->connected = false;
+			return ESP_FAIL;
+		}
+		// One TLS record per write, split into as many segments as it takes
+		const size_t record = n + ( s->tls ? RECORD_OVERHEAD : 0 );
+		++s->stats.writes;
+		s->stats.tx_bytes += n;
+		s->stats.wire_bytes += record + ( record + SEGMENT_PAYLOAD - 1 ) / SEGMENT_PAYLOAD * SEGMENT_OVERHEAD;
+		p += n;
+		len -= n;
+	}
+	s->last_tx = esp_timer_get_time();
+	return ESP_OK;
+}
+
+static esp_err_t read_all( struct mqtt_stream *const s, uint8_t *p, size_t len, const int timeout_ms )
+{
+	while ( len )
+	{
+		const int n = esp_transport_read( s->transport, ( char * )p, len, timeout_ms );
+		if ( n == 0 )
+			return ESP_ERR_TIMEOUT;
+		if ( n < 0 )
+		{
+			s->connected = false;
+			return ESP_FAIL;
+		}
+		p += n;
+		len -= n;
+	}
+	return ESP_OK;
+}
+
+/**
+ * Reads one packet, keeping up to max bytes of its body and dropping the rest. Only a timeout before the first byte
+ * leaves the session usable; once a packet has started, anything short of all of it would leave the stream out of step.
+ */
+static esp_err_t read_packet(
+	struct mqtt_stream *const s,
+	uint8_t *const type,
+	uint8_t *const body,
+	const size_t max,
+	const int timeout_ms )
+{
+	uint8_t scratch[ 64 ];
+	size_t len = 0;
+	uint8_t b = 0x80;
+	esp_err_t err;
+
+	if ( ( err = read_all( s, type, 1, timeout_ms ) ) != ESP_OK )
+		return err;
+	for ( int shift = 0; shift < 28 && b & 0x80; shift += 7 )
+	{
+		if ( ( err = read_all( s, &b, 1, TIMEOUT_MS ) ) != ESP_OK )
+			goto fail;
+		len |= ( b & 0x7F ) << shift;
+	}
+	if ( b & 0x80 )
+	{
+		err = ESP_ERR_INVALID_RESPONSE;
+		goto fail;
+	}
+
+	const size_t kept = len < max ? len : max;
+	if ( ( err = read_all( s, body, kept, TIMEOUT_MS ) ) != ESP_OK )
+		goto fail;
+	for ( len -= kept; len; )
+	{
+		const size_t n = len < sizeof( scratch ) ? len : sizeof( scratch );
+		if ( ( err = read_all( s, scratch, n, TIMEOUT_MS ) ) != ESP_OK )
+			goto fail;
+		len -= n;
+	}
+	return ESP_OK;
+
+fail:
+	s->connected = false;
+	return err;
+}
+
+static bool parse_uri( struct mqtt_stream *const s, bool *const tls )
+{
+	const char *const uri = s->config.uri;
+	const char *const sep = uri ? strstr( uri, "://" ) : NULL;
+
+	if ( !sep )
+		return false;
+	*tls = !strncasecmp( uri, "mqtts", sep - uri );
+	const char *const host = sep + 3;
+	const char *end = host + strcspn( host, ":/" );
+	if ( end == host || end - host >= HOST_MAX )
+		return false;
+	memcpy( s->host, host, end - host );
+	s->host[ end - host ] = '\0';
+	s->port = *end == ':' ? atoi( end + 1 ) : *tls ? 8883 : 1883;
+	return true;
+}
+
+static esp_err_t session_open( struct mqtt_stream *const s )
+{
+	const struct mqtt_stream_config *const c = &s->config;
+	uint8_t *p = s->buf + FIXED_MAX;
+	uint8_t flags = MQTT_CLEAN, type, ack[ 2 ];
+	esp_err_t err;
+
+	esp_transport_close( s->transport );
+	if ( esp_transport_connect( s->transport, s->host, s->port, TIMEOUT_MS ) < 0 )
+	{
+		ESP_LOGE( TAG, "connect to %s:%u failed", s->host, s->port );
+		return ESP_FAIL;
+	}
+	s->connected = true;
+
+	if ( c->username )
+		flags |= MQTT_USERNAME;
+	if ( c->password )
+		flags |= MQTT_PASSWORD;
+	p = put_string( p, "MQTT" );
+	*p++ = 4;  // 3.1.1
+	*p++ = flags;
+	*p++ = c->keepalive_s >> 8;
+	*p++ = c->keepalive_s;
+	p = put_string( p, c->client_id );
+	if ( c->username )
+		p = put_string( p, c->username );
+	if ( c->password )
+		p = put_string( p, c->password );
+
+	// Build the fixed header right in front of the variable part
+	uint8_t fixed[ FIXED_MAX ];
+	const size_t body = p - ( s->buf + FIXED_MAX );
+	const int n = encode_length( fixed + 1, body ) + 1;
+	fixed[ 0 ] = MQTT_CONNECT;
+	memcpy( s->buf + FIXED_MAX - n, fixed, n );
+	if ( ( err = write_all( s, s->buf + FIXED_MAX - n, body + n ) ) != ESP_OK )
+		return err;
+
+	if ( ( err = read_packet( s, &type, ack, sizeof( ack ), TIMEOUT_MS ) ) != ESP_OK )
+		return err;
+	if ( type != MQTT_CONNACK || ack[ 1 ] )
+	{
+		ESP_LOGE( TAG, "connection refused, type 0x%02x code %u", type, ack[ 1 ] );
+		s->connected = false;
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
+
+/** Reconnects a dropped session, and pings one that has been quiet for over half its keep-alive */
+static esp_err_t session_check( struct mqtt_stream *const s )
+{
+	const uint8_t ping[ 2 ] = { MQTT_PINGREQ, 0 };
+	uint8_t type;
+
+	if ( s->connected && s->config.keepalive_s
+		 && esp_timer_get_time() - s->last_tx > s->config.keepalive_s * 500000LL )
+	{
+		if ( write_all( s, ping, sizeof( ping ) ) != ESP_OK
+			 || read_packet( s, &type, NULL, 0, TIMEOUT_MS ) != ESP_OK || type != MQTT_PINGRESP )
+			s->connected = false;
+	}
+	if ( s->connected )
+		return ESP_OK;
+	++s->stats.reconnects;
+	return session_open( s );
+}
+
+mqtt_stream_handle_t mqtt_stream_connect( const struct mqtt_stream_config *const config )
+{
+	struct mqtt_stream *const s = calloc( 1, sizeof( *s ) );
+
+	if ( !s )
+		return NULL;
+	s->config = *config;
+	const size_t strings = ( config->client_id ? strlen( config->client_id ) : 0 )
+						 + ( config->username ? strlen( config->username ) + 2 : 0 )
+						 + ( config->password ? strlen( config->password ) + 2 : 0 );
+	if ( !config->client_id || FIXED_MAX + 12 + strings > CHUNK || !parse_uri( s, &s->tls ) )
+	{
+		ESP_LOGE( TAG, "bad configuration" );
+		free( s );
+		return NULL;
+	}
+
+	if ( s->tls )
+	{
+		s->transport = esp_transport_ssl_init();
+		if ( s->transport && config->cert_pem )
+			esp_transport_ssl_set_cert_data( s->transport, config->cert_pem, strlen( config->cert_pem ) );
+		if ( s->transport && config->crt_bundle_attach )
+			esp_transport_ssl_crt_bundle_attach( s->transport, config->crt_bundle_attach );
+	}
+	else
+		s->transport = esp_transport_tcp_init();
+
+	if ( !s->transport || session_open( s ) != ESP_OK )
+	{
+		mqtt_stream_disconnect( s );
+		return NULL;
+	}
+	return s;
+}
+
+void mqtt_stream_disconnect( mqtt_stream_handle_t s )
+{
+	const uint8_t disconnect[ 2 ] = { MQTT_DISCONN, 0 };
+
+	if ( !s )
+		return;
+	if ( s->connected )
+		write_all( s, disconnect, sizeof( disconnect ) );
+	if ( s->transport )
+	{
+		esp_transport_close( s->transport );
+		esp_transport_destroy( s->transport );
+	}
+	free( s );
+}
+
+static esp_err_t send_payload( struct mqtt_stream *const s, const struct mqtt_stream_source *const src )
+{
+	esp_err_t err = ESP_OK;
+
+	for ( size_t off = 0; off < src->len && err == ESP_OK; )
+	{
+		const size_t n = src->len - off < CHUNK ? src->len - off : CHUNK;
+		if ( src->data )
+			err = write_all( s, ( const uint8_t * )src->data + off, n );
+		else
+		{
+			const int got = src->reader( src->ctx, off, s->buf, n );
+			if ( got <= 0 )
+			{
+				// The length is already on the wire, the session cannot carry on
+				ESP_LOGE( TAG, "reader failed at %u", ( unsigned )off );
+				esp_transport_close( s->transport );
+				s->connected = false;
+				return ESP_ERR_INVALID_STATE;
+			}
+			err = write_all( s, s->buf, got );
+			off += got;
+			continue;
+		}
+		off += n;
+	}
+	return err;
+}
+
+static esp_err_t send_publish(
+	struct mqtt_stream *const s,
+	const char *const topic,
+	const struct mqtt_stream_source *const src,
+	const int qos,
+	const bool retain,
+	const uint16_t id,
+	const bool dup )
+{
+	const size_t topic_len = strlen( topic );
+	const size_t remaining = 2 + topic_len + ( qos ? 2 : 0 ) + src->len;
+	uint8_t *p = s->buf;
+	esp_err_t err;
+
+	if ( FIXED_MAX + 2 + topic_len + 2 > CHUNK )
+		return ESP_ERR_INVALID_SIZE;
+
+	*p++ = MQTT_PUBLISH | ( dup ? MQTT_DUP : 0 ) | qos << 1 | ( retain ? MQTT_RETAIN : 0 );
+	p += encode_length( p, remaining );
+	p = put_string( p, topic );
+	if ( qos )
+	{
+		*p++ = id >> 8;
+		*p++ = id;
+	}
+	if ( ( err = write_all( s, s->buf, p - s->buf ) ) != ESP_OK )
+		return err;
+	return send_payload( s, src );
+}
+
+/**
+ * Waits for the PUBACKs for ids, clearing the bit of each one that arrives in *pending. Nothing else is expected on a
+ * session that never subscribes.
+ */
+static esp_err_t wait_pubacks( struct mqtt_stream *const s, const uint16_t *const ids, size_t n, uint32_t *pending )
+{
+	const int64_t deadline = esp_timer_get_time() + CONFIG_MQTT_STREAM_ACK_TIMEOUT_MS * 1000LL;
+	uint8_t type, body[ 2 ];
+	esp_err_t err;
+
+	for ( int64_t left; *pending && ( left = deadline - esp_timer_get_time() ) > 0; )
+	{
+		if ( ( err = read_packet( s, &type, body, sizeof( body ), left / 1000 + 1 ) ) != ESP_OK )
+			return err;
+		if ( ( type & 0xF0 ) != MQTT_PUBACK )
+			continue;
+		for ( size_t i = 0; i < n; ++i )
+			if ( ids[ i ] == ( body[ 0 ] << 8 | body[ 1 ] ) )
+				*pending &= ~( 1UL << i );
+	}
+	return *pending ? ESP_ERR_TIMEOUT : ESP_OK;
+}
+
+static esp_err_t wait_puback( struct mqtt_stream *const s, const uint16_t id )
+{
+	uint32_t pending = 1;
+	return wait_pubacks( s, &id, 1, &pending );
+}
+
+static uint16_t take_id( struct mqtt_stream *const s )
+{
+	if ( !++s->next_id )
+		s->next_id = 1;
+	return s->next_id;
+}
+
+esp_err_t mqtt_stream_publish(
+	mqtt_stream_handle_t s,
+	const char *const topic,
+	const struct mqtt_stream_source *const src,
+	const int qos,
+	const bool retain )
+{
+	uint32_t sent_on = UINT32_MAX;
+	esp_err_t err = ESP_FAIL;
+
+	if ( !s || !topic || !src || ( !src->data && !src->reader ) || qos < 0 || qos > 1 )
+		return ESP_ERR_INVALID_ARG;
+
+	const uint16_t id = take_id( s );
+
+	for ( int attempt = 0; attempt <= CONFIG_MQTT_STREAM_MAX_RETRANSMITS; ++attempt )
+	{
+		if ( attempt )
+			++s->stats.retransmits;
+		if ( ( err = session_check( s ) ) != ESP_OK )
+			continue;
+		// A clean session forgets the packet id on reconnect, DUP only makes sense on the same session
+		err = send_publish( s, topic, src, qos, retain, id, sent_on == s->stats.reconnects );
+		sent_on = s->stats.reconnects;
+		if ( err == ESP_OK && qos )
+			err = wait_puback( s, id );
+		if ( err == ESP_OK || err == ESP_ERR_INVALID_SIZE || err == ESP_ERR_INVALID_STATE || !qos )
+			break;
+		ESP_LOGW( TAG, "publish %u to %s: %s", id, topic, esp_err_to_name( err ) );
+	}
+
+	if ( err == ESP_OK )
+	{
+		++s->stats.published;
+		s->stats.payload_bytes += src->len;
+	}
+	else
+		++s->stats.failed;
+	return err;
+}
+
+/** Encodes the PUBLISH packets with their bit set in mask back to back, writing out whenever the next won't fit */
+static esp_err_t send_packed(
+	struct mqtt_stream *const s,
+	const struct mqtt_stream_msg *const msgs,
+	const size_t n,
+	const int qos,
+	const uint16_t *const ids,
+	const uint32_t mask,
+	const bool dup )
+{
+	uint8_t *p = s->buf;
+	esp_err_t err;
+
+	for ( size_t i = 0; i < n; ++i )
+	{
+		if ( !( mask & 1UL << i ) )
+			continue;
+		const size_t topic_len = strlen( msgs[ i ].topic );
+		const size_t remaining = 2 + topic_len + ( qos ? 2 : 0 ) + msgs[ i ].len;
+		if ( FIXED_MAX + remaining > ( size_t )( s->buf + CHUNK - p ) )
+		{
+			if ( ( err = write_all( s, s->buf, p - s->buf ) ) != ESP_OK )
+				return err;
+			p = s->buf;
+		}
+		*p++ = MQTT_PUBLISH | ( dup ? MQTT_DUP : 0 ) | qos << 1 | ( msgs[ i ].retain ? MQTT_RETAIN : 0 );
+		p += encode_length( p, remaining );
+		p = put_string( p, msgs[ i ].topic );
+		if ( qos )
+		{
+			*p++ = ids[ i ] >> 8;
+			*p++ = ids[ i ];
+		}
+		memcpy( p, msgs[ i ].data, msgs[ i ].len );
+		p += msgs[ i ].len;
+	}
+	return p == s->buf ? ESP_OK : write_all( s, s->buf, p - s->buf );
+}
+
+esp_err_t mqtt_stream_publish_batch(
+	mqtt_stream_handle_t s,
+	const struct mqtt_stream_msg *const msgs,
+	const size_t n,
+	const int qos )
+{
+	uint16_t ids[ BATCH_MAX ];
+	uint32_t pending = n == BATCH_MAX ? UINT32_MAX : ( 1UL << n ) - 1;
+	uint32_t sent_on = UINT32_MAX;
+	esp_err_t err = ESP_FAIL;
+
+	if ( !s || !msgs || !n || n > BATCH_MAX || qos < 0 || qos > 1 )
+		return ESP_ERR_INVALID_ARG;
+	for ( size_t i = 0; i < n; ++i )
+	{
+		if ( !msgs[ i ].topic || ( !msgs[ i ].data && msgs[ i ].len ) )
+			return ESP_ERR_INVALID_ARG;
+		if ( FIXED_MAX + 2 + strlen( msgs[ i ].topic ) + 2 + msgs[ i ].len > CHUNK )
+			return ESP_ERR_INVALID_SIZE;
+		ids[ i ] = take_id( s );
+	}
+
+	// Only what is still unacknowledged goes again
+	for ( int attempt = 0; attempt <= CONFIG_MQTT_STREAM_MAX_RETRANSMITS; ++attempt )
+	{
+		if ( attempt )
+			s->stats.retransmits += __builtin_popcount( pending );
+		if ( ( err = session_check( s ) ) != ESP_OK )
+			continue;
+		err = send_packed( s, msgs, n, qos, ids, pending, sent_on == s->stats.reconnects );
+		sent_on = s->stats.reconnects;
+		if ( err == ESP_OK && qos )
+			err = wait_pubacks( s, ids, n, &pending );
+		if ( err == ESP_OK || !qos )
+			break;
+		ESP_LOGW(
+			TAG,
+			"batch of %u, %d unacknowledged: %s",
+			( unsigned )n,
+			__builtin_popcount( pending ),
+			esp_err_to_name( err ) );
+	}
+
+	if ( err == ESP_OK )
+		pending = 0;
+	for ( size_t i = 0; i < n; ++i )
+		if ( pending & 1UL << i )
+			++s->stats.failed;
+		else
+		{
+			++s->stats.published;
+			s->stats.payload_bytes += msgs[ i ].len;
+		}
+	return err;
+}
+
+void mqtt_stream_get_stats( mqtt_stream_handle_t s, struct mqtt_stream_stats *const out )
+{
+	*out = s->stats;
+}
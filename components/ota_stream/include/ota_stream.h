@@ -0,0 +1,34 @@
+
+#pragma once
+
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include "esp_partition.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct ota_stream_config
+{
+	const esp_http_client_config_t *http;  // URL, certificates and timeouts; the event handler is not used
+	const esp_partition_t *partition;	   // NULL for the next OTA slot
+	bool set_boot;						   // Boot from the partition once the image has been verified
+};
+
+struct ota_stream_stats
+{
+	uint64_t bytes;
+	uint32_t elapsed_ms;
+	uint32_t bytes_per_s;
+	uint32_t resumes;
+	uint64_t flash_stall_us;  // Network side waiting for the flash writer to free a buffer
+	uint64_t net_stall_us;	  // Flash writer waiting for the network side to fill a buffer
+};
+
+/**
+ * Downloads an image into an OTA partition, overlapping esp_ota_write() with the next network read through a double
+ * buffer. Dropped connections are resumed where they left off with a Range request. stats may be NULL.
+ */
+esp_err_t ota_stream_download( const struct ota_stream_config *const config, struct ota_stream_stats *const stats );
+
+void ota_stream_log_stats( const struct ota_stream_stats *const stats );
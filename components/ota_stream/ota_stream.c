@@ -0,0 +1,247 @@
+
+#include "ota_stream.h"
+
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHUNK		CONFIG_OTA_STREAM_CHUNK_SIZE
+#define N_BUFFERS	2
+#define BUFFER_STOP 0xFF
+
+struct job
+{
+	esp_ota_handle_t ota;
+	uint8_t *buffers[ N_BUFFERS ];
+	size_t lengths[ N_BUFFERS ];
+	QueueHandle_t free_q;  // Indexes of buffers the network side may fill
+	QueueHandle_t full_q;  // Indexes of buffers waiting for esp_ota_write()
+	StaticSemaphore_t done_buf;
+	SemaphoreHandle_t done;	// Given by the writer once it has seen the stop marker
+	volatile esp_err_t write_err;
+	uint64_t flash_stall_us;
+	uint64_t net_stall_us;
+};
+
+static const char *TAG = "ota_stream";
+
+static void writer_task( void *arg )
+{
+	struct job *const j = arg;
+	bool started = false;
+	uint8_t idx;
+
+	for ( ;; )
+	{
+		const int64_t wait_from = esp_timer_get_time();
+		xQueueReceive( j->full_q, &idx, portMAX_DELAY );
+		// Waiting for the first buffer is connection setup, not a stall
+		if ( started )
+			j->net_stall_us += esp_timer_get_time() - wait_from;
+		if ( idx == BUFFER_STOP )
+			break;
+		started = true;
+		if ( j->write_err == ESP_OK )
+			j->write_err = esp_ota_write( j->ota, j->buffers[ idx ], j->lengths[ idx ] );
+		xQueueSend( j->free_q, &idx, portMAX_DELAY );
+	}
+	xSemaphoreGive( j->done );
+	vTaskDelete( NULL );
+}
+
+/**
+ * One request from offset to the end, or to wherever the connection drops. Returns ESP_OK when the whole image has
+ * been queued, ESP_FAIL when the transfer broke off and is worth resuming, anything else when it is not.
+ */
+static esp_err_t fetch(
+	struct job *const j,
+	esp_http_client_handle_t client,
+	uint64_t *const offset,
+	int64_t *const total )
+{
+	char range[ 32 ];
+	esp_err_t err;
+
+	if ( *offset )
+	{
+		snprintf( range, sizeof( range ), "bytes=%" PRIu64 "-", *offset );
+		esp_http_client_set_header( client, "Range", range );
+	}
+	if ( ( err = esp_http_client_open( client, 0 ) ) != ESP_OK )
+		return ESP_FAIL;
+
+	const int64_t length = esp_http_client_fetch_headers( client );
+	const int status = esp_http_client_get_status_code( client );
+	if ( length < 0 )
+		return ESP_FAIL;
+	if ( *offset && status == 200 )
+	{
+		ESP_LOGE( TAG, "server ignored the Range request, cannot resume" );
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	if ( status != ( *offset ? 206 : 200 ) )
+	{
+		ESP_LOGE( TAG, "HTTP status %d", status );
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+	if ( *total < 0 && length > 0 )
+		*total = *offset + length;
+
+	int n = 1;
+	while ( n > 0 && j->write_err == ESP_OK )
+	{
+		const int64_t wait_from = esp_timer_get_time();
+		uint8_t idx;
+		xQueueReceive( j->free_q, &idx, portMAX_DELAY );
+		j->flash_stall_us += esp_timer_get_time() - wait_from;
+
+		// Fill the whole buffer so flash always sees full sector-sized writes
+		char *const buf = ( char * )j->buffers[ idx ];
+		size_t fill = 0;
+		while ( fill < CHUNK && ( n = esp_http_client_read( client, buf + fill, CHUNK - fill ) ) > 0 )
+			fill += n;
+
+		if ( fill )
+		{
+			j->lengths[ idx ] = fill;
+			*offset += fill;
+			xQueueSend( j->full_q, &idx, portMAX_DELAY );
+		}
+		else
+			xQueueSend( j->free_q, &idx, portMAX_DELAY );
+	}
+
+	if ( j->write_err != ESP_OK )
+		return j->write_err;
+	if ( n < 0 )
+		return ESP_FAIL;
+	if ( *total >= 0 ? *offset < ( uint64_t )*total : !esp_http_client_is_complete_data_received( client ) )
+		return ESP_FAIL;
+	return ESP_OK;
+}
+
+esp_err_t ota_stream_download( const struct ota_stream_config *const config, struct ota_stream_stats *const stats )
+{
+	const esp_partition_t *const part =
+		config->partition ? config->partition : esp_ota_get_next_update_partition( NULL );
+	struct job j = { 0 };
+	esp_http_client_handle_t client = NULL;
+	const uint8_t stop = BUFFER_STOP;
+	uint64_t offset = 0;
+	int64_t total = -1;
+	uint32_t resumes = 0;
+	esp_err_t err;
+
+	if ( !part )
+		return ESP_ERR_NOT_FOUND;
+
+	j.buffers[ 0 ] = malloc( CHUNK );
+	j.buffers[ 1 ] = malloc( CHUNK );
+	j.free_q = xQueueCreate( N_BUFFERS, sizeof( uint8_t ) );
+	j.full_q = xQueueCreate( N_BUFFERS + 1, sizeof( uint8_t ) );
+	if ( !j.buffers[ 0 ] || !j.buffers[ 1 ] || !j.free_q || !j.full_q )
+	{
+		err = ESP_ERR_NO_MEM;
+		goto out;
+	}
+	for ( uint8_t i = 0; i < N_BUFFERS; ++i )
+		xQueueSend( j.free_q, &i, 0 );
+	// Not the caller's task notification, which may already be in use for something else
+	j.done = xSemaphoreCreateBinaryStatic( &j.done_buf );
+
+	if ( ( err = esp_ota_begin( part, OTA_WITH_SEQUENTIAL_WRITES, &j.ota ) ) != ESP_OK )
+		goto out;
+
+	esp_http_client_config_t http = *config->http;
+	http.event_handler = NULL;
+	http.is_async = false;
+	if ( !( client = esp_http_client_init( &http ) ) )
+	{
+		esp_ota_abort( j.ota );
+		err = ESP_FAIL;
+		goto out;
+	}
+
+	if ( pdPASS != xTaskCreate( writer_task, "ota_writer", 3072, &j, CONFIG_OTA_STREAM_WRITER_PRIORITY, NULL ) )
+	{
+		esp_ota_abort( j.ota );
+		err = ESP_ERR_NO_MEM;
+		goto out;
+	}
+
+	ESP_LOGI( TAG, "writing to %s at 0x%" PRIx32, part->label, part->address );
+	const int64_t start = esp_timer_get_time();
+	for ( ;; )
+	{
+		err = fetch( &j, client, &offset, &total );
+		esp_http_client_close( client );
+		if ( err != ESP_FAIL || resumes >= CONFIG_OTA_STREAM_MAX_RESUMES )
+			break;
+		++resumes;
+		ESP_LOGW( TAG, "transfer dropped at %" PRIu64 " bytes, resuming (%" PRIu32 ")", offset, resumes );
+		vTaskDelay( pdMS_TO_TICKS( CONFIG_OTA_STREAM_RESUME_DELAY_MS ) );
+	}
+
+	// The writer drains whatever is still queued before it sees the stop marker
+	xQueueSend( j.full_q, &stop, portMAX_DELAY );
+	xSemaphoreTake( j.done, portMAX_DELAY );
+	const int64_t elapsed_us = esp_timer_get_time() - start;
+
+	if ( err == ESP_OK )
+		err = j.write_err;
+	if ( err == ESP_OK )
+		err = esp_ota_end( j.ota );
+	else
+		esp_ota_abort( j.ota );
+	if ( err == ESP_OK && config->set_boot )
+		err = esp_ota_set_boot_partition( part );
+
+	if ( stats )
+	{
+		*stats = ( struct ota_stream_stats ) {
+			.bytes = offset,
+			.elapsed_ms = elapsed_us / 1000,
+			.bytes_per_s = elapsed_us ? offset * 1000000 / elapsed_us : 0,
+			.resumes = resumes,
+			.flash_stall_us = j.flash_stall_us,
+			.net_stall_us = j.net_stall_us,
+		};
+	}
+
+out:
+	if ( client )
+		esp_http_client_cleanup( client );
+	if ( j.free_q )
+		vQueueDelete( j.free_q );
+	if ( j.full_q )
+		vQueueDelete( j.full_q );
+	free( j.buffers[ 0 ] );
+	free( j.buffers[ 1 ] );
+	if ( err != ESP_OK )
+		ESP_LOGE( TAG, "download failed: %s", esp_err_to_name( err ) );
+	return err;
+}
+
+void ota_stream_log_stats( const struct ota_stream_stats *const stats )
+{
+	ESP_LOGI(
+		TAG,
+		"%" PRIu64 " bytes in %" PRIu32 " ms, %" PRIu32 " B/s, %" PRIu32 " resumes",
+		stats->bytes,
+		stats->elapsed_ms,
+		stats->bytes_per_s,
+		stats->resumes );
+	ESP_LOGI(
+		TAG,
+		"flash stall %" PRIu32 " ms, network stall %" PRIu32 " ms",
+		( uint32_t )( stats->flash_stall_us / 1000 ),
+		( uint32_t )( stats->net_stall_us / 1000 ) );
+}
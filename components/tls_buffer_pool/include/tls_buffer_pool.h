@@ -0,0 +1,17 @@
+
+#pragma once
+
+#include <stdint.h>
+
+struct tls_buffer_pool_stats
+{
+	uint32_t pooled;	 // Record buffers served from a slot
+	uint32_t fallbacks;	 // Record buffers sized for a slot that found none free
+	uint32_t in_use;	 // Slots now
+	uint32_t peak;		 // Slots at most
+	uint32_t heap_bytes;  // Allocations of pool size on the heap now, fallbacks and larger ones
+	uint32_t heap_peak;
+};
+
+void tls_buffer_pool_get_stats( struct tls_buffer_pool_stats *const out );
+void tls_buffer_pool_log_stats( void );
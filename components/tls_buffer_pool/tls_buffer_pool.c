@@ -0,0 +1,161 @@
+
+#include "tls_buffer_pool.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "mem_budget.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC
+
+// What mbedtls allocates with by default
+#define CAPS ( MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT )
+
+/* mbedtls links against these with CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC */
+void *esp_mbedtls_mem_calloc( size_t n, size_t size );
+void esp_mbedtls_mem_free( void *ptr );
+
+/** Charged to TLS whichever task is handshaking */
+static void *heap_calloc( const size_t n, const size_t size )
+{
+#ifdef CONFIG_MEM_BUDGET
+	const int prev = mem_budget_push( MEM_BUDGET_TLS );
+	void *const p = heap_caps_calloc( n, size, CAPS );
+	mem_budget_pop( prev );
+	return p;
+#else
+	return heap_caps_calloc( n, size, CAPS );
+#endif
+}
+
+#ifdef CONFIG_TLS_BUFFER_POOL
+
+#define SLOTS	  CONFIG_TLS_BUFFER_POOL_SLOTS
+#define SLOT_SIZE ( ( CONFIG_TLS_BUFFER_POOL_SLOT_SIZE + 3 ) & ~3 )
+#define MIN_SIZE  CONFIG_TLS_BUFFER_POOL_MIN_SIZE
+
+static const char *TAG = "tls_buffer_pool";
+
+static uint8_t pool[ SLOTS ][ SLOT_SIZE ] __attribute__( ( aligned( 4 ) ) );
+static uint32_t free_slots = ( 1u << SLOTS ) - 1;
+static struct tls_buffer_pool_stats stats;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+/** A free slot, -1 when there is none */
+static int take( void )
+{
+	int slot = -1;
+
+	portENTER_CRITICAL( &mux );
+	if ( free_slots )
+	{
+		slot = __builtin_ctz( free_slots );
+		free_slots &= ~( 1u << slot );
+		++stats.pooled;
+		if ( ++stats.in_use > stats.peak )
+			stats.peak = stats.in_use;
+	}
+	else
+		++stats.fallbacks;
+	portEXIT_CRITICAL( &mux );
+	return slot;
+}
+
+/** Large heap buffers, by what the heap actually gave out so that the free takes back the same amount */
+static void account_heap( const void *const p, const bool alloc )
+{
+	const size_t bytes = p ? heap_caps_get_allocated_size( ( void * )p ) : 0;
+
+	if ( bytes < MIN_SIZE )
+		return;
+	portENTER_CRITICAL( &mux );
+	if ( alloc )
+	{
+		stats.heap_bytes += bytes;
+		if ( stats.heap_bytes > stats.heap_peak )
+			stats.heap_peak = stats.heap_bytes;
+	}
+	else
+		stats.heap_bytes -= bytes;
+	portEXIT_CRITICAL( &mux );
+}
+
+void *esp_mbedtls_mem_calloc( size_t n, size_t size )
+{
+	if ( size && n > SIZE_MAX / size )
+		return NULL;
+
+	const size_t bytes = n * size;
+	if ( bytes >= MIN_SIZE && bytes <= SLOT_SIZE )
+	{
+		const int slot = take();
+		if ( slot >= 0 )
+			return memset( pool[ slot ], 0, bytes );
+	}
+
+	void *const p = heap_calloc( n, size );
+	account_heap( p, true );
+	return p;
+}
+
+void esp_mbedtls_mem_free( void *ptr )
+{
+	const uintptr_t off = ( uintptr_t )ptr - ( uintptr_t )pool;
+
+	if ( ptr && off < sizeof( pool ) )
+	{
+		portENTER_CRITICAL( &mux );
+		free_slots |= 1u << ( off / SLOT_SIZE );
+		--stats.in_use;
+		portEXIT_CRITICAL( &mux );
+		return;
+	}
+	account_heap( ptr, false );
+	heap_caps_free( ptr );
+}
+
+void tls_buffer_pool_get_stats( struct tls_buffer_pool_stats *const out )
+{
+	portENTER_CRITICAL( &mux );
+	*out = stats;
+	portEXIT_CRITICAL( &mux );
+}
+
+void tls_buffer_pool_log_stats( void )
+{
+	struct tls_buffer_pool_stats s;
+
+	tls_buffer_pool_get_stats( &s );
+	ESP_LOGI(
+		TAG,
+		"%" PRIu32 " buffers pooled, %" PRIu32 " fell back to the heap; slots %" PRIu32 "/%d in use, peak %" PRIu32
+		"; heap %" PRIu32 " bytes, peak %" PRIu32,
+		s.pooled,
+		s.fallbacks,
+		s.in_use,
+		SLOTS,
+		s.peak,
+		s.heap_bytes,
+		s.heap_peak );
+}
+
+#else
+
+void *esp_mbedtls_mem_calloc( size_t n, size_t size )
+{
+	return heap_calloc( n, size );
+}
+
+void esp_mbedtls_mem_free( void *ptr )
+{
+	heap_caps_free( ptr );
+}
+
+#endif
+
+#endif
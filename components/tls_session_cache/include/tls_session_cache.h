@@ -0,0 +1,22 @@
+
+#pragma once
+
+#include <stdint.h>
+
+struct tls_session_cache_stats
+{
+	uint32_t lookups;
+	uint32_t hits;		  // A cached session was offered
+	uint32_t stored;
+	uint32_t evicted;
+	uint32_t expired;
+	uint32_t full_handshakes;
+	uint32_t resumed_handshakes;  // The server accepted the offered session
+	uint32_t failed_handshakes;
+	uint64_t full_us;
+	uint64_t resumed_us;
+};
+
+void tls_session_cache_get_stats( struct tls_session_cache_stats *const out );
+void tls_session_cache_log_stats( void );
+void tls_session_cache_flush( void );
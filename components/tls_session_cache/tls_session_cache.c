@@ -0,0 +1,307 @@
+
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+
+#include "tls_session_cache.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#include "sdkconfig.h"
+
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifdef CONFIG_TLS_SESSION_CACHE
+
+#define HOST_MAX		  64
+#define TRACK_MAX		  8
+#define TRACK_ABANDONED_US 60000000LL
+
+int __real_mbedtls_ssl_handshake( mbedtls_ssl_context *ssl );
+int __wrap_mbedtls_ssl_handshake( mbedtls_ssl_context *ssl );
+int __real_mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen );
+int __wrap_mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen );
+
+struct entry
+{
+	char host[ HOST_MAX ];
+	uint16_t port;
+	bool used;
+	int64_t stored_at;
+	int64_t last_used_at;
+	mbedtls_ssl_session session;
+};
+
+/** Handshakes in progress, a non-blocking handshake spans many calls. Only touched with the lock held. */
+struct track
+{
+	const mbedtls_ssl_context *ssl;
+	TaskHandle_t in_call;  // Task inside mbedtls_ssl_handshake() for it right now
+	int64_t started_at;
+	bool offered;
+	bool saw_certificate;
+};
+
+static const char *TAG = "tls_session_cache";
+
+static struct entry cache[ CONFIG_TLS_SESSION_CACHE_SIZE ];
+static struct track tracks[ TRACK_MAX ];
+static struct tls_session_cache_stats stats;
+
+static SemaphoreHandle_t cache_lock( void )
+{
+	static StaticSemaphore_t lock_buf;
+	static SemaphoreHandle_t lock;
+	static portMUX_TYPE lock_mux = portMUX_INITIALIZER_UNLOCKED;
+
+	portENTER_CRITICAL( &lock_mux );
+	if ( !lock )
+		lock = xSemaphoreCreateMutexStatic( &lock_buf );
+	portEXIT_CRITICAL( &lock_mux );
+	return lock;
+}
+
+#define lock()	 xSemaphoreTake( cache_lock(), portMAX_DELAY )
+#define unlock() xSemaphoreGive( cache_lock() )
+
+/** Only sockets set up through mbedtls_net_* (which is what esp-tls does) can tell the port */
+static uint16_t peer_port( const mbedtls_ssl_context *const ssl )
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof( addr );
+
+	if ( ssl->f_send != mbedtls_net_send || !ssl->p_bio )
+		return 0;
+	if ( getpeername( ( ( mbedtls_net_context * )ssl->p_bio )->fd, ( struct sockaddr * )&addr, &len ) )
+		return 0;
+	return ntohs( ( ( struct sockaddr_in * )&addr )->sin_port );
+}
+
+static struct entry *find( const char *const host, const uint16_t port )
+{
+	for ( size_t i = 0; i < CONFIG_TLS_SESSION_CACHE_SIZE; ++i )
+		if ( cache[ i ].used && cache[ i ].port == port && !strcmp( cache[ i ].host, host ) )
+			return &cache[ i ];
+	return NULL;
+}
+
+static void drop( struct entry *const e )
+{
+	mbedtls_ssl_session_free( &e->session );
+	e->used = false;
+}
+
+static struct entry *slot_for( const char *const host, const uint16_t port )
+{
+	struct entry *e = find( host, port ), *lru = &cache[ 0 ];
+
+	if ( e )
+	{
+		mbedtls_ssl_session_free( &e->session );
+		return e;
+	}
+	for ( size_t i = 0; i < CONFIG_TLS_SESSION_CACHE_SIZE; ++i )
+	{
+		if ( !cache[ i ].used )
+			return &cache[ i ];
+		if ( cache[ i ].last_used_at < lru->last_used_at )
+			lru = &cache[ i ];
+	}
+	++stats.evicted;
+	drop( lru );
+	return lru;
+}
+
+static struct track *track_find( const mbedtls_ssl_context *const ssl )
+{
+	for ( size_t i = 0; i < TRACK_MAX; ++i )
+		if ( tracks[ i ].ssl == ssl )
+			return &tracks[ i ];
+	return NULL;
+}
+
+/** Contexts freed halfway through a handshake never come back, their slots are reclaimed after a while */
+static struct track *track_alloc( const int64_t now )
+{
+	for ( size_t i = 0; i < TRACK_MAX; ++i )
+		if ( !tracks[ i ].ssl || now - tracks[ i ].started_at > TRACK_ABANDONED_US )
+			return &tracks[ i ];
+	return NULL;
+}
+
+/** First call for this context: offer a cached session if there is one */
+static struct track *track_start( mbedtls_ssl_context *const ssl )
+{
+	const int64_t now = esp_timer_get_time();
+	struct track *const t = track_alloc( now );
+	const char *const host = ssl->hostname;
+
+	if ( !t )
+		return NULL;
+	*t = ( struct track ) { .ssl = ssl, .started_at = now };
+	if ( !host )
+		return t;
+
+	++stats.lookups;
+	struct entry *const e = find( host, peer_port( ssl ) );
+	if ( !e )
+		return t;
+	if ( now - e->stored_at > CONFIG_TLS_SESSION_CACHE_LIFETIME_S * 1000000LL )
+	{
+		++stats.expired;
+		drop( e );
+		return t;
+	}
+	if ( !mbedtls_ssl_set_session( ssl, &e->session ) )
+	{
+		++stats.hits;
+		t->offered = true;
+		e->last_used_at = now;
+	}
+	return t;
+}
+
+static void track_finish( struct track *const t, mbedtls_ssl_context *const ssl, const int ret )
+{
+	const uint32_t elapsed = esp_timer_get_time() - t->started_at;
+	const char *const host = ssl->hostname;
+
+	if ( ret )
+	{
+		++stats.failed_handshakes;
+		// Whatever we offered may be what the server choked on
+		struct entry *const e = host ? find( host, peer_port( ssl ) ) : NULL;
+		if ( t->offered && e )
+			drop( e );
+	}
+	else
+	{
+		if ( t->offered && !t->saw_certificate )
+		{
+			++stats.resumed_handshakes;
+			stats.resumed_us += elapsed;
+		}
+		else
+		{
+			++stats.full_handshakes;
+			stats.full_us += elapsed;
+		}
+
+		if ( host && strlen( host ) < HOST_MAX )
+		{
+			const uint16_t port = peer_port( ssl );
+			struct entry *const e = slot_for( host, port );
+			mbedtls_ssl_session_init( &e->session );
+			if ( !mbedtls_ssl_get_session( ssl, &e->session ) )
+			{
+				strcpy( e->host, host );
+				e->port = port;
+				e->stored_at = e->last_used_at = esp_timer_get_time();
+				e->used = true;
+				++stats.stored;
+			}
+			else
+				drop( e );
+		}
+	}
+	t->ssl = NULL;
+}
+
+/** Offers a cached session on the first call of a handshake and keeps the negotiated one after the last */
+int __wrap_mbedtls_ssl_handshake( mbedtls_ssl_context *ssl )
+{
+	if ( !ssl || !ssl->conf )
+		return __real_mbedtls_ssl_handshake( ssl );
+
+	lock();
+	struct track *t = track_find( ssl );
+	// A context at HELLO_REQUEST is always a new handshake, even if a dead one left a slot at the same address
+	if ( ssl->state == MBEDTLS_SSL_HELLO_REQUEST )
+	{
+		if ( t )
+			t->ssl = NULL;
+		t = track_start( ssl );
+	}
+	if ( t )
+		t->in_call = xTaskGetCurrentTaskHandle();
+	unlock();
+
+	const int ret = __real_mbedtls_ssl_handshake( ssl );
+
+	// The slot may have been taken over while unlocked if the handshake ran past TRACK_ABANDONED_US
+	lock();
+	if ( ( t = track_find( ssl ) ) )
+	{
+		t->in_call = NULL;
+		if ( ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE )
+			track_finish( t, ssl, ret );
+	}
+	unlock();
+	return ret;
+}
+
+/**
+ * Tells full handshakes from resumed ones: only a full one has the server send its certificate, which mbedtls parses
+ * from inside the handshake call.
+ */
+int __wrap_mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen )
+{
+	const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+	lock();
+	for ( size_t i = 0; i < TRACK_MAX; ++i )
+		if ( tracks[ i ].ssl && tracks[ i ].in_call == self )
+			tracks[ i ].saw_certificate = true;
+	unlock();
+	return __real_mbedtls_x509_crt_parse_der( chain, buf, buflen );
+}
+
+void tls_session_cache_get_stats( struct tls_session_cache_stats *const out )
+{
+	lock();
+	*out = stats;
+	unlock();
+}
+
+void tls_session_cache_log_stats( void )
+{
+	struct tls_session_cache_stats s;
+
+	tls_session_cache_get_stats( &s );
+	ESP_LOGI(
+		TAG,
+		"lookups %" PRIu32 ", hits %" PRIu32 " (%" PRIu32 "%%), stored %" PRIu32 ", evicted %" PRIu32
+		", expired %" PRIu32,
+		s.lookups,
+		s.hits,
+		s.lookups ? s.hits * 100 / s.lookups : 0,
+		s.stored,
+		s.evicted,
+		s.expired );
+	ESP_LOGI(
+		TAG,
+		"full handshakes %" PRIu32 " avg %" PRIu32 " ms, resumed %" PRIu32 " avg %" PRIu32 " ms, failed %" PRIu32,
+		s.full_handshakes,
+		s.full_handshakes ? ( uint32_t )( s.full_us / s.full_handshakes / 1000 ) : 0,
+		s.resumed_handshakes,
+		s.resumed_handshakes ? ( uint32_t )( s.resumed_us / s.resumed_handshakes / 1000 ) : 0,
+		s.failed_handshakes );
+}
+
+void tls_session_cache_flush( void )
+{
+	lock();
+	for ( size_t i = 0; i < CONFIG_TLS_SESSION_CACHE_SIZE; ++i )
+		if ( cache[ i ].used )
+			drop( &cache[ i ] );
+	unlock();
+}
+
+#endif
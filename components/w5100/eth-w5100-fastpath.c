@@ -0,0 +1,253 @@
+
+#include "eth-w5100-fastpath.h"
+
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "eth-w5100-hooks.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+#include <string.h>
+
+#ifdef CONFIG_W5100_FASTPATH
+
+#define ETH_HDR_LEN		 14
+#define ETHTYPE_IPV4	 0x0800
+#define ETHTYPE_ARP		 0x0806
+#define ARP_LEN			 28
+#define ARP_OP_REQUEST	 1
+#define ARP_OP_REPLY	 2
+#define IP_PROTO_ICMP	 1
+#define IP_FLAG_MF		 0x2000
+#define IP_OFFSET_MASK	 0x1FFF
+#define ICMP_ECHO_REPLY	 0
+#define ICMP_ECHO		 8
+#define REPLY_TTL		 64
+#define US_PER_S		 1000000LL
+
+/** Refilled continuously, holds at most one second's worth */
+struct bucket
+{
+	int64_t tokens_us;
+	int64_t last_at;
+};
+
+static struct w5100_fastpath_stats stats;
+static portMUX_TYPE fastpath_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Only used from the driver's RX task */
+static struct bucket arp_bucket, icmp_bucket;
+
+/* The interface's address, kept current by the IP events rather than asked for on every frame */
+static esp_netif_t *addr_netif;
+static uint32_t addr_ip;  // Network order, 0 while there is none
+static uint8_t addr_mac[ 6 ];
+
+static inline uint16_t be16( const uint8_t *const p )
+{
+	return p[ 0 ] << 8 | p[ 1 ];
+}
+
+static inline void put_be16( uint8_t *const p, const uint16_t v )
+{
+	p[ 0 ] = v >> 8;
+	p[ 1 ] = v;
+}
+
+/** Each token is worth US_PER_S / pps microseconds of budget */
+static bool bucket_take( struct bucket *const b, const uint32_t pps )
+{
+	const int64_t now = esp_timer_get_time();
+
+	b->tokens_us += now - b->last_at;
+	if ( b->tokens_us > US_PER_S )
+		b->tokens_us = US_PER_S;
+	b->last_at = now;
+	if ( b->tokens_us < US_PER_S / pps )
+		return false;
+	b->tokens_us -= US_PER_S / pps;
+	return true;
+}
+
+static uint16_t ip_checksum( const uint8_t *const p, const size_t len )
+{
+	uint32_t sum = 0;
+
+	for ( size_t i = 0; i + 1 < len; i += 2 )
+		sum += be16( p + i );
+	while ( sum >> 16 )
+		sum = ( sum & 0xFFFF ) + ( sum >> 16 );
+	return ~sum;
+}
+
+static void count( uint32_t *const counter )
+{
+	portENTER_CRITICAL( &fastpath_mux );
+	++*counter;
+	++stats.lwip_bypassed;
+	portEXIT_CRITICAL( &fastpath_mux );
+}
+
+static void reply( esp_netif_t *const netif, uint8_t *const frame, const size_t len, uint32_t *const counter )
+{
+	if ( esp_netif_transmit( netif, frame, len ) == ESP_OK )
+		count( counter );
+	else
+		count( &stats.tx_failed );
+}
+
+/** ARP request for our address, turned into the reply */
+static bool arp_input(
+	esp_netif_t *const netif,
+	uint8_t *const frame,
+	const size_t len,
+	const uint8_t mac[ 6 ],
+	const uint8_t ip[ 4 ] )
+{
+	uint8_t *const arp = frame + ETH_HDR_LEN;
+
+	if ( len < ETH_HDR_LEN + ARP_LEN || be16( arp ) != 1 || be16( arp + 2 ) != ETHTYPE_IPV4 || arp[ 4 ] != 6
+		 || arp[ 5 ] != 4 || be16( arp + 6 ) != ARP_OP_REQUEST || memcmp( arp + 24, ip, 4 ) )
+		return false;
+
+	if ( !bucket_take( &arp_bucket, CONFIG_W5100_FASTPATH_ARP_PPS ) )
+	{
+		count( &stats.arp_limited );
+		return true;
+	}
+
+	put_be16( arp + 6, ARP_OP_REPLY );
+	memcpy( arp + 18, arp + 8, 10 );  // Sender becomes target
+	memcpy( arp + 8, mac, 6 );
+	memcpy( arp + 14, ip, 4 );
+	memcpy( frame, arp + 18, 6 );
+	memcpy( frame + 6, mac, 6 );
+	reply( netif, frame, len, &stats.arp_replies );
+	return true;
+}
+
+/** Unfragmented echo request to our unicast address, turned into the reply */
+static bool icmp_input(
+	esp_netif_t *const netif,
+	uint8_t *const frame,
+	const size_t len,
+	const uint8_t mac[ 6 ],
+	const uint8_t ip[ 4 ] )
+{
+	uint8_t *const l3 = frame + ETH_HDR_LEN;
+	const size_t l3_len = len - ETH_HDR_LEN;
+
+	if ( l3_len < 20 || l3[ 0 ] >> 4 != 4 || l3[ 9 ] != IP_PROTO_ICMP || memcmp( l3 + 16, ip, 4 ) )
+		return false;
+
+	const size_t ihl = ( l3[ 0 ] & 0x0F ) * 4;
+	const size_t tot = be16( l3 + 2 );
+	if ( ihl < 20 || tot > l3_len || tot < ihl + 8 || be16( l3 + 6 ) & ( IP_FLAG_MF | IP_OFFSET_MASK )
+		 || ip_checksum( l3, ihl ) )
+		return false;
+
+	uint8_t *const icmp = l3 + ihl;
+	if ( icmp[ 0 ] != ICMP_ECHO || icmp[ 1 ] )
+		return false;
+
+	if ( !bucket_take( &icmp_bucket, CONFIG_W5100_FASTPATH_ICMP_PPS ) )
+	{
+		count( &stats.icmp_limited );
+		return true;
+	}
+
+	// Only the type changes, so the checksum is patched rather than recomputed over the payload (RFC 1624)
+	icmp[ 0 ] = ICMP_ECHO_REPLY;
+	uint32_t sum = be16( icmp + 2 ) + ( ICMP_ECHO << 8 );
+	put_be16( icmp + 2, sum + ( sum >> 16 ) );
+
+	memcpy( l3 + 16, l3 + 12, 4 );
+	memcpy( l3 + 12, ip, 4 );
+	l3[ 8 ] = REPLY_TTL;
+	put_be16( l3 + 10, 0 );
+	put_be16( l3 + 10, ip_checksum( l3, ihl ) );
+
+	memcpy( frame, frame + 6, 6 );
+	memcpy( frame + 6, mac, 6 );
+	reply( netif, frame, ETH_HDR_LEN + tot, &stats.icmp_replies );
+	return true;
+}
+
+static void ip_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
+{
+	if ( event_id == IP_EVENT_ETH_GOT_IP )
+	{
+		const ip_event_got_ip_t *const event = event_data;
+		uint8_t mac[ 6 ];
+
+		if ( esp_netif_get_mac( event->esp_netif, mac ) != ESP_OK )
+			return;
+		portENTER_CRITICAL( &fastpath_mux );
+		addr_netif = event->esp_netif;
+		addr_ip = event->ip_info.ip.addr;
+		memcpy( addr_mac, mac, sizeof( mac ) );
+		portEXIT_CRITICAL( &fastpath_mux );
+	}
+	else
+	{
+		portENTER_CRITICAL( &fastpath_mux );
+		addr_ip = 0;
+		portEXIT_CRITICAL( &fastpath_mux );
+	}
+}
+
+void w5100_fastpath_start( void )
+{
+	ESP_ERROR_CHECK( esp_event_handler_register( IP_EVENT, IP_EVENT_ETH_GOT_IP, ip_event_handler, NULL ) );
+	ESP_ERROR_CHECK( esp_event_handler_register( IP_EVENT, IP_EVENT_ETH_LOST_IP, ip_event_handler, NULL ) );
+}
+
+void w5100_fastpath_stop( void )
+{
+	esp_event_handler_unregister( IP_EVENT, IP_EVENT_ETH_GOT_IP, ip_event_handler );
+	esp_event_handler_unregister( IP_EVENT, IP_EVENT_ETH_LOST_IP, ip_event_handler );
+	portENTER_CRITICAL( &fastpath_mux );
+	addr_ip = 0;
+	portEXIT_CRITICAL( &fastpath_mux );
+}
+
+bool w5100_fastpath_input( esp_netif_t *const netif, uint8_t *const frame, const size_t len )
+{
+	uint32_t ip_addr;
+	uint8_t mac[ 6 ];
+
+	if ( len < ETH_HDR_LEN )
+		return false;
+
+	const uint16_t type = be16( frame + 12 );
+	if ( type != ETHTYPE_ARP && type != ETHTYPE_IPV4 )
+		return false;
+
+	portENTER_CRITICAL( &fastpath_mux );
+	ip_addr = netif == addr_netif ? addr_ip : 0;
+	memcpy( mac, addr_mac, sizeof( mac ) );
+	portEXIT_CRITICAL( &fastpath_mux );
+	// No address yet, DHCP and friends are lwIP's business
+	if ( !ip_addr )
+		return false;
+
+	const uint8_t *const ip = ( const uint8_t * )&ip_addr;
+	return type == ETHTYPE_ARP ? arp_input( netif, frame, len, mac, ip ) : icmp_input( netif, frame, len, mac, ip );
+}
+
+void w5100_fastpath_get_stats( struct w5100_fastpath_stats *const out )
+{
+	portENTER_CRITICAL( &fastpath_mux );
+	*out = stats;
+	portEXIT_CRITICAL( &fastpath_mux );
+}
+
+void w5100_fastpath_reset_stats( void )
+{
+	portENTER_CRITICAL( &fastpath_mux );
+	memset( &stats, 0, sizeof( stats ) );
+	portEXIT_CRITICAL( &fastpath_mux );
+}
+
+#endif
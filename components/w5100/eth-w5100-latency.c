@@ -0,0 +1,208 @@
+
+#include "eth-w5100-latency.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "eth-w5100-hooks.h"
+#include "eth-w5100-regs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include <string.h>
+
+#ifdef CONFIG_W5100_LATENCY_HIST
+
+#define TX_INFLIGHT_MAX 4
+
+static const char *TAG = "w5100_lat";
+
+static const char *const stage_names[ W5100_LAT_STAGE_MAX ] = {
+	[W5100_LAT_RX_POLL_TO_SPI] = "rx poll->spi",
+	[W5100_LAT_RX_SPI_TO_NETIF] = "rx spi->netif",
+	[W5100_LAT_RX_TOTAL] = "rx total",
+	[W5100_LAT_TX_OUTPUT_TO_SPI] = "tx output->spi",
+	[W5100_LAT_TX_SPI_TO_SEND_OK] = "tx spi->send_ok",
+	[W5100_LAT_TX_TOTAL] = "tx total",
+};
+
+static struct w5100_lat_hist hists[ W5100_LAT_STAGE_MAX ];
+static portMUX_TYPE lat_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* RX side only ever runs in the driver's RX task */
+static int64_t rx_seen_at;
+static int64_t rx_read_at;
+
+/* Frames being handed to the driver right now, by the task handing each over, which is the one writing its SEND */
+static struct
+{
+	TaskHandle_t task;
+	int64_t output_at;
+} tx_inflight[ TX_INFLIGHT_MAX ];
+
+/* The frame last sent, until Sn_IR reports SEND_OK */
+static struct
+{
+	int64_t current_output_at;
+	int64_t send_at;
+} tx;
+
+static inline uint32_t bucket_of( const uint32_t us )
+{
+	const uint32_t b = us < 2 ? 0 : 31 - __builtin_clz( us );
+	return b < W5100_LAT_BUCKETS ? b : W5100_LAT_BUCKETS - 1;
+}
+
+static void record( const enum w5100_lat_stage stage, const int64_t from, const int64_t to )
+{
+	const uint32_t us = to > from ? to - from : 0;
+	struct w5100_lat_hist *const h = &hists[ stage ];
+
+	portENTER_CRITICAL_SAFE( &lat_mux );
+	++h->buckets[ bucket_of( us ) ];
+	++h->count;
+	h->total_us += us;
+	if ( us > h->max_us )
+		h->max_us = us;
+	portEXIT_CRITICAL_SAFE( &lat_mux );
+}
+
+void w5100_lat_on_read( const uint16_t addr, const uint8_t *const data, const uint32_t size )
+{
+	if ( addr == W5100_S0_RX_RSR && size == 2 )
+	{
+		if ( !rx_seen_at && ( data[ 0 ] || data[ 1 ] ) )
+			rx_seen_at = esp_timer_get_time();
+	}
+	else if ( addr >= W5100_RX_MEM_BASE && addr < W5100_MEM_END )
+		rx_read_at = esp_timer_get_time();
+	else if ( addr == W5100_S0_IR && size == 1 && data[ 0 ] & W5100_SN_IR_SEND_OK && tx.send_at )
+	{
+		const int64_t now = esp_timer_get_time();
+		record( W5100_LAT_TX_SPI_TO_SEND_OK, tx.send_at, now );
+		if ( tx.current_output_at )
+			record( W5100_LAT_TX_TOTAL, tx.current_output_at, now );
+		tx.send_at = 0;
+	}
+}
+
+void w5100_lat_on_write( const uint16_t addr, const uint8_t *const data, const uint32_t size )
+{
+	if ( addr != W5100_S0_CR || size != 1 || data[ 0 ] != W5100_SN_CR_SEND )
+		return;
+
+	const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+	const int64_t now = esp_timer_get_time();
+	int64_t output_at = 0;
+
+	portENTER_CRITICAL( &lat_mux );
+	for ( size_t i = 0; i < TX_INFLIGHT_MAX; ++i )
+		if ( tx_inflight[ i ].task == self )
+		{
+			output_at = tx_inflight[ i ].output_at;
+			tx_inflight[ i ].output_at = 0;
+			break;
+		}
+	portEXIT_CRITICAL( &lat_mux );
+
+	if ( output_at )
+		record( W5100_LAT_TX_OUTPUT_TO_SPI, output_at, now );
+	tx.current_output_at = output_at;
+	tx.send_at = now;
+}
+
+void w5100_lat_rx_netif( void )
+{
+	const int64_t now = esp_timer_get_time();
+
+	if ( rx_read_at )
+	{
+		if ( rx_seen_at )
+		{
+			record( W5100_LAT_RX_POLL_TO_SPI, rx_seen_at, rx_read_at );
+			record( W5100_LAT_RX_TOTAL, rx_seen_at, now );
+		}
+		record( W5100_LAT_RX_SPI_TO_NETIF, rx_read_at, now );
+	}
+	// Any frame still queued in the chip is timed from the next Sn_RX_RSR read
+	rx_seen_at = 0;
+	rx_read_at = 0;
+}
+
+void w5100_lat_tx_begin( const int64_t output_at )
+{
+	const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+	// More tasks sending at once than there are entries leaves the extra frames untimed
+	portENTER_CRITICAL( &lat_mux );
+	for ( size_t i = 0; i < TX_INFLIGHT_MAX; ++i )
+		if ( !tx_inflight[ i ].task || tx_inflight[ i ].task == self )
+		{
+			tx_inflight[ i ].task = self;
+			tx_inflight[ i ].output_at = output_at;
+			break;
+		}
+	portEXIT_CRITICAL( &lat_mux );
+}
+
+void w5100_lat_tx_end( void )
+{
+	const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+	portENTER_CRITICAL( &lat_mux );
+	for ( size_t i = 0; i < TX_INFLIGHT_MAX; ++i )
+		if ( tx_inflight[ i ].task == self )
+			memset( &tx_inflight[ i ], 0, sizeof( tx_inflight[ i ] ) );
+	portEXIT_CRITICAL( &lat_mux );
+}
+
+void w5100_lat_get( const enum w5100_lat_stage stage, struct w5100_lat_hist *const out )
+{
+	portENTER_CRITICAL( &lat_mux );
+	*out = hists[ stage ];
+	portEXIT_CRITICAL( &lat_mux );
+}
+
+/** Upper bound of the bucket holding the given percentile */
+static uint32_t percentile_us( const struct w5100_lat_hist *const h, const uint32_t pct )
+{
+	const uint32_t target = ( ( uint64_t )h->count * pct + 99 ) / 100;
+	uint32_t seen = 0;
+
+	for ( uint32_t b = 0; b < W5100_LAT_BUCKETS - 1; ++b )
+		if ( ( seen += h->buckets[ b ] ) >= target )
+			return 2 << b;
+	return h->max_us;
+}
+
+void w5100_lat_dump( void )
+{
+	struct w5100_lat_hist h;
+
+	ESP_LOGI( TAG, "%-16s %8s %8s %8s %8s %8s %8s", "stage", "count", "avg", "p50<", "p90<", "p99<", "max" );
+	for ( enum w5100_lat_stage s = 0; s < W5100_LAT_STAGE_MAX; ++s )
+	{
+		w5100_lat_get( s, &h );
+		if ( !h.count )
+			continue;
+		ESP_LOGI(
+			TAG,
+			"%-16s %8" PRIu32 " %8" PRIu32 " %8" PRIu32 " %8" PRIu32 " %8" PRIu32 " %8" PRIu32,
+			stage_names[ s ],
+			h.count,
+			( uint32_t )( h.total_us / h.count ),
+			percentile_us( &h, 50 ),
+			percentile_us( &h, 90 ),
+			percentile_us( &h, 99 ),
+			h.max_us );
+	}
+}
+
+void w5100_lat_reset( void )
+{
+	portENTER_CRITICAL( &lat_mux );
+	memset( hists, 0, sizeof( hists ) );
+	portEXIT_CRITICAL( &lat_mux );
+}
+
+#endif
@@ -4,7 +4,11 @@
 #include "esp_eth.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "eth-w5100-health.h"
+#include "eth-w5100-hooks.h"
 #include "eth-w5100-ll.h"
+#include "eth-w5100-static.h"
+#include "eth-w5100-txsched.h"
 #include "eth-w5100.h"
 
 #include <stdint.h>
@@ -20,6 +24,14 @@ struct
 static const char *TAG = "w5100_main";
 EventGroupHandle_t eth_ev;
 
+__attribute__( ( weak ) ) void w5100_hot_begin( void )
+{
+}
+
+__attribute__( ( weak ) ) void w5100_hot_end( void )
+{
+}
+
 /** Event handler for Ethernet events */
 static void eth_event_handler( void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data )
 {
@@ -74,7 +86,7 @@ static void got_ip_event_handler( void *arg, esp_event_base_t event_base, int32_
 
 static void init( void )
 {
-	eth_ev = xEventGroupCreate();
+	eth_ev = W5100_EVENT_GROUP_CREATE();
 
 	// Register user defined event handers
 	ESP_ERROR_CHECK( esp_event_handler_instance_register(
@@ -95,6 +107,15 @@ static void init( void )
 void deinit( void )
 {
 	ESP_LOGD( TAG, "Starting deinit" );
+#ifdef CONFIG_W5100_HEALTH_MONITOR
+	w5100_health_stop();
+#endif
+#ifdef CONFIG_W5100_TX_SCHEDULER
+	w5100_txsched_stop();
+#endif
+#ifdef CONFIG_W5100_FASTPATH
+	w5100_fastpath_stop();
+#endif
 	eth_deinit();
 	ESP_ERROR_CHECK( esp_event_handler_instance_unregister( IP_EVENT, IP_EVENT_ETH_GOT_IP, evt_hdls.got_ip_evt_hdl ) );
 	ESP_ERROR_CHECK( esp_event_handler_instance_unregister( ETH_EVENT, ESP_EVENT_ANY_ID, evt_hdls.eth_evt_hdl ) );
@@ -109,6 +130,12 @@ void deinit( void )
 void w5100_start()
 {
 	init();
+#ifdef CONFIG_W5100_FASTPATH
+	w5100_fastpath_start();
+#endif
+#ifdef CONFIG_W5100_TX_SCHEDULER
+	w5100_txsched_start();
+#endif
 	eth_init( &( struct eth_ifconfig ){
 		.hostname = "w5100_esp32",
 		.w5100_cfg =
@@ -131,5 +158,8 @@ void w5100_start()
 		},
 #endif
 	} );
+#ifdef CONFIG_W5100_HEALTH_MONITOR
+	w5100_health_start();
+#endif
 	xEventGroupWaitBits( eth_ev, GOT_IPV4, pdFALSE, pdTRUE, portMAX_DELAY );
 }
@@ -0,0 +1,46 @@
+
+#include "esp_timer.h"
+#include "eth-w5100-hooks.h"
+#include "eth-w5100-main.h"
+#include "sdkconfig.h"
+
+#include <stdlib.h>
+
+#ifdef CONFIG_W5100_WRAP_ETH_TRANSMIT
+esp_err_t __wrap_esp_eth_transmit( esp_eth_handle_t hdl, void *buf, size_t length )
+{
+	const int64_t output_at = esp_timer_get_time();
+	esp_err_t err;
+
+	w5100_hot_begin();
+#ifdef CONFIG_W5100_TX_SCHEDULER
+	err = w5100_txsched_enqueue( hdl, buf, length, output_at );
+#else
+	err = w5100_transmit( hdl, buf, length, output_at );
+#endif
+	w5100_hot_end();
+	return err;
+}
+#endif
+
+#ifdef CONFIG_W5100_WRAP_NETIF_RECEIVE
+esp_err_t __wrap_esp_netif_receive( esp_netif_t *esp_netif, void *buffer, size_t len, void *eb )
+{
+#ifdef CONFIG_W5100_LATENCY_HIST
+	w5100_lat_rx_netif();
+#endif
+#ifdef CONFIG_W5100_FASTPATH
+	// Answered or dropped without going near lwIP, the buffer is ours to free
+	w5100_hot_begin();
+	const bool consumed = w5100_fastpath_input( esp_netif, buffer, len );
+	w5100_hot_end();
+	if ( consumed )
+	{
+		// What lwIP's own path does for Ethernet, the esp_eth glue has no driver_free_rx_buffer
+		free( buffer );
+		return ESP_OK;
+	}
+#endif
+	return __real_esp_netif_receive( esp_netif, buffer, len, eb );
+}
+#endif
@@ -0,0 +1,408 @@
+
+#include "eth-w5100-txsched.h"
+
+#include "esp_eth.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "eth-w5100-hooks.h"
+#include "eth-w5100-main.h"
+#include "eth-w5100-static.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#ifdef CONFIG_W5100_TX_SCHEDULER
+
+#define FRAME_MAX		 1514
+#define POOL_SIZE \
+	( CONFIG_W5100_TXSCHED_CONTROL_LIMIT + CONFIG_W5100_TXSCHED_INTERACTIVE_LIMIT + CONFIG_W5100_TXSCHED_BULK_LIMIT )
+#define NO_SLOT			 UINT8_MAX
+#define MAX_INTER_PORTS	 8
+#define ETHTYPE_IPV4	 0x0800
+#define ETHTYPE_ARP		 0x0806
+#define ETHTYPE_IPV6	 0x86DD
+#define IP_PROTO_ICMP	 1
+#define IP_PROTO_TCP	 6
+#define IP_PROTO_UDP	 17
+#define IP_PROTO_ICMPV6	 58
+#define TXSCHED_STACK	 3072
+#define DSCP_EF			 46
+#define DSCP_CS6		 48
+
+_Static_assert( POOL_SIZE < NO_SLOT, "TX scheduler queue limits too large" );
+
+struct slot
+{
+	int64_t enqueued_at;  // When it came into esp_eth_transmit()
+	uint16_t len;
+	uint8_t next;
+	uint8_t data[ FRAME_MAX ];
+};
+
+struct txq
+{
+	uint8_t head;
+	uint8_t tail;
+	uint16_t limit;
+	uint32_t quantum;
+	int32_t deficit;
+	struct w5100_txq_stats stats;
+};
+
+static const char *TAG = "w5100_txsched";
+
+static struct slot pool[ POOL_SIZE ];
+static uint8_t free_head;
+static struct txq queues[ W5100_TXQ_MAX ];
+static uint32_t control_run;  // Control frames picked in a row while another class was waiting
+static uint16_t inter_ports[ MAX_INTER_PORTS ];
+static size_t inter_ports_n;
+static esp_eth_handle_t eth_hdl;
+static TaskHandle_t txsched_task_hdl;
+W5100_TASK_DEFINE( txsched_task, TXSCHED_STACK );
+static volatile bool txsched_running;  // Cleared under txsched_mux, so an enqueue sees it either before or after
+static uint32_t notifying;			   // Enqueues between queueing a frame and notifying the task
+static portMUX_TYPE txsched_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint16_t be16( const uint8_t *const p )
+{
+	return p[ 0 ] << 8 | p[ 1 ];
+}
+
+static bool is_inter_port( const uint16_t port )
+{
+	for ( size_t i = 0; i < inter_ports_n; ++i )
+		if ( inter_ports[ i ] == port )
+			return true;
+	return false;
+}
+
+static enum w5100_txq_class classify_dscp( const uint8_t dscp )
+{
+	if ( dscp >= DSCP_CS6 || dscp == DSCP_EF )
+		return W5100_TXQ_CONTROL;
+	if ( dscp >= 24 && dscp <= 40 )  // CS3 up to CS5, which covers AF3x and AF4x
+		return W5100_TXQ_INTERACTIVE;
+	return W5100_TXQ_BULK;
+}
+
+static enum w5100_txq_class classify_l4(
+	const uint8_t proto,
+	const uint8_t *const l4,
+	const size_t l4_len,
+	const enum w5100_txq_class by_dscp )
+{
+	if ( proto == IP_PROTO_ICMP || proto == IP_PROTO_ICMPV6 )
+		return W5100_TXQ_CONTROL;
+	if ( by_dscp != W5100_TXQ_BULK )
+		return by_dscp;
+
+	if ( proto == IP_PROTO_UDP && l4_len >= 8 )
+	{
+		const uint16_t sport = be16( l4 ), dport = be16( l4 + 2 );
+		// DNS, DHCP and NTP
+		if ( sport == 53 || dport == 53 || dport == 67 || dport == 68 || dport == 123 )
+			return W5100_TXQ_CONTROL;
+		return is_inter_port( sport ) || is_inter_port( dport ) ? W5100_TXQ_INTERACTIVE : W5100_TXQ_BULK;
+	}
+
+	if ( proto == IP_PROTO_TCP && l4_len >= 20 )
+	{
+		const size_t doff = ( l4[ 12 ] >> 4 ) * 4;
+		const size_t payload = l4_len > doff ? l4_len - doff : 0;
+		// Pure ACKs and handshakes keep every flow moving, bulk ones included
+		if ( !payload )
+			return W5100_TXQ_CONTROL;
+		if ( ( is_inter_port( be16( l4 ) ) || is_inter_port( be16( l4 + 2 ) ) )
+			 && payload <= CONFIG_W5100_TXSCHED_INTERACTIVE_MAX_PAYLOAD )
+			return W5100_TXQ_INTERACTIVE;
+	}
+	return W5100_TXQ_BULK;
+}
+
+static enum w5100_txq_class classify( const uint8_t *const frame, const size_t len )
+{
+	if ( len < 14 )
+		return W5100_TXQ_BULK;
+
+	const uint8_t *const l3 = frame + 14;
+	const size_t l3_len = len - 14;
+
+	switch ( be16( frame + 12 ) )
+	{
+		case ETHTYPE_ARP:
+			return W5100_TXQ_CONTROL;
+		case ETHTYPE_IPV4:
+		{
+			if ( l3_len < 20 )
+				break;
+			const size_t ihl = ( l3[ 0 ] & 0x0F ) * 4;
+			const size_t tot = MIN( be16( l3 + 2 ), l3_len );
+			if ( ihl < 20 || tot < ihl )
+				break;
+			return classify_l4( l3[ 9 ], l3 + ihl, tot - ihl, classify_dscp( l3[ 1 ] >> 2 ) );
+		}
+		case ETHTYPE_IPV6:
+		{
+			if ( l3_len < 40 )
+				break;
+			const uint8_t tclass = ( l3[ 0 ] & 0x0F ) << 4 | l3[ 1 ] >> 4;
+			return classify_l4( l3[ 6 ], l3 + 40, MIN( be16( l3 + 4 ), l3_len - 40 ), classify_dscp( tclass >> 2 ) );
+		}
+		default:
+			break;
+	}
+	return W5100_TXQ_BULK;
+}
+
+/**
+ * Control first, but for one frame from the others after every CONFIG_W5100_TXSCHED_CONTROL_BURST, deficit round robin
+ * between the others. Called with txsched_mux held.
+ */
+static enum w5100_txq_class pick_queue( void )
+{
+	const bool control = queues[ W5100_TXQ_CONTROL ].head != NO_SLOT;
+	const bool others = queues[ W5100_TXQ_INTERACTIVE ].head != NO_SLOT || queues[ W5100_TXQ_BULK ].head != NO_SLOT;
+
+	if ( control && ( !others || control_run < CONFIG_W5100_TXSCHED_CONTROL_BURST ) )
+	{
+		control_run = others ? control_run + 1 : 0;
+		return W5100_TXQ_CONTROL;
+	}
+	control_run = 0;
+
+	for ( int round = 0; round < 2; ++round )
+	{
+		for ( enum w5100_txq_class c = W5100_TXQ_INTERACTIVE; c < W5100_TXQ_MAX; ++c )
+		{
+			struct txq *const q = &queues[ c ];
+			if ( q->head == NO_SLOT )
+			{
+				q->deficit = 0;
+				continue;
+			}
+			if ( q->deficit >= pool[ q->head ].len )
+				return c;
+		}
+		for ( enum w5100_txq_class c = W5100_TXQ_INTERACTIVE; c < W5100_TXQ_MAX; ++c )
+			if ( queues[ c ].head != NO_SLOT )
+				queues[ c ].deficit += queues[ c ].quantum;
+	}
+	return W5100_TXQ_MAX;
+}
+
+static void txsched_task( void *p )
+{
+	while ( txsched_running )
+	{
+		ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+
+		while ( txsched_running )
+		{
+			portENTER_CRITICAL( &txsched_mux );
+			const enum w5100_txq_class c = pick_queue();
+			if ( c == W5100_TXQ_MAX )
+			{
+				portEXIT_CRITICAL( &txsched_mux );
+				break;
+			}
+			struct txq *const q = &queues[ c ];
+			const uint8_t idx = q->head;
+			q->head = pool[ idx ].next;
+			if ( q->head == NO_SLOT )
+				q->tail = NO_SLOT;
+			q->deficit -= pool[ idx ].len;
+			--q->stats.depth;
+			portEXIT_CRITICAL( &txsched_mux );
+
+			const uint32_t delay = esp_timer_get_time() - pool[ idx ].enqueued_at;
+			w5100_hot_begin();
+			const esp_err_t err = w5100_transmit( eth_hdl, pool[ idx ].data, pool[ idx ].len, pool[ idx ].enqueued_at );
+			w5100_hot_end();
+			if ( err != ESP_OK )
+				ESP_LOGD( TAG, "Driver rejected a %u byte frame", pool[ idx ].len );
+
+			portENTER_CRITICAL( &txsched_mux );
+			++q->stats.sent;
+			q->stats.bytes += pool[ idx ].len;
+			q->stats.delay_total_us += delay;
+			if ( delay > q->stats.delay_max_us )
+				q->stats.delay_max_us = delay;
+			pool[ idx ].next = free_head;
+			free_head = idx;
+			portEXIT_CRITICAL( &txsched_mux );
+		}
+	}
+
+	// An enqueue that queued before the stop may still be about to notify this task
+	for ( ;; )
+	{
+		portENTER_CRITICAL( &txsched_mux );
+		const bool busy = notifying;
+		portEXIT_CRITICAL( &txsched_mux );
+		if ( !busy )
+			break;
+		vTaskDelay( 1 );
+	}
+	w5100_task_exit( &txsched_task_hdl );
+}
+
+esp_err_t w5100_txsched_enqueue( esp_eth_handle_t hdl, const void *buf, size_t length, const int64_t output_at )
+{
+	if ( !txsched_running || length > FRAME_MAX )
+		return w5100_transmit( hdl, ( void * )buf, length, output_at );
+
+	const enum w5100_txq_class c = classify( buf, length );
+	struct txq *const q = &queues[ c ];
+
+	portENTER_CRITICAL( &txsched_mux );
+	if ( q->stats.depth >= q->limit || free_head == NO_SLOT )
+	{
+		++q->stats.dropped;
+		portEXIT_CRITICAL( &txsched_mux );
+		return ESP_ERR_NO_MEM;
+	}
+	const uint8_t idx = free_head;
+	free_head = pool[ idx ].next;
+	portEXIT_CRITICAL( &txsched_mux );
+
+	memcpy( pool[ idx ].data, buf, length );
+	pool[ idx ].len = length;
+	pool[ idx ].next = NO_SLOT;
+	pool[ idx ].enqueued_at = output_at;
+
+	portENTER_CRITICAL( &txsched_mux );
+	// Stopped meanwhile, nothing would send it anymore
+	if ( !txsched_running )
+	{
+		pool[ idx ].next = free_head;
+		free_head = idx;
+		portEXIT_CRITICAL( &txsched_mux );
+		return w5100_transmit( hdl, ( void * )buf, length, output_at );
+	}
+	eth_hdl = hdl;
+	if ( q->tail == NO_SLOT )
+		q->head = idx;
+	else
+		pool[ q->tail ].next = idx;
+	q->tail = idx;
+	++q->stats.enqueued;
+	if ( ++q->stats.depth > q->stats.depth_max )
+		q->stats.depth_max = q->stats.depth;
+	const TaskHandle_t task = txsched_task_hdl;
+	++notifying;
+	portEXIT_CRITICAL( &txsched_mux );
+
+	if ( task )
+		xTaskNotifyGive( task );
+	portENTER_CRITICAL( &txsched_mux );
+	--notifying;
+	portEXIT_CRITICAL( &txsched_mux );
+	return ESP_OK;
+}
+
+static void parse_inter_ports( void )
+{
+	const char *s = CONFIG_W5100_TXSCHED_INTERACTIVE_PORTS;
+	char *end;
+
+	inter_ports_n = 0;
+	while ( *s && inter_ports_n < MAX_INTER_PORTS )
+	{
+		const long port = strtol( s, &end, 10 );
+		if ( end == s )
+		{
+			++s;
+			continue;
+		}
+		if ( port > 0 && port <= UINT16_MAX )
+			inter_ports[ inter_ports_n++ ] = port;
+		s = end;
+	}
+}
+
+void w5100_txsched_start( void )
+{
+	static const uint16_t limits[ W5100_TXQ_MAX ] = {
+		[W5100_TXQ_CONTROL] = CONFIG_W5100_TXSCHED_CONTROL_LIMIT,
+		[W5100_TXQ_INTERACTIVE] = CONFIG_W5100_TXSCHED_INTERACTIVE_LIMIT,
+		[W5100_TXQ_BULK] = CONFIG_W5100_TXSCHED_BULK_LIMIT,
+	};
+	static const uint32_t weights[ W5100_TXQ_MAX ] = {
+		[W5100_TXQ_INTERACTIVE] = CONFIG_W5100_TXSCHED_INTERACTIVE_WEIGHT,
+		[W5100_TXQ_BULK] = CONFIG_W5100_TXSCHED_BULK_WEIGHT,
+	};
+
+	parse_inter_ports();
+	for ( size_t i = 0; i < POOL_SIZE; ++i )
+		pool[ i ].next = i + 1 < POOL_SIZE ? i + 1 : NO_SLOT;
+	free_head = 0;
+	control_run = 0;
+	for ( enum w5100_txq_class c = 0; c < W5100_TXQ_MAX; ++c )
+		queues[ c ] = ( struct txq ) {
+			.head = NO_SLOT, .tail = NO_SLOT, .limit = limits[ c ], .quantum = weights[ c ] * FRAME_MAX
+		};
+
+	txsched_running = true;
+	ESP_ERROR_CHECK(
+		pdPASS
+		!= W5100_TASK_CREATE(
+			txsched_task,
+			txsched_task,
+			"w5100_txsched",
+			TXSCHED_STACK,
+			CONFIG_W5100_TXSCHED_TASK_PRIORITY,
+			&txsched_task_hdl ) );
+}
+
+void w5100_txsched_stop( void )
+{
+	if ( !txsched_task_hdl )
+		return;
+	portENTER_CRITICAL( &txsched_mux );
+	txsched_running = false;
+	portEXIT_CRITICAL( &txsched_mux );
+	xTaskNotifyGive( txsched_task_hdl );
+	w5100_task_join( &txsched_task_hdl );
+
+	// Whatever is still queued is not going out, lwIP retransmits what matters
+	portENTER_CRITICAL( &txsched_mux );
+	for ( enum w5100_txq_class c = 0; c < W5100_TXQ_MAX; ++c )
+	{
+		struct txq *const q = &queues[ c ];
+		while ( q->head != NO_SLOT )
+		{
+			const uint8_t idx = q->head;
+			q->head = pool[ idx ].next;
+			pool[ idx ].next = free_head;
+			free_head = idx;
+		}
+		q->tail = NO_SLOT;
+		q->stats.dropped += q->stats.depth;
+		q->stats.depth = 0;
+	}
+	portEXIT_CRITICAL( &txsched_mux );
+}
+
+void w5100_txsched_get_stats( struct w5100_txq_stats stats[ W5100_TXQ_MAX ] )
+{
+	portENTER_CRITICAL( &txsched_mux );
+	for ( enum w5100_txq_class c = 0; c < W5100_TXQ_MAX; ++c )
+		stats[ c ] = queues[ c ].stats;
+	portEXIT_CRITICAL( &txsched_mux );
+}
+
+void w5100_txsched_reset_stats( void )
+{
+	portENTER_CRITICAL( &txsched_mux );
+	for ( enum w5100_txq_class c = 0; c < W5100_TXQ_MAX; ++c )
+		queues[ c ].stats = ( struct w5100_txq_stats ) { .depth = queues[ c ].stats.depth };
+	portEXIT_CRITICAL( &txsched_mux );
+}
+
+#endif
@@ -0,0 +1,34 @@
+
+#pragma once
+
+#include "driver/spi_master.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Per-device bus accounting. Entry 0 is always the W5100, co-tenants follow in registration order. */
+struct w5100_bus_dev_stats
+{
+	const char *name;
+	uint64_t busy_us;		// Time spent holding the bus
+	uint64_t total_wait_us; // Time spent waiting to get the bus
+	uint32_t max_wait_us;	// Worst single wait for the bus
+	uint32_t holds;
+};
+
+/**
+ * Adds another device to the W5100 SPI host. Only available with CONFIG_W5100_SPI_SHARED_BUS, since the exclusive
+ * mode keeps the bus acquired for the lifetime of the driver.
+ */
+esp_err_t w5100_bus_add_cotenant(
+	const char *name,
+	const spi_device_interface_config_t *const dev_cfg,
+	spi_device_handle_t *const handle );
+esp_err_t w5100_bus_remove_cotenant( spi_device_handle_t handle );
+
+/** spi_device_transmit() for co-tenants, holding the bus for a single transaction and accounting it */
+esp_err_t w5100_bus_transmit( spi_device_handle_t handle, spi_transaction_t *const trans );
+
+/** Copies up to max entries, returns how many devices are registered */
+size_t w5100_bus_get_stats( struct w5100_bus_dev_stats *const out, const size_t max );
+void w5100_bus_reset_stats( void );
@@ -0,0 +1,17 @@
+
+#pragma once
+
+#include <stdint.h>
+
+struct w5100_fastpath_stats
+{
+	uint32_t arp_replies;
+	uint32_t icmp_replies;
+	uint32_t arp_limited;	// Requests over CONFIG_W5100_FASTPATH_ARP_PPS, dropped
+	uint32_t icmp_limited;	// Requests over CONFIG_W5100_FASTPATH_ICMP_PPS, dropped
+	uint32_t tx_failed;
+	uint32_t lwip_bypassed;	 // Frames answered or dropped here that never went through the tcpip mailbox
+};
+
+void w5100_fastpath_get_stats( struct w5100_fastpath_stats *const stats );
+void w5100_fastpath_reset_stats( void );
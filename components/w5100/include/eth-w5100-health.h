@@ -0,0 +1,22 @@
+
+#pragma once
+
+#include <stdint.h>
+
+struct w5100_health_stats
+{
+	uint32_t checks;
+	uint32_t recoveries;
+	uint32_t recoveries_over_budget;  // Took longer than CONFIG_W5100_HEALTH_RECOVERY_BUDGET_MS
+	uint32_t cause_mac_lost;		  // SHAR no longer holds our MAC, the chip reset itself
+	uint32_t cause_socket_closed;	  // Socket 0 left MACRAW
+	uint32_t cause_rx_stalled;		  // Sn_RX_RSR kept data pending while Sn_RX_RD never moved
+	uint32_t failed;				  // Chip did not come back after the reset
+	uint32_t quiesce_timeouts;		  // Reset went ahead with a driver RX or TX run still open
+	uint32_t last_recovery_us;
+	uint32_t max_recovery_us;
+};
+
+void w5100_health_start( void );
+void w5100_health_stop( void );
+void w5100_health_get_stats( struct w5100_health_stats *const stats );
@@ -0,0 +1,30 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#define W5100_LAT_BUCKETS 20
+
+enum w5100_lat_stage
+{
+	W5100_LAT_RX_POLL_TO_SPI,	 // Data first seen in Sn_RX_RSR until the last byte of the frame is read
+	W5100_LAT_RX_SPI_TO_NETIF,	 // Frame read until it is handed to the netif
+	W5100_LAT_RX_TOTAL,
+	W5100_LAT_TX_OUTPUT_TO_SPI,	 // esp_eth_transmit() until the SEND command is written
+	W5100_LAT_TX_SPI_TO_SEND_OK, // SEND command until Sn_IR reports SEND_OK
+	W5100_LAT_TX_TOTAL,
+	W5100_LAT_STAGE_MAX
+};
+
+/** Bucket 0 counts samples under 2 us, bucket n samples in [2^n, 2^(n+1)) us, the last one everything above */
+struct w5100_lat_hist
+{
+	uint32_t buckets[ W5100_LAT_BUCKETS ];
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t total_us;
+};
+
+void w5100_lat_get( const enum w5100_lat_stage stage, struct w5100_lat_hist *const out );
+void w5100_lat_dump( void );
+void w5100_lat_reset( void );
@@ -2,3 +2,10 @@
 #pragma once
 
 void w5100_start( void );
+
+/**
+ * Bracket the driver's RX and TX paths, which must not allocate. Empty weak definitions, for a heap profiler to
+ * override.
+ */
+void w5100_hot_begin( void );
+void w5100_hot_end( void );
@@ -0,0 +1,34 @@
+
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <stdint.h>
+
+/* The port's SPI link, also what the link benchmark drives */
+void w5100_spi_init( void );
+void w5100_spi_deinit( void );
+void w5100_ll_hw_reset( void );
+void w5100_read( const uint16_t addr, uint8_t *const data_rx, const uint32_t size );
+void w5100_write( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size );
+void w5100_ll_lock( void );
+void w5100_ll_unlock( void );
+
+/** Re-adds the device at another SCLK rate, waiting for any transfer in progress to finish */
+esp_err_t w5100_ll_set_clock( const int hz );
+int w5100_ll_get_clock( void );
+
+struct w5100_ll_lock_stats
+{
+	uint32_t acquisitions;
+	uint32_t contended;	 // The mutex had a holder when we asked for it
+	uint64_t wait_us;	 // Time spent taking the mutex, waiting included
+	uint64_t held_us;
+};
+
+/** Only counted with CONFIG_W5100_LL_LOCK_STATS, zeros otherwise */
+void w5100_ll_get_lock_stats( struct w5100_ll_lock_stats *const out );
+/** Clears the stats and from then on only counts locking done by task, or by every task if NULL */
+void w5100_ll_reset_lock_stats( TaskHandle_t task );
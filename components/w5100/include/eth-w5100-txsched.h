@@ -0,0 +1,29 @@
+
+#pragma once
+
+#include <stdint.h>
+
+enum w5100_txq_class
+{
+	W5100_TXQ_CONTROL,	  // ARP, ICMP, DNS/DHCP/NTP, DSCP CS6/CS7/EF, TCP without payload. First, up to a burst.
+	W5100_TXQ_INTERACTIVE, // Small segments on the interactive ports, DSCP AF3x/AF4x/CS4/CS5
+	W5100_TXQ_BULK,		  // Everything else
+	W5100_TXQ_MAX
+};
+
+struct w5100_txq_stats
+{
+	uint32_t enqueued;
+	uint32_t sent;
+	uint32_t dropped;  // Queue limit reached or no free frame slot, or still queued when the scheduler stopped
+	uint32_t depth;
+	uint32_t depth_max;
+	uint64_t bytes;
+	uint64_t delay_total_us;  // Time from esp_eth_transmit() to the frame being handed to the driver
+	uint32_t delay_max_us;
+};
+
+void w5100_txsched_start( void );
+void w5100_txsched_stop( void );
+void w5100_txsched_get_stats( struct w5100_txq_stats stats[ W5100_TXQ_MAX ] );
+void w5100_txsched_reset_stats( void );
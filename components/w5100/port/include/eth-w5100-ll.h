@@ -1,10 +1,35 @@
 
 #pragma once
 
+#include "driver/spi_master.h"
+#include "eth-w5100-spi.h"
+#include "sdkconfig.h"
+
+#include <stdbool.h>
 #include <stdint.h>
 
-void w5100_spi_init( void );
-void w5100_spi_deinit( void );
-void w5100_ll_hw_reset( void );
-void w5100_read( const uint16_t addr, uint8_t *const data_rx, const uint32_t size );
-void w5100_write( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size );
+/* Raw accessors for sequences that must not be interleaved with the driver, caller holds w5100_ll_lock() */
+void w5100_ll_read_nolock( const uint16_t addr, uint8_t *const data_rx, const uint32_t size );
+void w5100_ll_write_nolock( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size );
+
+#ifdef CONFIG_W5100_HEALTH_MONITOR
+/**
+ * Holds back the driver's RX and TX paths and waits up to timeout_us for the runs they are in the middle of to finish.
+ * Returns with the lock held either way, false when a run was still open at the deadline.
+ */
+bool w5100_ll_quiesce( const int64_t timeout_us );
+/** Lets the driver back in and drops the lock */
+void w5100_ll_resume( void );
+#endif
+
+/* Configuration shadow, filled from the driver's own register writes */
+bool w5100_ll_shadow_valid( void );
+bool w5100_ll_shadow_mac_matches( const uint8_t mac[ 6 ] );
+void w5100_ll_shadow_restore( void );
+
+#ifdef CONFIG_W5100_SPI_SHARED_BUS
+/* Shared bus arbitration, the W5100 side */
+void w5100_bus_attach( spi_device_handle_t handle );
+void w5100_bus_hold( void );
+void w5100_bus_drop( void );
+#endif
@@ -0,0 +1,52 @@
+
+#pragma once
+
+/* Common registers */
+#define W5100_REG_MR   0x0000
+#define W5100_REG_GAR  0x0001
+#define W5100_REG_SUBR 0x0005
+#define W5100_REG_SHAR 0x0009
+#define W5100_REG_SIPR 0x000F
+#define W5100_REG_IR   0x0015
+#define W5100_REG_IMR  0x0016
+#define W5100_REG_RTR  0x0017
+#define W5100_REG_RCR  0x0019
+#define W5100_REG_RMSR 0x001A
+#define W5100_REG_TMSR 0x001B
+
+#define W5100_COMMON_REGS_SIZE 0x001C
+#define W5100_RTR_DEFAULT	   0x07D0
+#define W5100_MR_RST		   0x80
+
+/* Socket registers, MACRAW always lives in socket 0 */
+#define W5100_SOCK_REG( n, reg ) ( 0x0400 + ( n ) * 0x0100 + ( reg ) )
+#define W5100_SN_MR				 0x00
+#define W5100_SN_CR				 0x01
+#define W5100_SN_IR				 0x02
+#define W5100_SN_SR				 0x03
+#define W5100_SN_TX_FSR			 0x20
+#define W5100_SN_TX_RD			 0x22
+#define W5100_SN_TX_WR			 0x24
+#define W5100_SN_RX_RSR			 0x26
+#define W5100_SN_RX_RD			 0x28
+
+#define W5100_S0_MR		W5100_SOCK_REG( 0, W5100_SN_MR )
+#define W5100_S0_CR		W5100_SOCK_REG( 0, W5100_SN_CR )
+#define W5100_S0_IR		W5100_SOCK_REG( 0, W5100_SN_IR )
+#define W5100_S0_SR		W5100_SOCK_REG( 0, W5100_SN_SR )
+#define W5100_S0_TX_FSR W5100_SOCK_REG( 0, W5100_SN_TX_FSR )
+#define W5100_S0_TX_WR	W5100_SOCK_REG( 0, W5100_SN_TX_WR )
+#define W5100_S0_RX_RSR W5100_SOCK_REG( 0, W5100_SN_RX_RSR )
+#define W5100_S0_RX_RD	W5100_SOCK_REG( 0, W5100_SN_RX_RD )
+
+#define W5100_SN_MR_MACRAW	0x04
+#define W5100_SN_CR_OPEN	0x01
+#define W5100_SN_CR_SEND	0x20
+#define W5100_SN_CR_RECV	0x40
+#define W5100_SN_IR_SEND_OK 0x10
+#define W5100_SN_SR_MACRAW	0x42
+
+/* Buffer memory */
+#define W5100_TX_MEM_BASE 0x4000
+#define W5100_RX_MEM_BASE 0x6000
+#define W5100_MEM_END	  0x8000
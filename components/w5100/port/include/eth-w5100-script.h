@@ -0,0 +1,91 @@
+
+#pragma once
+
+#include "esp_attr.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define W_PCK( address, data ) ( __builtin_bswap32(( 0xF0000000 | ( address ) << 8 | ( data ) )) )
+#define R_PCK( address )	   ( __builtin_bswap32(( 0x0F000000 | ( address ) << 8 )) )
+
+#define W5100_SCRIPT_NONE 0xFF
+
+/**
+ * One prebuilt SPI frame. Writes may take their data byte from the args array passed to the runner, reads scatter
+ * their result byte into the result struct. Writes are seen by the configuration shadow, the reset gate's run tracking
+ * and the latency hooks the way w5100_write() would have shown them; reads only in scripts run for the driver.
+ */
+struct w5100_script_op
+{
+	uint32_t frame;
+	uint16_t addr;
+	uint8_t arg;
+	uint8_t result;
+};
+
+struct w5100_script
+{
+	const char *name;
+	const struct w5100_script_op *ops;
+	size_t n_ops;
+	bool driver;  // Part of the driver's RX or TX path, its reads count as the driver's own
+};
+
+#define W5100_SCRIPT_READ( reg, type, field ) \
+	{ .frame = R_PCK( reg ), .addr = ( reg ), .arg = W5100_SCRIPT_NONE, .result = offsetof( type, field ) }
+#define W5100_SCRIPT_READ16( reg, type, field ) \
+	W5100_SCRIPT_READ( reg, type, field[ 0 ] ), W5100_SCRIPT_READ( ( reg ) + 1, type, field[ 1 ] )
+#define W5100_SCRIPT_WRITE( reg, data ) \
+	{ .frame = W_PCK( reg, data ), .addr = ( reg ), .arg = W5100_SCRIPT_NONE, .result = W5100_SCRIPT_NONE }
+#define W5100_SCRIPT_WRITE_ARG( reg, idx ) \
+	{ .frame = W_PCK( reg, 0 ), .addr = ( reg ), .arg = ( idx ), .result = W5100_SCRIPT_NONE }
+
+/** Op tables live in DRAM so the frames can be handed to the SPI driver as they are */
+#define W5100_SCRIPT_DEFINE( script_name, for_driver, ... ) \
+	static const DRAM_ATTR struct w5100_script_op script_name##_ops[] = { __VA_ARGS__ }; \
+	const struct w5100_script script_name = { \
+		.name = #script_name, \
+		.ops = script_name##_ops, \
+		.n_ops = sizeof( script_name##_ops ) / sizeof( script_name##_ops[ 0 ] ), \
+		.driver = ( for_driver ) \
+	}
+
+static inline uint16_t w5100_be16( const uint8_t b[ 2 ] )
+{
+	return b[ 0 ] << 8 | b[ 1 ];
+}
+
+/** Runs a script as a single burst of polled transactions, holding the lock for its whole duration */
+void w5100_run_script( const struct w5100_script *const script, const uint8_t *const args, void *const result );
+/** Same, caller holds the lock, as the RX path does from its poll through the frame read to the commit */
+void w5100_ll_run_script_nolock(
+	const struct w5100_script *const script,
+	const uint8_t *const args,
+	void *const result );
+
+/* Hot sequences of the MACRAW RX path */
+
+/** IR + S0_IR + S0_RX_RSR + S0_RX_RD */
+struct w5100_rx_poll_result
+{
+	uint8_t ir;
+	uint8_t s0_ir;
+	uint8_t rx_rsr[ 2 ];
+	uint8_t rx_rd[ 2 ];
+};
+extern const struct w5100_script w5100_script_rx_poll;
+
+/** Writes S0_RX_RD from args[ 0 ] (MSB) and args[ 1 ] (LSB), then issues RECV */
+extern const struct w5100_script w5100_script_rx_commit;
+
+/** SHAR + S0_SR + S0_RX_RSR + S0_RX_RD, what the health monitor looks at */
+struct w5100_health_result
+{
+	uint8_t shar[ 6 ];
+	uint8_t s0_sr;
+	uint8_t rx_rsr[ 2 ];
+	uint8_t rx_rd[ 2 ];
+};
+extern const struct w5100_script w5100_script_health;
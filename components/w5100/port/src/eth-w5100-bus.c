@@ -0,0 +1,179 @@
+
+#include "eth-w5100-bus.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "eth-w5100-ll.h"
+#include "sdkconfig.h"
+
+#include <string.h>
+
+#ifdef CONFIG_W5100_SPI_SHARED_BUS
+
+#define W5100_DEV_IDX 0
+#define MAX_DEVS	  ( 1 + CONFIG_W5100_SPI_MAX_COTENANTS )
+
+struct dev
+{
+	bool used;
+	spi_device_handle_t handle;
+	int64_t hold_start;
+	struct w5100_bus_dev_stats stats;
+};
+
+static const char *TAG = "w5100_bus";
+
+/* Entries are claimed and released with devs_mux held */
+static struct dev devs[ MAX_DEVS ] = { [W5100_DEV_IDX] = { .used = true, .stats.name = "w5100" } };
+
+static portMUX_TYPE devs_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void bus_hold( const size_t idx )
+{
+	const int64_t start = esp_timer_get_time();
+	ESP_ERROR_CHECK( spi_device_acquire_bus( devs[ idx ].handle, portMAX_DELAY ) );
+	devs[ idx ].hold_start = esp_timer_get_time();
+
+	const uint32_t waited = devs[ idx ].hold_start - start;
+	portENTER_CRITICAL( &devs_mux );
+	devs[ idx ].stats.total_wait_us += waited;
+	if ( waited > devs[ idx ].stats.max_wait_us )
+		devs[ idx ].stats.max_wait_us = waited;
+	++devs[ idx ].stats.holds;
+	portEXIT_CRITICAL( &devs_mux );
+}
+
+static void bus_drop( const size_t idx )
+{
+	const int64_t busy = esp_timer_get_time() - devs[ idx ].hold_start;
+	spi_device_release_bus( devs[ idx ].handle );
+	portENTER_CRITICAL( &devs_mux );
+	devs[ idx ].stats.busy_us += busy;
+	portEXIT_CRITICAL( &devs_mux );
+}
+
+static size_t find_cotenant( spi_device_handle_t handle )
+{
+	size_t idx = 0;
+
+	portENTER_CRITICAL( &devs_mux );
+	for ( size_t i = W5100_DEV_IDX + 1; i < MAX_DEVS && !idx; ++i )
+		if ( devs[ i ].used && devs[ i ].handle == handle )
+			idx = i;
+	portEXIT_CRITICAL( &devs_mux );
+	return idx;
+}
+
+/** Takes a free entry for a co-tenant being added, 0 when there is none */
+static size_t claim_cotenant( const char *name )
+{
+	size_t idx = 0;
+
+	portENTER_CRITICAL( &devs_mux );
+	for ( size_t i = W5100_DEV_IDX + 1; i < MAX_DEVS && !idx; ++i )
+		if ( !devs[ i ].used )
+		{
+			devs[ i ] = ( struct dev ) { .used = true, .stats.name = name };
+			idx = i;
+		}
+	portEXIT_CRITICAL( &devs_mux );
+	return idx;
+}
+
+static void release_cotenant( const size_t idx )
+{
+	portENTER_CRITICAL( &devs_mux );
+	devs[ idx ].handle = NULL;
+	devs[ idx ].used = false;
+	portEXIT_CRITICAL( &devs_mux );
+}
+
+void w5100_bus_attach( spi_device_handle_t handle )
+{
+	devs[ W5100_DEV_IDX ].handle = handle;
+}
+
+void w5100_bus_hold( void )
+{
+	bus_hold( W5100_DEV_IDX );
+}
+
+void w5100_bus_drop( void )
+{
+	bus_drop( W5100_DEV_IDX );
+}
+
+esp_err_t w5100_bus_add_cotenant(
+	const char *name,
+	const spi_device_interface_config_t *const dev_cfg,
+	spi_device_handle_t *const handle )
+{
+	const size_t idx = claim_cotenant( name );
+	if ( !idx )
+	{
+		ESP_LOGE( TAG, "No room for co-tenant %s, raise CONFIG_W5100_SPI_MAX_COTENANTS", name );
+		return ESP_ERR_NO_MEM;
+	}
+
+	const esp_err_t err = spi_bus_add_device( VSPI_HOST, dev_cfg, handle );
+	if ( err != ESP_OK )
+	{
+		release_cotenant( idx );
+		return err;
+	}
+
+	portENTER_CRITICAL( &devs_mux );
+	devs[ idx ].handle = *handle;
+	portEXIT_CRITICAL( &devs_mux );
+	return ESP_OK;
+}
+
+esp_err_t w5100_bus_remove_cotenant( spi_device_handle_t handle )
+{
+	const size_t idx = find_cotenant( handle );
+	if ( !idx )
+		return ESP_ERR_NOT_FOUND;
+
+	const esp_err_t err = spi_bus_remove_device( handle );
+	if ( err == ESP_OK )
+		release_cotenant( idx );
+	return err;
+}
+
+esp_err_t w5100_bus_transmit( spi_device_handle_t handle, spi_transaction_t *const trans )
+{
+	const size_t idx = find_cotenant( handle );
+	if ( !idx )
+		return ESP_ERR_INVALID_ARG;
+
+	bus_hold( idx );
+	const esp_err_t err = spi_device_transmit( handle, trans );
+	bus_drop( idx );
+	return err;
+}
+
+size_t w5100_bus_get_stats( struct w5100_bus_dev_stats *const out, const size_t max )
+{
+	size_t n = 0;
+	portENTER_CRITICAL( &devs_mux );
+	for ( size_t i = 0; i < MAX_DEVS; ++i )
+	{
+		if ( !devs[ i ].used || ( i != W5100_DEV_IDX && !devs[ i ].handle ) )
+			continue;
+		if ( n < max )
+			out[ n ] = devs[ i ].stats;
+		++n;
+	}
+	portEXIT_CRITICAL( &devs_mux );
+	return n;
+}
+
+void w5100_bus_reset_stats( void )
+{
+	portENTER_CRITICAL( &devs_mux );
+	for ( size_t i = 0; i < MAX_DEVS; ++i )
+		devs[ i ].stats = ( struct w5100_bus_dev_stats ) { .name = devs[ i ].stats.name };
+	portEXIT_CRITICAL( &devs_mux );
+}
+
+#endif
@@ -0,0 +1,180 @@
+
+#include "eth-w5100-health.h"
+
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "eth-w5100-ll.h"
+#include "eth-w5100-regs.h"
+#include "eth-w5100-script.h"
+#include "eth-w5100-static.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include <string.h>
+
+#ifdef CONFIG_W5100_HEALTH_MONITOR
+
+#define CHIP_READY_TIMEOUT_US  20000
+#define SOCKET_OPEN_TIMEOUT_US 5000
+#define POLL_STEP_US		   250
+#define QUIESCE_TIMEOUT_US	   50000
+#define HEALTH_STACK		   2560
+
+static const char *TAG = "w5100_health";
+
+static TaskHandle_t health_task_hdl;
+W5100_TASK_DEFINE( health_task, HEALTH_STACK );
+static volatile bool health_running;
+static struct w5100_health_stats stats;
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint16_t rd16( const uint16_t addr )
+{
+	uint8_t buf[ 2 ];
+	w5100_ll_read_nolock( addr, buf, sizeof( buf ) );
+	return buf[ 0 ] << 8 | buf[ 1 ];
+}
+
+static uint8_t rd8( const uint16_t addr )
+{
+	uint8_t val;
+	w5100_ll_read_nolock( addr, &val, 1 );
+	return val;
+}
+
+/** Busy-waits on a register until it holds the expected value. Only ever runs for a few ms during recovery. */
+static bool wait_reg( const uint16_t addr, const uint16_t size, const uint16_t expected, const int64_t timeout_us )
+{
+	const int64_t deadline = esp_timer_get_time() + timeout_us;
+	do
+	{
+		if ( ( size == 2 ? rd16( addr ) : rd8( addr ) ) == expected )
+			return true;
+		esp_rom_delay_us( POLL_STEP_US );
+	} while ( esp_timer_get_time() < deadline );
+	return false;
+}
+
+/** Holds the driver back, resets the chip and replays its configuration */
+static void recover( void )
+{
+	const bool drained = w5100_ll_quiesce( QUIESCE_TIMEOUT_US );
+	const int64_t start = esp_timer_get_time();
+	bool ok;
+
+	w5100_ll_hw_reset();
+	ok = wait_reg( W5100_REG_RTR, 2, W5100_RTR_DEFAULT, CHIP_READY_TIMEOUT_US );
+	if ( ok )
+	{
+		w5100_ll_shadow_restore();
+		ok = wait_reg( W5100_S0_CR, 1, 0, SOCKET_OPEN_TIMEOUT_US )
+			&& wait_reg( W5100_S0_SR, 1, W5100_SN_SR_MACRAW, SOCKET_OPEN_TIMEOUT_US );
+	}
+	w5100_ll_resume();
+
+	const uint32_t elapsed = esp_timer_get_time() - start;
+	portENTER_CRITICAL( &stats_mux );
+	++stats.recoveries;
+	stats.last_recovery_us = elapsed;
+	if ( elapsed > stats.max_recovery_us )
+		stats.max_recovery_us = elapsed;
+	if ( elapsed > CONFIG_W5100_HEALTH_RECOVERY_BUDGET_MS * 1000 )
+		++stats.recoveries_over_budget;
+	if ( !drained )
+		++stats.quiesce_timeouts;
+	if ( !ok )
+		++stats.failed;
+	portEXIT_CRITICAL( &stats_mux );
+
+	ESP_LOGW(
+		TAG,
+		"Hot reset %s in %" PRIu32 " us%s",
+		ok ? "done" : "FAILED",
+		elapsed,
+		drained ? "" : ", driver cut off" );
+}
+
+static void health_task( void *p )
+{
+	uint16_t last_rx_rd = 0;
+	uint32_t rx_stall_checks = 0;
+
+	while ( health_running )
+	{
+		ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS( CONFIG_W5100_HEALTH_PERIOD_MS ) );
+		if ( !health_running )
+			break;
+		// Nothing to compare against until the driver has brought the socket up
+		if ( !w5100_ll_shadow_valid() )
+			continue;
+
+		struct w5100_health_result regs;
+		w5100_run_script( &w5100_script_health, NULL, &regs );
+		const uint16_t rx_rd = w5100_be16( regs.rx_rd );
+
+		if ( w5100_be16( regs.rx_rsr ) && rx_rd == last_rx_rd )
+			++rx_stall_checks;
+		else
+			rx_stall_checks = 0;
+		last_rx_rd = rx_rd;
+
+		uint32_t *cause = NULL;
+		if ( !w5100_ll_shadow_mac_matches( regs.shar ) )
+			cause = &stats.cause_mac_lost;
+		else if ( regs.s0_sr != W5100_SN_SR_MACRAW )
+			cause = &stats.cause_socket_closed;
+		else if ( rx_stall_checks >= CONFIG_W5100_HEALTH_RX_STALL_CHECKS )
+			cause = &stats.cause_rx_stalled;
+
+		portENTER_CRITICAL( &stats_mux );
+		++stats.checks;
+		if ( cause )
+			++*cause;
+		portEXIT_CRITICAL( &stats_mux );
+		if ( !cause )
+			continue;
+
+		recover();
+		rx_stall_checks = 0;
+		last_rx_rd = 0;
+	}
+
+	w5100_task_exit( &health_task_hdl );
+}
+
+void w5100_health_start( void )
+{
+	portENTER_CRITICAL( &stats_mux );
+	memset( &stats, 0, sizeof( stats ) );
+	portEXIT_CRITICAL( &stats_mux );
+	health_running = true;
+	ESP_ERROR_CHECK(
+		pdPASS
+		!= W5100_TASK_CREATE(
+			health_task,
+			health_task,
+			"w5100_health",
+			HEALTH_STACK,
+			tskIDLE_PRIORITY + 2,
+			&health_task_hdl ) );
+}
+
+void w5100_health_stop( void )
+{
+	if ( !health_task_hdl )
+		return;
+	health_running = false;
+	xTaskNotifyGive( health_task_hdl );
+	w5100_task_join( &health_task_hdl );
+}
+
+void w5100_health_get_stats( struct w5100_health_stats *const out )
+{
+	portENTER_CRITICAL( &stats_mux );
+	*out = stats;
+	portEXIT_CRITICAL( &stats_mux );
+}
+
+#endif
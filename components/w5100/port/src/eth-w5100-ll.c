@@ -3,16 +3,111 @@
 
 #include "driver/gpio.h"
 #include "driver/spi_master.h"
+#include "esp_timer.h"
+#include "eth-w5100-hooks.h"
+#include "eth-w5100-regs.h"
+#include "eth-w5100-script.h"
+#include "eth-w5100-static.h"
+#include "sdkconfig.h"
 #include "soc/gpio_struct.h"
 
+#include <string.h>
+
+spi_device_handle_t w5100_spi_handle = NULL;
+SemaphoreHandle_t eth_mutex;
+static int spi_clock_hz = 1200000;
+
+#ifdef CONFIG_W5100_LL_LOCK_STATS
+/* Only touched with eth_mutex held */
+static struct w5100_ll_lock_stats lock_stats;
+static TaskHandle_t lock_stats_task;
+static bool holder_counted;
+static int64_t held_since;
+
+static inline void eth_lock( void )
+{
+	const bool count = !lock_stats_task || lock_stats_task == xTaskGetCurrentTaskHandle();
+	const bool contended = xSemaphoreGetMutexHolder( eth_mutex );
+	const int64_t asked_at = esp_timer_get_time();
+
+	ESP_ERROR_CHECK( pdTRUE != xSemaphoreTake( eth_mutex, pdMS_TO_TICKS( 10000 ) ) );
+	held_since = esp_timer_get_time();
+	holder_counted = count;
+	if ( !count )
+		return;
+	lock_stats.wait_us += held_since - asked_at;
+	lock_stats.contended += contended;
+	++lock_stats.acquisitions;
+}
+
+static inline void eth_unlock( void )
+{
+	if ( holder_counted )
+		lock_stats.held_us += esp_timer_get_time() - held_since;
+	ESP_ERROR_CHECK( pdTRUE != xSemaphoreGive( eth_mutex ) );
+}
+#else
 #define eth_lock()	 ESP_ERROR_CHECK( pdTRUE != xSemaphoreTake( eth_mutex, pdMS_TO_TICKS( 10000 ) ) )
 #define eth_unlock() ESP_ERROR_CHECK( pdTRUE != xSemaphoreGive( eth_mutex ) )
+#endif
 
-#define W_PCK( address, data ) ( __builtin_bswap32(( 0xF0000000 | ( address ) << 8 | ( data ) )) )
-#define R_PCK( address )	   ( __builtin_bswap32(( 0x0F000000 | ( address ) << 8 )) )
+/** Copy of every configuration register the driver wrote, replayed after a hot reset */
+static struct
+{
+	uint8_t common[ W5100_COMMON_REGS_SIZE ];
+	uint32_t common_valid;
+	uint8_t s0_mr;
+	bool s0_opened;
+} shadow;
 
-spi_device_handle_t w5100_spi_handle = NULL;
-SemaphoreHandle_t eth_mutex;
+#ifdef CONFIG_W5100_HEALTH_MONITOR
+/*
+ * The driver's RX and TX paths are runs of separate accesses, Sn_RX_RSR through RECV and Sn_TX_FSR through the SEND_OK
+ * acknowledge, and a hot reset landing inside one leaves it working from pointers the chip no longer has. Each path's
+ * run in progress is followed from the accesses themselves, with eth_mutex held.
+ */
+enum
+{
+	SEQ_RX,
+	SEQ_TX,
+	SEQ_MAX
+};
+
+static TaskHandle_t seq_owner[ SEQ_MAX ];
+static SemaphoreHandle_t gate_mutex;  // Held from w5100_ll_quiesce() to w5100_ll_resume()
+static volatile bool gate_closed;
+
+static void seq_track_read( const uint16_t addr, const uint8_t *const data_rx, const uint32_t size )
+{
+	if ( addr == W5100_S0_RX_RSR && size == 2 && ( data_rx[ 0 ] || data_rx[ 1 ] ) )
+		seq_owner[ SEQ_RX ] = xTaskGetCurrentTaskHandle();
+	else if ( addr == W5100_S0_TX_FSR )
+		seq_owner[ SEQ_TX ] = xTaskGetCurrentTaskHandle();
+}
+
+static void seq_track_write( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size )
+{
+	if ( addr == W5100_S0_CR && size == 1 && data_tx[ 0 ] == W5100_SN_CR_RECV )
+		seq_owner[ SEQ_RX ] = NULL;
+	else if ( addr == W5100_S0_IR && size == 1 && data_tx[ 0 ] & W5100_SN_IR_SEND_OK )
+		seq_owner[ SEQ_TX ] = NULL;
+}
+
+/** Holds back an access that would start a new run while a hot reset is pending, runs in progress go on */
+static inline void gate_pass( void )
+{
+	const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+	if ( !gate_closed || seq_owner[ SEQ_RX ] == self || seq_owner[ SEQ_TX ] == self )
+		return;
+	ESP_ERROR_CHECK( pdTRUE != xSemaphoreTake( gate_mutex, portMAX_DELAY ) );
+	ESP_ERROR_CHECK( pdTRUE != xSemaphoreGive( gate_mutex ) );
+}
+#else
+#define seq_track_read( addr, data_rx, size )
+#define seq_track_write( addr, data_tx, size )
+#define gate_pass()
+#endif
 
 static void IRAM_ATTR w5100_SPI_EN_assert( spi_transaction_t *trans )
 {
@@ -24,6 +119,45 @@ static void IRAM_ATTR w5100_SPI_En_deassert( spi_transaction_t *trans )
 	GPIO.out_w1tc = ( 1 << GPIO_NUM_22 );
 }
 
+#ifdef CONFIG_W5100_SPI_SHARED_BUS
+/** Hands the bus over to co-tenants every CONFIG_W5100_SPI_SHARED_CHUNK_FRAMES frames of a transfer */
+static inline void bus_chunk( const uint32_t i )
+{
+	if ( i % CONFIG_W5100_SPI_SHARED_CHUNK_FRAMES )
+		return;
+	if ( i )
+		w5100_bus_drop();
+	w5100_bus_hold();
+}
+
+static inline void bus_done( const uint32_t size )
+{
+	if ( size )
+		w5100_bus_drop();
+}
+#else
+#define bus_chunk( i )
+#define bus_done( size )
+#endif
+
+static void shadow_capture( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size )
+{
+	for ( uint32_t i = 0; i < size; ++i )
+	{
+		const uint16_t reg = addr + i;
+
+		if ( reg < W5100_COMMON_REGS_SIZE && reg != W5100_REG_IR )
+		{
+			shadow.common[ reg ] = reg == W5100_REG_MR ? data_tx[ i ] & ~W5100_MR_RST : data_tx[ i ];
+			shadow.common_valid |= 1 << reg;
+		}
+		else if ( reg == W5100_S0_MR )
+			shadow.s0_mr = data_tx[ i ];
+		else if ( reg == W5100_S0_CR && data_tx[ i ] == W5100_SN_CR_OPEN )
+			shadow.s0_opened = true;
+	}
+}
+
 void w5100_ll_hw_reset( void )
 {
 	ESP_ERROR_CHECK( gpio_set_level( GPIO_NUM_12, 1 ) );
@@ -31,54 +165,300 @@ void w5100_ll_hw_reset( void )
 	ESP_ERROR_CHECK( gpio_set_level( GPIO_NUM_12, 0 ) );
 }
 
-void w5100_spi_init( void )
+static esp_err_t add_device( const int hz )
 {
-	ESP_ERROR_CHECK( gpio_config( &( const gpio_config_t ) {
-		.pin_bit_mask = BIT64( GPIO_NUM_12 ) | BIT64( GPIO_NUM_22 ),
-		.mode = GPIO_MODE_OUTPUT } ) );
-	ESP_ERROR_CHECK( !( eth_mutex = xSemaphoreCreateMutex() ) );
-	ESP_ERROR_CHECK( spi_bus_add_device(
+	const esp_err_t err = spi_bus_add_device(
 		VSPI_HOST,
 		&( spi_device_interface_config_t ) {
-			.clock_speed_hz = 1200000,
+			.clock_speed_hz = hz,
 			.spics_io_num = 17,
 			.queue_size = 1,
 			.pre_cb = w5100_SPI_EN_assert,
 			.post_cb = w5100_SPI_En_deassert },
-		&w5100_spi_handle ) );
+		&w5100_spi_handle );
+	if ( err != ESP_OK )
+		return err;
+#ifdef CONFIG_W5100_SPI_SHARED_BUS
+	w5100_bus_attach( w5100_spi_handle );
+#else
 	ESP_ERROR_CHECK( spi_device_acquire_bus( w5100_spi_handle, portMAX_DELAY ) );
+#endif
+	return ESP_OK;
 }
 
-void w5100_spi_deinit( void )
+static void remove_device( void )
 {
-	eth_lock();
+#ifndef CONFIG_W5100_SPI_SHARED_BUS
 	spi_device_release_bus( w5100_spi_handle );
+#endif
 	ESP_ERROR_CHECK( spi_bus_remove_device( w5100_spi_handle ) );
+}
+
+void w5100_spi_init( void )
+{
+	ESP_ERROR_CHECK( gpio_config( &( const gpio_config_t ) {
+		.pin_bit_mask = BIT64( GPIO_NUM_12 ) | BIT64( GPIO_NUM_22 ),
+		.mode = GPIO_MODE_OUTPUT } ) );
+	ESP_ERROR_CHECK( !( eth_mutex = W5100_MUTEX_CREATE() ) );
+#ifdef CONFIG_W5100_HEALTH_MONITOR
+	ESP_ERROR_CHECK( !( gate_mutex = W5100_MUTEX_CREATE() ) );
+	memset( seq_owner, 0, sizeof( seq_owner ) );
+#endif
+	ESP_ERROR_CHECK( add_device( spi_clock_hz ) );
+	memset( &shadow, 0, sizeof( shadow ) );
+}
+
+void w5100_spi_deinit( void )
+{
+	eth_lock();
+	remove_device();
 	eth_unlock();
 	vSemaphoreDelete( eth_mutex );
+#ifdef CONFIG_W5100_HEALTH_MONITOR
+	vSemaphoreDelete( gate_mutex );
+#endif
 }
 
-void w5100_read( const uint16_t addr, uint8_t *const data_rx, const uint32_t size )
+esp_err_t w5100_ll_set_clock( const int hz )
 {
-	spi_transaction_t trans = { .flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA, .length = 32 };
+	esp_err_t err;
+
 	eth_lock();
+	remove_device();
+	// Fall back to the previous rate so the driver keeps a working device
+	if ( ( err = add_device( hz ) ) == ESP_OK )
+		spi_clock_hz = hz;
+	else
+		ESP_ERROR_CHECK( add_device( spi_clock_hz ) );
+	eth_unlock();
+	return err;
+}
+
+int w5100_ll_get_clock( void )
+{
+	return spi_clock_hz;
+}
+
+void w5100_ll_get_lock_stats( struct w5100_ll_lock_stats *const out )
+{
+#ifdef CONFIG_W5100_LL_LOCK_STATS
+	eth_lock();
+	*out = lock_stats;
+	eth_unlock();
+#else
+	memset( out, 0, sizeof( *out ) );
+#endif
+}
+
+void w5100_ll_reset_lock_stats( TaskHandle_t task )
+{
+#ifdef CONFIG_W5100_LL_LOCK_STATS
+	eth_lock();
+	memset( &lock_stats, 0, sizeof( lock_stats ) );
+	lock_stats_task = task;
+	holder_counted = false;
+	eth_unlock();
+#endif
+}
+
+void w5100_ll_lock( void )
+{
+	eth_lock();
+}
+
+void w5100_ll_unlock( void )
+{
+	eth_unlock();
+}
+
+#ifdef CONFIG_W5100_HEALTH_MONITOR
+bool w5100_ll_quiesce( const int64_t timeout_us )
+{
+	const int64_t deadline = esp_timer_get_time() + timeout_us;
+	bool drained;
+
+	ESP_ERROR_CHECK( pdTRUE != xSemaphoreTake( gate_mutex, portMAX_DELAY ) );
+	gate_closed = true;
+	for ( ;; )
+	{
+		eth_lock();
+		drained = !seq_owner[ SEQ_RX ] && !seq_owner[ SEQ_TX ];
+		if ( drained || esp_timer_get_time() >= deadline )
+			break;
+		eth_unlock();
+		vTaskDelay( 1 );
+	}
+	return drained;
+}
+
+void w5100_ll_resume( void )
+{
+	// Runs the reset cut off, if any, are over as far as the chip is concerned
+	memset( seq_owner, 0, sizeof( seq_owner ) );
+	gate_closed = false;
+	eth_unlock();
+	ESP_ERROR_CHECK( pdTRUE != xSemaphoreGive( gate_mutex ) );
+}
+#endif
+
+void w5100_ll_read_nolock( const uint16_t addr, uint8_t *const data_rx, const uint32_t size )
+{
+	spi_transaction_t trans = { .flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA, .length = 32 };
 	for ( uint32_t i = 0; i < size; ++i )
 	{
+		bus_chunk( i );
 		*( uint32_t * )&trans.tx_buffer = R_PCK( addr + i );
 		ESP_ERROR_CHECK( spi_device_transmit( w5100_spi_handle, &trans ) );
 		data_rx[ i ] = trans.rx_data[ 3 ];
 	}
-	eth_unlock();
+	bus_done( size );
 }
 
-void w5100_write( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size )
+void w5100_ll_write_nolock( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size )
 {
 	spi_transaction_t trans = { .flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA, .length = 32 };
-	eth_lock();
+	if ( addr < W5100_TX_MEM_BASE )
+		shadow_capture( addr, data_tx, size );
 	for ( uint32_t i = 0; i < size; ++i )
 	{
+		bus_chunk( i );
 		*( uint32_t * )&trans.tx_buffer = W_PCK( addr + i, data_tx[ i ] );
 		ESP_ERROR_CHECK( spi_device_transmit( w5100_spi_handle, &trans ) );
 	}
+	bus_done( size );
+}
+
+bool w5100_ll_shadow_valid( void )
+{
+	return shadow.s0_opened && shadow.s0_mr == W5100_SN_MR_MACRAW;
+}
+
+bool w5100_ll_shadow_mac_matches( const uint8_t mac[ 6 ] )
+{
+	return !memcmp( &shadow.common[ W5100_REG_SHAR ], mac, 6 );
+}
+
+void w5100_ll_shadow_restore( void )
+{
+	for ( uint16_t reg = 0; reg < W5100_COMMON_REGS_SIZE; ++reg )
+		if ( shadow.common_valid & 1 << reg )
+			w5100_ll_write_nolock( reg, &shadow.common[ reg ], 1 );
+	w5100_ll_write_nolock( W5100_S0_MR, &shadow.s0_mr, 1 );
+	w5100_ll_write_nolock( W5100_S0_CR, &( const uint8_t ) { W5100_SN_CR_OPEN }, 1 );
+}
+
+void w5100_read( const uint16_t addr, uint8_t *const data_rx, const uint32_t size )
+{
+	gate_pass();
+	eth_lock();
+	w5100_ll_read_nolock( addr, data_rx, size );
+	seq_track_read( addr, data_rx, size );
+	eth_unlock();
+#ifdef CONFIG_W5100_LATENCY_HIST
+	w5100_lat_on_read( addr, data_rx, size );
+#endif
+}
+
+void w5100_write( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size )
+{
+	gate_pass();
+	eth_lock();
+	w5100_ll_write_nolock( addr, data_tx, size );
+	seq_track_write( addr, data_tx, size );
+	eth_unlock();
+#ifdef CONFIG_W5100_LATENCY_HIST
+	w5100_lat_on_write( addr, data_tx, size );
+#endif
+}
+
+/** A script's access to consecutive registers, reported the way w5100_read() and w5100_write() report theirs */
+static void script_note(
+	const struct w5100_script *const script,
+	const uint16_t addr,
+	const bool write,
+	const uint8_t *const data,
+	const uint32_t size )
+{
+	if ( write )
+	{
+		if ( addr < W5100_TX_MEM_BASE )
+			shadow_capture( addr, data, size );
+		seq_track_write( addr, data, size );
+#ifdef CONFIG_W5100_LATENCY_HIST
+		w5100_lat_on_write( addr, data, size );
+#endif
+	}
+	else if ( script->driver )
+	{
+		seq_track_read( addr, data, size );
+#ifdef CONFIG_W5100_LATENCY_HIST
+		w5100_lat_on_read( addr, data, size );
+#endif
+	}
+}
+
+void w5100_ll_run_script_nolock(
+	const struct w5100_script *const script,
+	const uint8_t *const args,
+	void *const result )
+{
+	spi_transaction_t trans = { .length = 32 };
+	uint8_t *const out = result;
+	uint8_t run[ 8 ];
+	uint32_t run_len = 0;
+	uint16_t run_addr = 0;
+	bool run_write = false;
+
+#ifdef CONFIG_W5100_SPI_SHARED_BUS
+	w5100_bus_hold();
+#endif
+	for ( size_t i = 0; i < script->n_ops; ++i )
+	{
+		const struct w5100_script_op *const op = &script->ops[ i ];
+		const bool write = op->result == W5100_SCRIPT_NONE;
+		uint8_t data;
+
+		// Constant frames go out straight from the table, only argument writes need patching
+		if ( op->arg == W5100_SCRIPT_NONE )
+		{
+			trans.flags = SPI_TRANS_USE_RXDATA;
+			trans.tx_buffer = &op->frame;
+			data = op->frame >> 24;
+		}
+		else
+		{
+			data = args[ op->arg ];
+			trans.flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA;
+			*( uint32_t * )trans.tx_data = op->frame | ( uint32_t )data << 24;
+		}
+		ESP_ERROR_CHECK( spi_device_polling_transmit( w5100_spi_handle, &trans ) );
+		if ( !write )
+			out[ op->result ] = data = trans.rx_data[ 3 ];
+
+		// Sn_RX_RSR and the like are only meaningful as the pair of bytes they were read as
+		if ( run_len && ( write != run_write || op->addr != run_addr + run_len || run_len == sizeof( run ) ) )
+		{
+			script_note( script, run_addr, run_write, run, run_len );
+			run_len = 0;
+		}
+		if ( !run_len )
+		{
+			run_addr = op->addr;
+			run_write = write;
+		}
+		run[ run_len++ ] = data;
+	}
+#ifdef CONFIG_W5100_SPI_SHARED_BUS
+	w5100_bus_drop();
+#endif
+	if ( run_len )
+		script_note( script, run_addr, run_write, run, run_len );
+}
+
+void w5100_run_script( const struct w5100_script *const script, const uint8_t *const args, void *const result )
+{
+	gate_pass();
+	eth_lock();
+	w5100_ll_run_script_nolock( script, args, result );
 	eth_unlock();
 }
@@ -0,0 +1,33 @@
+
+#include "eth-w5100-script.h"
+
+#include "eth-w5100-regs.h"
+
+W5100_SCRIPT_DEFINE(
+	w5100_script_rx_poll,
+	true,
+	W5100_SCRIPT_READ( W5100_REG_IR, struct w5100_rx_poll_result, ir ),
+	W5100_SCRIPT_READ( W5100_S0_IR, struct w5100_rx_poll_result, s0_ir ),
+	W5100_SCRIPT_READ16( W5100_S0_RX_RSR, struct w5100_rx_poll_result, rx_rsr ),
+	W5100_SCRIPT_READ16( W5100_S0_RX_RD, struct w5100_rx_poll_result, rx_rd ) );
+
+W5100_SCRIPT_DEFINE(
+	w5100_script_rx_commit,
+	true,
+	W5100_SCRIPT_WRITE_ARG( W5100_S0_RX_RD, 0 ),
+	W5100_SCRIPT_WRITE_ARG( W5100_S0_RX_RD + 1, 1 ),
+	W5100_SCRIPT_WRITE( W5100_S0_CR, W5100_SN_CR_RECV ) );
+
+// Not the driver: a non-zero Sn_RX_RSR read here must not open an RX run that only the driver's RECV would close
+W5100_SCRIPT_DEFINE(
+	w5100_script_health,
+	false,
+	W5100_SCRIPT_READ( W5100_REG_SHAR + 0, struct w5100_health_result, shar[ 0 ] ),
+	W5100_SCRIPT_READ( W5100_REG_SHAR + 1, struct w5100_health_result, shar[ 1 ] ),
+	W5100_SCRIPT_READ( W5100_REG_SHAR + 2, struct w5100_health_result, shar[ 2 ] ),
+	W5100_SCRIPT_READ( W5100_REG_SHAR + 3, struct w5100_health_result, shar[ 3 ] ),
+	W5100_SCRIPT_READ( W5100_REG_SHAR + 4, struct w5100_health_result, shar[ 4 ] ),
+	W5100_SCRIPT_READ( W5100_REG_SHAR + 5, struct w5100_health_result, shar[ 5 ] ),
+	W5100_SCRIPT_READ( W5100_S0_SR, struct w5100_health_result, s0_sr ),
+	W5100_SCRIPT_READ16( W5100_S0_RX_RSR, struct w5100_health_result, rx_rsr ),
+	W5100_SCRIPT_READ16( W5100_S0_RX_RD, struct w5100_health_result, rx_rd ) );
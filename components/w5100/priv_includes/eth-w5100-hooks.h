@@ -0,0 +1,54 @@
+
+#pragma once
+
+#include "esp_eth.h"
+#include "esp_netif.h"
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Link-time wraps, see CMakeLists.txt */
+esp_err_t __real_esp_eth_transmit( esp_eth_handle_t hdl, void *buf, size_t length );
+esp_err_t __wrap_esp_eth_transmit( esp_eth_handle_t hdl, void *buf, size_t length );
+esp_err_t __real_esp_netif_receive( esp_netif_t *esp_netif, void *buffer, size_t len, void *eb );
+esp_err_t __wrap_esp_netif_receive( esp_netif_t *esp_netif, void *buffer, size_t len, void *eb );
+
+#ifdef CONFIG_W5100_TX_SCHEDULER
+/** Queues a copy of the frame, output_at goes along with it to the driver */
+esp_err_t w5100_txsched_enqueue( esp_eth_handle_t hdl, const void *buf, size_t length, const int64_t output_at );
+#endif
+
+#ifdef CONFIG_W5100_FASTPATH
+/** Follows the interface's address through the IP events, started before the driver */
+void w5100_fastpath_start( void );
+void w5100_fastpath_stop( void );
+/** Called from the netif receive wrap, true when the frame was dealt with and must not go to lwIP */
+bool w5100_fastpath_input( esp_netif_t *const netif, uint8_t *const frame, const size_t len );
+#endif
+
+#ifdef CONFIG_W5100_LATENCY_HIST
+/* Called from the port callbacks with every transfer the driver makes */
+void w5100_lat_on_read( const uint16_t addr, const uint8_t *const data, const uint32_t size );
+void w5100_lat_on_write( const uint16_t addr, const uint8_t *const data, const uint32_t size );
+/* Called from the netif wraps */
+void w5100_lat_rx_netif( void );
+/* Called around each frame handed to the driver, by the task handing it over */
+void w5100_lat_tx_begin( const int64_t output_at );
+void w5100_lat_tx_end( void );
+#endif
+
+/** Hands a frame to the driver, the time it came into esp_eth_transmit() going with it to the SEND command */
+static inline esp_err_t w5100_transmit( esp_eth_handle_t hdl, void *buf, size_t length, const int64_t output_at )
+{
+	esp_err_t err;
+
+#ifdef CONFIG_W5100_LATENCY_HIST
+	w5100_lat_tx_begin( output_at );
+#endif
+	err = __real_esp_eth_transmit( hdl, buf, length );
+#ifdef CONFIG_W5100_LATENCY_HIST
+	w5100_lat_tx_end();
+#endif
+	return err;
+}
@@ -0,0 +1,76 @@
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+/*
+ * Driver tasks and kernel objects, allocated from the heap or, with CONFIG_W5100_STATIC_ALLOC, from storage reserved at
+ * build time. Stack sizes are in bytes as everywhere in ESP-IDF.
+ */
+
+#ifdef CONFIG_W5100_STATIC_ALLOC
+
+#define W5100_TASK_DEFINE( name, stack_size ) \
+	static StackType_t name##_stack[ stack_size ]; \
+	static StaticTask_t name##_tcb
+
+#define W5100_TASK_CREATE( name, fn, label, stack_size, prio, hdl ) \
+	( ( *( hdl ) = xTaskCreateStatic( fn, label, stack_size, NULL, prio, name##_stack, &name##_tcb ) ) ? pdPASS \
+																									  : pdFAIL )
+
+#define W5100_MUTEX_CREATE() \
+	( { \
+		static StaticSemaphore_t mutex_buf; \
+		xSemaphoreCreateMutexStatic( &mutex_buf ); \
+	} )
+
+#define W5100_EVENT_GROUP_CREATE() \
+	( { \
+		static StaticEventGroup_t event_group_buf; \
+		xEventGroupCreateStatic( &event_group_buf ); \
+	} )
+
+#else
+
+#define W5100_TASK_DEFINE( name, stack_size )
+#define W5100_TASK_CREATE( name, fn, label, stack_size, prio, hdl ) \
+	xTaskCreate( fn, label, stack_size, NULL, prio, hdl )
+#define W5100_MUTEX_CREATE()		xSemaphoreCreateMutex()
+#define W5100_EVENT_GROUP_CREATE() xEventGroupCreate()
+
+#endif
+
+/**
+ * Last thing a driver task does once told to stop. A task deleting itself leaves its TCB to the idle task, which would
+ * still be holding a static one when the task is started again, so in static mode the task parks and whoever stopped it
+ * does the deleting in w5100_task_join().
+ */
+static inline void w5100_task_exit( TaskHandle_t *const hdl )
+{
+	*hdl = NULL;
+#ifdef CONFIG_W5100_STATIC_ALLOC
+	vTaskSuspend( NULL );
+#else
+	vTaskDelete( NULL );
+#endif
+}
+
+/** Waits for a task that was told to stop to be gone */
+static inline void w5100_task_join( TaskHandle_t *const hdl )
+{
+#ifdef CONFIG_W5100_STATIC_ALLOC
+	const TaskHandle_t task = *hdl;
+#endif
+
+	while ( *hdl )
+		vTaskDelay( 1 );
+#ifdef CONFIG_W5100_STATIC_ALLOC
+	while ( eTaskGetState( task ) != eSuspended )
+		vTaskDelay( 1 );
+	vTaskDelete( task );
+#endif
+}
@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+"""Prints the static RAM taken by the objects in a static library, as listed by nm."""
+
+import subprocess
+import sys
+from collections import defaultdict
+
+RAM_TYPES = {'b': 'bss', 'd': 'data', 'c': 'common'}
+
+
+def main(nm, lib, top=10):
+    out = subprocess.run([nm, '--print-size', '--size-sort', '--radix=d', lib],
+                         check=True, capture_output=True, text=True).stdout
+    totals = defaultdict(int)
+    symbols = []
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) != 4 or fields[2].lower() not in RAM_TYPES:
+            continue
+        size = int(fields[1])
+        totals[RAM_TYPES[fields[2].lower()]] += size
+        symbols.append((size, fields[3]))
+
+    name = lib.rsplit('/', 1)[-1]
+    print('{}: static RAM {} bytes ({})'.format(
+        name, sum(totals.values()), ', '.join('{} {}'.format(k, v) for k, v in sorted(totals.items()))))
+    for size, sym in sorted(symbols, reverse=True)[:top]:
+        print('  {:>8} {}'.format(size, sym))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.exit('usage: static_footprint.py <nm> <library>')
+    main(sys.argv[1], sys.argv[2])
@@ -0,0 +1,5 @@
+
+#pragma once
+
+/** Runs every backend, clock rate, contention mode, direction and size in turn, blocking until done */
+void w5100_spibench_run( void );
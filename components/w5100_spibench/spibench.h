@@ -0,0 +1,35 @@
+
+#pragma once
+
+#include "esp_err.h"
+
+#include <stdint.h>
+
+struct spibench_lock_stats
+{
+	uint32_t acquisitions;
+	uint32_t contended;
+	uint64_t wait_us;
+};
+
+/** What the benchmark drives, shaped after the port's callbacks */
+struct spibench_backend
+{
+	const char *name;
+	void ( *begin )( void );
+	void ( *end )( void );
+	void ( *read )( const uint16_t addr, uint8_t *const data_rx, const uint32_t size );
+	void ( *write )( const uint16_t addr, const uint8_t *const data_tx, const uint32_t size );
+	esp_err_t ( *set_clock )( const int hz );  // NULL when the clock means nothing to the backend
+	void ( *reset_lock_stats )( void );		  // Count only the calling task from now on
+	void ( *get_lock_stats )( struct spibench_lock_stats *const out );
+};
+
+extern const struct spibench_backend spibench_mock;
+extern const struct spibench_backend spibench_w5100;
+
+int64_t spibench_now_us( void );
+
+/* The port's lock accounting, which both backends go through */
+void spibench_ll_reset_lock_stats( void );
+void spibench_ll_get_lock_stats( struct spibench_lock_stats *const out );
@@ -0,0 +1,129 @@
+
+#include "driver/spi_master.h"
+#include "eth-w5100-script.h"
+#include "eth-w5100-spi.h"
+#include "sdkconfig.h"
+#include "spibench.h"
+
+#include <string.h>
+
+#ifdef CONFIG_W5100_SPIBENCH_MOCK
+
+#define MEM_SIZE 0x8000
+
+/*
+ * The port runs as it is, eth-w5100-ll.c and all, with the SPI master driver underneath it swapped for the chip's
+ * memory while the mock is active. Every other device, and the port outside the mock, goes to the real driver.
+ * Linked with --wrap, see CMakeLists.txt.
+ */
+esp_err_t __real_spi_bus_add_device(
+	spi_host_device_t host,
+	const spi_device_interface_config_t *dev_config,
+	spi_device_handle_t *handle );
+esp_err_t __real_spi_bus_remove_device( spi_device_handle_t handle );
+esp_err_t __real_spi_device_acquire_bus( spi_device_handle_t device, TickType_t wait );
+void __real_spi_device_release_bus( spi_device_handle_t dev );
+esp_err_t __real_spi_device_transmit( spi_device_handle_t handle, spi_transaction_t *trans_desc );
+esp_err_t __real_spi_device_polling_transmit( spi_device_handle_t handle, spi_transaction_t *trans_desc );
+
+esp_err_t __wrap_spi_bus_add_device(
+	spi_host_device_t host,
+	const spi_device_interface_config_t *dev_config,
+	spi_device_handle_t *handle );
+esp_err_t __wrap_spi_bus_remove_device( spi_device_handle_t handle );
+esp_err_t __wrap_spi_device_acquire_bus( spi_device_handle_t device, TickType_t wait );
+void __wrap_spi_device_release_bus( spi_device_handle_t dev );
+esp_err_t __wrap_spi_device_transmit( spi_device_handle_t handle, spi_transaction_t *trans_desc );
+esp_err_t __wrap_spi_device_polling_transmit( spi_device_handle_t handle, spi_transaction_t *trans_desc );
+
+static uint8_t mem[ MEM_SIZE ];
+static volatile bool active;
+static int mock_device;  // Its address is the handle the port gets while the mock is active
+
+#define MOCK_HANDLE ( ( spi_device_handle_t )&mock_device )
+
+/** The chip's side of one 32-bit frame, decoded against the port's own frame layout */
+static void chip( spi_transaction_t *const trans )
+{
+	const uint8_t *const tx = trans->flags & SPI_TRANS_USE_TXDATA ? trans->tx_data : trans->tx_buffer;
+	const uint16_t addr = tx[ 1 ] << 8 | tx[ 2 ];
+	uint32_t frame;
+
+	memcpy( &frame, tx, sizeof( frame ) );
+	if ( frame == W_PCK( addr, tx[ 3 ] ) )
+		mem[ addr & ( MEM_SIZE - 1 ) ] = tx[ 3 ];
+	else if ( frame != R_PCK( addr ) )
+		return;
+	if ( trans->flags & SPI_TRANS_USE_RXDATA )
+		trans->rx_data[ 3 ] = mem[ addr & ( MEM_SIZE - 1 ) ];
+	else if ( trans->rx_buffer )
+		( ( uint8_t * )trans->rx_buffer )[ 3 ] = mem[ addr & ( MEM_SIZE - 1 ) ];
+}
+
+esp_err_t __wrap_spi_bus_add_device(
+	spi_host_device_t host,
+	const spi_device_interface_config_t *dev_config,
+	spi_device_handle_t *handle )
+{
+	if ( !active )
+		return __real_spi_bus_add_device( host, dev_config, handle );
+	*handle = MOCK_HANDLE;
+	return ESP_OK;
+}
+
+esp_err_t __wrap_spi_bus_remove_device( spi_device_handle_t handle )
+{
+	return handle == MOCK_HANDLE ? ESP_OK : __real_spi_bus_remove_device( handle );
+}
+
+esp_err_t __wrap_spi_device_acquire_bus( spi_device_handle_t device, TickType_t wait )
+{
+	return device == MOCK_HANDLE ? ESP_OK : __real_spi_device_acquire_bus( device, wait );
+}
+
+void __wrap_spi_device_release_bus( spi_device_handle_t dev )
+{
+	if ( dev != MOCK_HANDLE )
+		__real_spi_device_release_bus( dev );
+}
+
+esp_err_t __wrap_spi_device_transmit( spi_device_handle_t handle, spi_transaction_t *trans_desc )
+{
+	if ( handle != MOCK_HANDLE )
+		return __real_spi_device_transmit( handle, trans_desc );
+	chip( trans_desc );
+	return ESP_OK;
+}
+
+esp_err_t __wrap_spi_device_polling_transmit( spi_device_handle_t handle, spi_transaction_t *trans_desc )
+{
+	if ( handle != MOCK_HANDLE )
+		return __real_spi_device_polling_transmit( handle, trans_desc );
+	chip( trans_desc );
+	return ESP_OK;
+}
+
+static void begin( void )
+{
+	memset( mem, 0, sizeof( mem ) );
+	active = true;
+	w5100_spi_init();
+}
+
+static void end( void )
+{
+	w5100_spi_deinit();
+	active = false;
+}
+
+const struct spibench_backend spibench_mock = {
+	.name = "mock",
+	.begin = begin,
+	.end = end,
+	.read = w5100_read,
+	.write = w5100_write,
+	.reset_lock_stats = spibench_ll_reset_lock_stats,
+	.get_lock_stats = spibench_ll_get_lock_stats,
+};
+
+#endif
@@ -0,0 +1,58 @@
+
+#include "esp_timer.h"
+#include "eth-w5100-spi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "spibench.h"
+
+#define W5100_REG_MR  0x0000
+#define W5100_MR_RST  0x80
+#define DEFAULT_CLOCK 1200000
+
+static void begin( void )
+{
+	w5100_spi_init();
+	w5100_ll_hw_reset();
+	// Software reset as well, the chip may have been left mid-transfer by a previous run
+	w5100_write( W5100_REG_MR, &( const uint8_t ) { W5100_MR_RST }, 1 );
+	vTaskDelay( pdMS_TO_TICKS( 10 ) );
+}
+
+static void end( void )
+{
+	w5100_ll_set_clock( DEFAULT_CLOCK );
+	w5100_spi_deinit();
+}
+
+void spibench_ll_reset_lock_stats( void )
+{
+	w5100_ll_reset_lock_stats( xTaskGetCurrentTaskHandle() );
+}
+
+void spibench_ll_get_lock_stats( struct spibench_lock_stats *const out )
+{
+	struct w5100_ll_lock_stats s;
+
+	w5100_ll_get_lock_stats( &s );
+	*out = ( struct spibench_lock_stats ) {
+		.acquisitions = s.acquisitions,
+		.contended = s.contended,
+		.wait_us = s.wait_us,
+	};
+}
+
+int64_t spibench_now_us( void )
+{
+	return esp_timer_get_time();
+}
+
+const struct spibench_backend spibench_w5100 = {
+	.name = "w5100",
+	.begin = begin,
+	.end = end,
+	.read = w5100_read,
+	.write = w5100_write,
+	.set_clock = w5100_ll_set_clock,
+	.reset_lock_stats = spibench_ll_reset_lock_stats,
+	.get_lock_stats = spibench_ll_get_lock_stats,
+};
@@ -0,0 +1,171 @@
+
+#include "w5100_spibench.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "spibench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CONFIG_W5100_SPIBENCH
+
+#define TX_MEM_BASE 0x4000
+#define RX_MEM_BASE 0x6000
+#define S0_RX_RSR	0x0426
+#define XFER_MAX	8192
+#define VERIFY_SIZE 256
+
+static const char *TAG = "w5100_spibench";
+
+static volatile bool contender_run;
+static TaskHandle_t bench_task;
+
+/** Polls Sn_RX_RSR back to back, which is what the driver's RX task does while idle */
+static void contender_task( void *arg )
+{
+	const struct spibench_backend *const b = arg;
+	uint8_t rsr[ 2 ];
+
+	while ( contender_run )
+	{
+		b->read( S0_RX_RSR, rsr, sizeof( rsr ) );
+		taskYIELD();
+	}
+	xTaskNotifyGive( bench_task );
+	vTaskDelete( NULL );
+}
+
+static void contender_start( const struct spibench_backend *const b )
+{
+	contender_run = true;
+	bench_task = xTaskGetCurrentTaskHandle();
+	xTaskCreate( contender_task, "spibench_load", 2048, ( void * )b, CONFIG_W5100_SPIBENCH_CONTENDER_PRIORITY, NULL );
+}
+
+static void contender_stop( void )
+{
+	contender_run = false;
+	ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+}
+
+static void measure(
+	const struct spibench_backend *const b,
+	const int clock_hz,
+	const bool contention,
+	const bool write,
+	const uint32_t size,
+	uint8_t *const buf )
+{
+	const uint32_t iters = size < CONFIG_W5100_SPIBENCH_BYTES ? CONFIG_W5100_SPIBENCH_BYTES / size : 1;
+	struct spibench_lock_stats ls;
+
+	b->reset_lock_stats();
+	const int64_t start = spibench_now_us();
+	for ( uint32_t i = 0; i < iters; ++i )
+		if ( write )
+			b->write( TX_MEM_BASE, buf, size );
+		else
+			b->read( RX_MEM_BASE, buf, size );
+	const int64_t elapsed = spibench_now_us() - start;
+	b->get_lock_stats( &ls );
+
+	const uint64_t frames = ( uint64_t )iters * size;
+	// Machine readable, one line per measurement: grep SPI_BENCH and strip the prefix
+	printf(
+		"SPI_BENCH {\"backend\":\"%s\",\"clock_hz\":%d,\"contention\":%s,\"op\":\"%s\",\"size\":%" PRIu32
+		",\"iters\":%" PRIu32 ",\"bytes_per_s\":%" PRIu32 ",\"us_per_frame\":%.3f,\"lock_frac\":%.4f"
+		",\"lock_contended\":%" PRIu32 "}\n",
+		b->name,
+		clock_hz,
+		contention ? "true" : "false",
+		write ? "write" : "read",
+		size,
+		iters,
+		elapsed ? ( uint32_t )( frames * 1000000 / elapsed ) : 0,
+		( double )elapsed / frames,
+		elapsed ? ( double )ls.wait_us / elapsed : 0.0,
+		ls.contended );
+}
+
+/** Round trip through the TX buffer, so numbers from a link that garbles data are not taken at face value */
+static bool verify( const struct spibench_backend *const b, uint8_t *const buf )
+{
+	for ( int i = 0; i < VERIFY_SIZE; ++i )
+		buf[ i ] = i * 7 + 3;
+	b->write( TX_MEM_BASE, buf, VERIFY_SIZE );
+	memset( buf, 0, VERIFY_SIZE );
+	b->read( TX_MEM_BASE, buf, VERIFY_SIZE );
+	for ( int i = 0; i < VERIFY_SIZE; ++i )
+		if ( buf[ i ] != ( uint8_t )( i * 7 + 3 ) )
+			return false;
+	return true;
+}
+
+static void run_clock( const struct spibench_backend *const b, const int clock_hz, uint8_t *const buf )
+{
+	if ( b->set_clock && b->set_clock( clock_hz ) != ESP_OK )
+	{
+		ESP_LOGW( TAG, "%s: %d Hz not supported", b->name, clock_hz );
+		return;
+	}
+	if ( !verify( b, buf ) )
+	{
+		ESP_LOGE( TAG, "%s: readback mismatch at %d Hz, skipping", b->name, clock_hz );
+		return;
+	}
+
+	for ( int contention = 0; contention < 2; ++contention )
+	{
+		if ( contention )
+			contender_start( b );
+		for ( int write = 0; write < 2; ++write )
+			for ( uint32_t size = 1; size <= XFER_MAX; size <<= 1 )
+				measure( b, clock_hz, contention, write, size, buf );
+		if ( contention )
+			contender_stop();
+	}
+}
+
+static void run_backend( const struct spibench_backend *const b, uint8_t *const buf )
+{
+	ESP_LOGI( TAG, "backend %s", b->name );
+	b->begin();
+	if ( b->set_clock )
+	{
+		for ( const char *p = CONFIG_W5100_SPIBENCH_CLOCKS; *p; )
+		{
+			char *end;
+			const long hz = strtol( p, &end, 10 );
+			if ( end == p )
+				break;
+			run_clock( b, hz, buf );
+			p = *end == ',' ? end + 1 : end;
+		}
+	}
+	else
+		run_clock( b, 0, buf );
+	b->end();
+}
+
+void w5100_spibench_run( void )
+{
+	uint8_t *const buf = malloc( XFER_MAX );
+
+	if ( !buf )
+	{
+		ESP_LOGE( TAG, "out of memory" );
+		return;
+	}
+#ifdef CONFIG_W5100_SPIBENCH_MOCK
+	run_backend( &spibench_mock, buf );
+#endif
+	run_backend( &spibench_w5100, buf );
+	free( buf );
+	ESP_LOGI( TAG, "done" );
+}
+
+#endif
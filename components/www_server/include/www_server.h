@@ -0,0 +1,31 @@
+
+#pragma once
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#include <stdint.h>
+
+struct www_server_stats
+{
+	uint32_t requests;
+	uint32_t not_found;
+	uint32_t not_modified;	// Answered 304 from the client's If-None-Match
+	uint32_t gzip;			// Served the precompressed variant
+	uint64_t bytes;			// Body bytes, all straight from the mapped partition
+	uint32_t open;
+	uint32_t open_max;
+	uint32_t ram_per_connection;  // Largest heap drop per open connection seen, from the idle baseline
+};
+
+/**
+ * Maps the CONFIG_WWW_SERVER_PARTITION image built by tools/mkwww.py and serves it. Bodies are sent from the mapping
+ * as they are, nothing is copied or allocated per request.
+ */
+esp_err_t www_server_start( void );
+void www_server_stop( void );
+
+/** For registering dynamic handlers next to the static content, NULL when not running */
+httpd_handle_t www_server_handle( void );
+
+void www_server_get_stats( struct www_server_stats *const stats );
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Packs a directory into the image www_server serves from flash.
+
+Layout, little endian:
+  header   magic "WWW1", u32 entry count, u32 image size, u32 reserved
+  entries  128 bytes each, sorted by path:
+           char path[64], char type[40], u32 offset, u32 len, u32 gz_offset, u32 gz_len, u32 etag, u32 flags
+  data     file contents and their gzip variants, 4-byte aligned
+
+gz_len is 0 when compressing did not pay off. The ETag is FNV-1a over the uncompressed contents, the server adds "-gz"
+to it for the gzip variant. Given the partition size, an image that does not fit in it is an error.
+"""
+
+import gzip
+import mimetypes
+import os
+import struct
+import sys
+
+MAGIC = b'WWW1'
+HEADER = struct.Struct('<4sIII')
+ENTRY = struct.Struct('<64s40sIIIIII')
+PATH_MAX = 64
+TYPE_MAX = 40
+# Smaller than this, or saving less than this fraction, is not worth a Content-Encoding
+GZIP_MIN_SIZE = 256
+GZIP_MIN_SAVING = 0.1
+COMPRESSIBLE = ('text/', 'application/json', 'application/javascript', 'image/svg+xml')
+
+mimetypes.add_type('application/javascript', '.js')
+mimetypes.add_type('application/json', '.json')
+mimetypes.add_type('image/svg+xml', '.svg')
+
+
+def fnv1a(data):
+    h = 0x811C9DC5
+    for b in data:
+        h = ((h ^ b) * 0x01000193) & 0xFFFFFFFF
+    return h
+
+
+def align(n):
+    return (n + 3) & ~3
+
+
+def collect(root):
+    files = []
+    for dirpath, _, names in os.walk(root):
+        for name in names:
+            full = os.path.join(dirpath, name)
+            path = '/' + os.path.relpath(full, root).replace(os.sep, '/')
+            if len(path) >= PATH_MAX:
+                sys.exit('{}: path longer than {} bytes'.format(path, PATH_MAX - 1))
+            files.append((path, full))
+    return sorted(files)
+
+
+def main(root, out, limit=None):
+    files = collect(root)
+    data = bytearray()
+    data_base = HEADER.size + ENTRY.size * len(files)
+    entries = []
+
+    for path, full in files:
+        with open(full, 'rb') as f:
+            body = f.read()
+        mime = mimetypes.guess_type(path)[0] or 'application/octet-stream'
+        if mime.startswith('text/'):
+            mime += '; charset=utf-8'
+        mime = mime[:TYPE_MAX - 1]
+
+        offset = data_base + len(data)
+        data += body + bytes(align(len(body)) - len(body))
+        gz_offset = gz_len = 0
+        if len(body) >= GZIP_MIN_SIZE and mime.startswith(COMPRESSIBLE):
+            packed = gzip.compress(body, compresslevel=9, mtime=0)
+            if len(packed) <= len(body) * (1 - GZIP_MIN_SAVING):
+                gz_offset, gz_len = data_base + len(data), len(packed)
+                data += packed + bytes(align(len(packed)) - len(packed))
+        entries.append(ENTRY.pack(path.encode(), mime.encode(), offset, len(body), gz_offset, gz_len, fnv1a(body), 0))
+        print('{:<40} {:>8} {:>8}'.format(path, len(body), gz_len or '-'))
+
+    image = HEADER.pack(MAGIC, len(files), data_base + len(data), 0) + b''.join(entries) + data
+    if limit is not None and len(image) > limit:
+        sys.exit('{}: {} bytes do not fit in the {} byte partition'.format(out, len(image), limit))
+    with open(out, 'wb') as f:
+        f.write(image)
+    print('{}: {} files, {} bytes'.format(out, len(files), len(image)))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) not in (3, 4):
+        sys.exit('usage: mkwww.py <directory> <image> [<partition size>]')
+    main(sys.argv[1], sys.argv[2], int(sys.argv[3], 0) if len(sys.argv) == 4 else None)
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Loads www_server from the host and prints one JSON line, "WWW_BENCH {...}".
+
+Each connection is a keep-alive client fetching the same path back to back. Requests per second and latency come from
+this side, the heap cost of a connection from the device's stats URI, which tracks it as connections open.
+"""
+
+import argparse
+import http.client
+import json
+import threading
+import time
+
+
+def fetch_stats(host, port, uri):
+    conn = http.client.HTTPConnection(host, port, timeout=5)
+    try:
+        conn.request('GET', uri)
+        return json.loads(conn.getresponse().read())
+    finally:
+        conn.close()
+
+
+def worker(args, deadline, results, ready, lock):
+    headers = {'Accept-Encoding': 'gzip'} if args.gzip else {}
+    conn = http.client.HTTPConnection(args.host, args.port, timeout=10)
+    latencies = []
+    nbytes = errors = not_modified = 0
+    etag = None
+    ready.wait()
+
+    while time.monotonic() < deadline:
+        if args.etag and etag:
+            headers['If-None-Match'] = etag
+        start = time.monotonic()
+        try:
+            conn.request('GET', args.path, headers=headers)
+            resp = conn.getresponse()
+            body = resp.read()
+        except (OSError, http.client.HTTPException):
+            errors += 1
+            conn.close()
+            conn = http.client.HTTPConnection(args.host, args.port, timeout=10)
+            continue
+        latencies.append(time.monotonic() - start)
+        nbytes += len(body)
+        not_modified += resp.status == 304
+        etag = resp.getheader('ETag') or etag
+    conn.close()
+
+    with lock:
+        results['latencies'] += latencies
+        results['bytes'] += nbytes
+        results['errors'] += errors
+        results['not_modified'] += not_modified
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('host')
+    parser.add_argument('--port', type=int, default=80)
+    parser.add_argument('--path', default='/index.html')
+    parser.add_argument('--connections', type=int, default=3)
+    parser.add_argument('--duration', type=float, default=10)
+    parser.add_argument('--gzip', action='store_true', help='accept the precompressed variant')
+    parser.add_argument('--etag', action='store_true', help='revalidate with If-None-Match, expecting 304s')
+    parser.add_argument('--stats-uri', default='/_www/stats')
+    args = parser.parse_args()
+
+    before = fetch_stats(args.host, args.port, args.stats_uri)
+    results = {'latencies': [], 'bytes': 0, 'errors': 0, 'not_modified': 0}
+    lock = threading.Lock()
+    ready = threading.Event()
+    deadline = time.monotonic() + args.duration
+    threads = [threading.Thread(target=worker, args=(args, deadline, results, ready, lock))
+               for _ in range(args.connections)]
+    for t in threads:
+        t.start()
+    start = time.monotonic()
+    ready.set()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - start
+    after = fetch_stats(args.host, args.port, args.stats_uri)
+
+    lat = sorted(results['latencies'])
+    pct = lambda p: round(lat[min(len(lat) - 1, int(len(lat) * p / 100))] * 1000, 2) if lat else None
+    print('WWW_BENCH ' + json.dumps({
+        'path': args.path,
+        'connections': args.connections,
+        'gzip': args.gzip,
+        'etag': args.etag,
+        'requests': len(lat),
+        'errors': results['errors'],
+        'not_modified': results['not_modified'],
+        'requests_per_s': round(len(lat) / elapsed, 1),
+        'body_bytes_per_s': round(results['bytes'] / elapsed),
+        'p50_ms': pct(50),
+        'p99_ms': pct(99),
+        'open_max': after['open_max'],
+        'ram_per_connection': after['ram_per_connection'],
+        'free_heap': after['free_heap'],
+        'min_free_heap': after['min_free_heap'],
+        'device_requests': after['requests'] - before['requests'],
+    }))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,309 @@
+
+#include "www_server.h"
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#ifdef CONFIG_WWW_SERVER
+
+#define IMAGE_MAGIC	   0x31575757  // "WWW1"
+#define ENTRY_PATH_MAX 64
+#define ENTRY_TYPE_MAX 40
+#define HDR_MAX		   128
+#define INDEX		   "index.html"
+
+/* Image layout, see tools/mkwww.py */
+struct image_header
+{
+	uint32_t magic;
+	uint32_t count;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+struct image_entry
+{
+	char path[ ENTRY_PATH_MAX ];
+	char type[ ENTRY_TYPE_MAX ];
+	uint32_t offset;
+	uint32_t len;
+	uint32_t gz_offset;
+	uint32_t gz_len;
+	uint32_t etag;
+	uint32_t flags;
+};
+
+static const char *TAG = "www_server";
+
+static httpd_handle_t server;
+static esp_partition_mmap_handle_t map_handle;
+static const uint8_t *image;
+static const struct image_entry *entries;
+static uint32_t n_entries;
+
+static struct www_server_stats stats;
+static uint32_t idle_free_heap;
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static int entry_cmp( const void *key, const void *e )
+{
+	return strncmp( key, ( ( const struct image_entry * )e )->path, ENTRY_PATH_MAX );
+}
+
+static const struct image_entry *lookup( const char *const path )
+{
+	return bsearch( path, entries, n_entries, sizeof( *entries ), entry_cmp );
+}
+
+/** Comma separated header values are only ever checked for one token, so a substring match does */
+static bool header_has( httpd_req_t *const req, const char *const field, const char *const token )
+{
+	char value[ HDR_MAX ];
+
+	if ( httpd_req_get_hdr_value_str( req, field, value, sizeof( value ) ) != ESP_OK )
+		return false;
+	return strstr( value, token ) || !strcmp( value, "*" );
+}
+
+/**
+ * Static content is served for whatever no registered handler matched, so handlers added through www_server_handle()
+ * take precedence over files of the same name
+ */
+static esp_err_t static_get_handler( httpd_req_t *req, httpd_err_code_t error )
+{
+	char path[ ENTRY_PATH_MAX ];
+	char etag[ 14 ];
+	const size_t len = strcspn( req->uri, "?#" );
+
+	if ( req->method != HTTP_GET )
+		return httpd_resp_send_err( req, HTTPD_405_METHOD_NOT_ALLOWED, NULL );
+	if ( len + ( req->uri[ len - 1 ] == '/' ? sizeof( INDEX ) - 1 : 0 ) >= sizeof( path ) )
+		return httpd_resp_send_err( req, HTTPD_414_URI_TOO_LONG, NULL );
+	memcpy( path, req->uri, len );
+	path[ len ] = '\0';
+	if ( path[ len - 1 ] == '/' )
+		strcat( path, INDEX );
+
+	portENTER_CRITICAL( &stats_mux );
+	++stats.requests;
+	portEXIT_CRITICAL( &stats_mux );
+
+	const struct image_entry *const e = lookup( path );
+	if ( !e )
+	{
+		portENTER_CRITICAL( &stats_mux );
+		++stats.not_found;
+		portEXIT_CRITICAL( &stats_mux );
+		return httpd_resp_send_err( req, HTTPD_404_NOT_FOUND, NULL );
+	}
+
+	// The two variants are different bodies, so caches must not hand one out for the other
+	const bool gz = e->gz_len && header_has( req, "Accept-Encoding", "gzip" );
+	snprintf( etag, sizeof( etag ), "\"%08" PRIx32 "%s\"", e->etag, gz ? "-gz" : "" );
+	httpd_resp_set_hdr( req, "ETag", etag );
+	httpd_resp_set_hdr( req, "Cache-Control", "no-cache" );
+	if ( e->gz_len )
+		httpd_resp_set_hdr( req, "Vary", "Accept-Encoding" );
+
+	if ( header_has( req, "If-None-Match", etag ) )
+	{
+		portENTER_CRITICAL( &stats_mux );
+		++stats.not_modified;
+		portEXIT_CRITICAL( &stats_mux );
+		httpd_resp_set_status( req, "304 Not Modified" );
+		return httpd_resp_send( req, NULL, 0 );
+	}
+
+	const uint32_t size = gz ? e->gz_len : e->len;
+	if ( gz )
+		httpd_resp_set_hdr( req, "Content-Encoding", "gzip" );
+	httpd_resp_set_type( req, e->type );
+
+	portENTER_CRITICAL( &stats_mux );
+	stats.gzip += gz;
+	stats.bytes += size;
+	portEXIT_CRITICAL( &stats_mux );
+
+	// Goes to the socket in as many pieces as lwIP takes, each copied once from the flash cache into its pbufs
+	return httpd_resp_send( req, ( const char * )image + ( gz ? e->gz_offset : e->offset ), size );
+}
+
+static esp_err_t stats_get_handler( httpd_req_t *req )
+{
+	struct www_server_stats s;
+	char json[ 320 ];
+
+	www_server_get_stats( &s );
+	snprintf(
+		json,
+		sizeof( json ),
+		"{\"requests\":%" PRIu32 ",\"not_found\":%" PRIu32 ",\"not_modified\":%" PRIu32 ",\"gzip\":%" PRIu32
+		",\"bytes\":%" PRIu64 ",\"open\":%" PRIu32 ",\"open_max\":%" PRIu32 ",\"ram_per_connection\":%" PRIu32
+		",\"free_heap\":%" PRIu32 ",\"min_free_heap\":%" PRIu32 "}",
+		s.requests,
+		s.not_found,
+		s.not_modified,
+		s.gzip,
+		s.bytes,
+		s.open,
+		s.open_max,
+		s.ram_per_connection,
+		esp_get_free_heap_size(),
+		esp_get_minimum_free_heap_size() );
+	httpd_resp_set_type( req, "application/json" );
+	httpd_resp_set_hdr( req, "Cache-Control", "no-store" );
+	return httpd_resp_sendstr( req, json );
+}
+
+/* Sessions come and go in the server task, the heap is measured against what was free with none open */
+
+static esp_err_t on_open( httpd_handle_t hd, int sockfd )
+{
+	const uint32_t free_heap = esp_get_free_heap_size();
+
+	portENTER_CRITICAL( &stats_mux );
+	if ( ++stats.open > stats.open_max )
+		stats.open_max = stats.open;
+	if ( idle_free_heap > free_heap )
+	{
+		const uint32_t per = ( idle_free_heap - free_heap ) / stats.open;
+		if ( per > stats.ram_per_connection )
+			stats.ram_per_connection = per;
+	}
+	portEXIT_CRITICAL( &stats_mux );
+	return ESP_OK;
+}
+
+static void on_close( httpd_handle_t hd, int sockfd )
+{
+	close( sockfd );
+
+	const uint32_t free_heap = esp_get_free_heap_size();
+	portENTER_CRITICAL( &stats_mux );
+	if ( stats.open && !--stats.open )
+		idle_free_heap = free_heap;
+	portEXIT_CRITICAL( &stats_mux );
+}
+
+/** Whether the entry's strings are terminated and its bodies lie within the image */
+static bool entry_valid( const struct image_entry *const e, const uint32_t size )
+{
+	return memchr( e->path, '\0', sizeof( e->path ) ) && memchr( e->type, '\0', sizeof( e->type ) )
+		   && e->offset <= size && e->len <= size - e->offset && e->gz_offset <= size
+		   && e->gz_len <= size - e->gz_offset;
+}
+
+static esp_err_t map_image( void )
+{
+	const esp_partition_t *const part = esp_partition_find_first(
+		ESP_PARTITION_TYPE_DATA,
+		ESP_PARTITION_SUBTYPE_ANY,
+		CONFIG_WWW_SERVER_PARTITION );
+	const void *addr;
+	esp_err_t err;
+
+	if ( !part )
+	{
+		ESP_LOGE( TAG, "No partition \"%s\"", CONFIG_WWW_SERVER_PARTITION );
+		return ESP_ERR_NOT_FOUND;
+	}
+	if ( ( err = esp_partition_mmap( part, 0, part->size, ESP_PARTITION_MMAP_DATA, &addr, &map_handle ) ) != ESP_OK )
+		return err;
+
+	const struct image_header *const hdr = addr;
+	if ( hdr->magic != IMAGE_MAGIC || hdr->size > part->size
+		 || sizeof( *hdr ) + ( uint64_t )hdr->count * sizeof( struct image_entry ) > hdr->size )
+	{
+		ESP_LOGE( TAG, "No www image in \"%s\", flash one built by mkwww.py", CONFIG_WWW_SERVER_PARTITION );
+		esp_partition_munmap( map_handle );
+		return ESP_ERR_INVALID_VERSION;
+	}
+
+	// The handler sends straight from the mapping, an entry pointing past it would read whatever follows
+	const struct image_entry *const table = ( const struct image_entry * )( hdr + 1 );
+	for ( uint32_t i = 0; i < hdr->count; ++i )
+	{
+		if ( !entry_valid( &table[ i ], hdr->size ) )
+		{
+			ESP_LOGE( TAG, "Entry %" PRIu32 " of the www image is corrupt", i );
+			esp_partition_munmap( map_handle );
+			return ESP_ERR_INVALID_SIZE;
+		}
+	}
+
+	image = addr;
+	entries = table;
+	n_entries = hdr->count;
+	ESP_LOGI( TAG, "%" PRIu32 " files, %" PRIu32 " bytes mapped", n_entries, hdr->size );
+	return ESP_OK;
+}
+
+esp_err_t www_server_start( void )
+{
+	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+	esp_err_t err;
+
+	if ( server )
+		return ESP_ERR_INVALID_STATE;
+	if ( ( err = map_image() ) != ESP_OK )
+		return err;
+
+	config.server_port = CONFIG_WWW_SERVER_PORT;
+	config.max_open_sockets = CONFIG_WWW_SERVER_MAX_CONNECTIONS;
+	config.stack_size = CONFIG_WWW_SERVER_STACK_SIZE;
+	config.lru_purge_enable = true;
+	config.open_fn = on_open;
+	config.close_fn = on_close;
+
+	memset( &stats, 0, sizeof( stats ) );
+	if ( ( err = httpd_start( &server, &config ) ) != ESP_OK )
+	{
+		esp_partition_munmap( map_handle );
+		return err;
+	}
+	idle_free_heap = esp_get_free_heap_size();
+
+	httpd_register_uri_handler(
+		server,
+		&( const httpd_uri_t ) {
+			.uri = CONFIG_WWW_SERVER_STATS_URI, .method = HTTP_GET, .handler = stats_get_handler } );
+	httpd_register_err_handler( server, HTTPD_404_NOT_FOUND, static_get_handler );
+	ESP_LOGI( TAG, "Serving on port %d", CONFIG_WWW_SERVER_PORT );
+	return ESP_OK;
+}
+
+void www_server_stop( void )
+{
+	if ( !server )
+		return;
+	httpd_stop( server );
+	server = NULL;
+	esp_partition_munmap( map_handle );
+	image = NULL;
+	entries = NULL;
+	n_entries = 0;
+}
+
+httpd_handle_t www_server_handle( void )
+{
+	return server;
+}
+
+void www_server_get_stats( struct www_server_stats *const out )
+{
+	portENTER_CRITICAL( &stats_mux );
+	*out = stats;
+	portEXIT_CRITICAL( &stats_mux );
+}
+
+#endif
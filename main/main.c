@@ -9,7 +9,13 @@
 #include "eth-w5100-main.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "link_coordinator.h"
+#include "mem_budget.h"
+#include "metrics_export.h"
 #include "mqtt_example.h"
+#include "soak.h"
+#include "w5100_spibench.h"
+#include "www_server.h"
 
 #include <time.h>
 
@@ -23,26 +29,63 @@ void tasklol( void *p )
 			.miso_io_num = GPIO_NUM_19,
 			.mosi_io_num = GPIO_NUM_23,
 			.sclk_io_num = GPIO_NUM_18,
+#ifdef CONFIG_W5100_SPI_SHARED_BUS
+			.max_transfer_sz = CONFIG_W5100_SPI_SHARED_MAX_TRANSFER,
+#else
 			.max_transfer_sz = 4,
+#endif
 			.quadwp_io_num = -1,
 			.quadhd_io_num = -1 },
 		1 ) );
 
+#ifdef CONFIG_W5100_SPIBENCH
+	// Needs the link to itself, the driver is never started
+	w5100_spibench_run();
+	vTaskDelete( NULL );
+#endif
+
 	// Initialize TCP/IP network interface (should be called only once in application)
 	ESP_ERROR_CHECK( esp_netif_init() );
 	// Create default event loop that running in background
 	ESP_ERROR_CHECK( esp_event_loop_create_default() );
 
+#ifdef CONFIG_LINK_COORDINATOR
+	// Before the driver, to see the first address
+	ESP_ERROR_CHECK( link_coordinator_start() );
+#endif
 	w5100_start();
+	MEM_BUDGET_SNAPSHOT( "eth" );
+#ifdef CONFIG_METRICS_EXPORT
+	// Sends nothing until the collector resolves, which needs an address
+	metrics_export_start();
+#endif
 
 	ESP_ERROR_CHECK( setenv( "TZ", CONFIG_TZ_ENV, 1 ) );
 	tzset();
 	ESP_ERROR_CHECK(
 		esp_netif_sntp_init( &( const esp_sntp_config_t )ESP_NETIF_SNTP_DEFAULT_CONFIG( "pool.ntp.org" ) ) );
 	ESP_ERROR_CHECK( esp_netif_sntp_sync_wait( pdMS_TO_TICKS( 20000 ) ) );
+	MEM_BUDGET_SNAPSHOT( "sntp" );
+
+#ifdef CONFIG_WWW_SERVER
+	ESP_ERROR_CHECK( www_server_start() );
+	MEM_BUDGET_SNAPSHOT( "www" );
+#endif
 
+#ifdef CONFIG_SOAK_MODE
+	soak_run();
+#else
+	// Both run in this task, whose allocations are the app's otherwise
+	MEM_BUDGET_TAG( MEM_BUDGET_HTTP );
 	http_client_test();
+	MEM_BUDGET_SNAPSHOT( "http" );
+	MEM_BUDGET_TAG( MEM_BUDGET_MQTT );
 	mqtt_example();
+	MEM_BUDGET_SNAPSHOT( "mqtt" );
+#endif
+#ifdef CONFIG_MEM_BUDGET
+	mem_budget_dump();
+#endif
 #ifdef CONFIG_TEST_DEINIT
 	vTaskDelay( pdMS_TO_TICKS( 60000 ) );
 	deinit();
@@ -0,0 +1,362 @@
+
+#include "soak.h"
+
+#include "esp_heap_caps.h"
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "eth-w5100-spi.h"
+#include "eth-w5100-txsched.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "http_pool.h"
+#include "lwip/sockets.h"
+#include "lwip/stats.h"
+#include "mqtt_client.h"
+#include "sdkconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netdb.h>
+
+#ifdef CONFIG_SOAK_MODE
+
+#define STR_( x )	   #x
+#define STR( x )	   STR_( x )
+#define CREEP_SAMPLES  3
+#define LEAK_MIN_N	   10
+#define MQTT_TOPIC_FMT "/soak/%d"
+
+enum proto
+{
+	PROTO_HTTP,
+	PROTO_MQTT,
+	PROTO_MAX
+};
+
+/** What one protocol did during the current sample period */
+struct window
+{
+	uint32_t ok;
+	uint32_t errors;
+	uint64_t bytes;
+	uint64_t latency_total_us;
+	uint32_t latency_max_us;
+};
+
+struct trend
+{
+	uint32_t baseline_n;
+	uint64_t baseline_us;  // Sum of the per-sample averages that make up the baseline
+	uint32_t over;		   // Consecutive samples above the creep threshold
+};
+
+static const char *TAG = "soak";
+static const char *const proto_names[ PROTO_MAX ] = { "http", "mqtt" };
+
+static struct window windows[ PROTO_MAX ];
+static portMUX_TYPE window_mux = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool running;
+
+static void record( const enum proto p, const bool ok, const uint32_t bytes, const uint32_t latency_us )
+{
+	struct window *const w = &windows[ p ];
+
+	portENTER_CRITICAL( &window_mux );
+	if ( ok )
+	{
+		++w->ok;
+		w->bytes += bytes;
+		w->latency_total_us += latency_us;
+		if ( latency_us > w->latency_max_us )
+			w->latency_max_us = latency_us;
+	}
+	else
+		++w->errors;
+	portEXIT_CRITICAL( &window_mux );
+}
+
+static void http_task( void *arg )
+{
+	const esp_http_client_config_t config = {
+		.url = "http://" CONFIG_EXAMPLE_HTTP_ENDPOINT "/bytes/" STR( CONFIG_SOAK_HTTP_BODY_SIZE ),
+		.timeout_ms = 10000,
+	};
+
+	while ( running )
+	{
+		esp_http_client_handle_t client = http_pool_acquire( &config );
+		if ( client )
+		{
+			const int64_t start = esp_timer_get_time();
+			const esp_err_t err = http_pool_perform( client );
+			const bool ok = err == ESP_OK && esp_http_client_get_status_code( client ) == 200;
+			record(
+				PROTO_HTTP,
+				ok,
+				ok ? esp_http_client_get_content_length( client ) : 0,
+				esp_timer_get_time() - start );
+			http_pool_release( client, ok );
+		}
+		else
+			record( PROTO_HTTP, false, 0, 0 );
+		vTaskDelay( pdMS_TO_TICKS( CONFIG_SOAK_HTTP_PERIOD_MS ) );
+	}
+	vTaskDelete( NULL );
+}
+
+static void mqtt_event_handler( void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data )
+{
+	const esp_mqtt_event_handle_t event = event_data;
+	char topic[ 16 ];
+	int64_t sent_at;
+
+	switch ( ( esp_mqtt_event_id_t )event_id )
+	{
+		case MQTT_EVENT_CONNECTED:
+			snprintf( topic, sizeof( topic ), MQTT_TOPIC_FMT, ( int )( intptr_t )handler_args );
+			esp_mqtt_client_subscribe( event->client, topic, 1 );
+			break;
+		case MQTT_EVENT_DATA:
+			// Echo of our own publish, the send time is at the front
+			if ( !event->current_data_offset && event->data_len >= ( int )sizeof( sent_at ) )
+			{
+				memcpy( &sent_at, event->data, sizeof( sent_at ) );
+				record( PROTO_MQTT, true, event->total_data_len, esp_timer_get_time() - sent_at );
+			}
+			break;
+		case MQTT_EVENT_ERROR:
+			record( PROTO_MQTT, false, 0, 0 );
+			break;
+		default:
+			break;
+	}
+}
+
+static void mqtt_task( void *arg )
+{
+	const int idx = ( intptr_t )arg;
+	char client_id[ 24 ], topic[ 16 ];
+
+	snprintf( client_id, sizeof( client_id ), "w5100-soak-%d", idx );
+	snprintf( topic, sizeof( topic ), MQTT_TOPIC_FMT, idx );
+	const esp_mqtt_client_config_t cfg = {
+		.broker.address.uri = CONFIG_BROKER_URI,
+		.credentials.client_id = client_id,
+	};
+	uint8_t *const payload = calloc( 1, CONFIG_SOAK_MQTT_SIZE );
+	esp_mqtt_client_handle_t client = esp_mqtt_client_init( &cfg );
+
+	if ( !payload || !client )
+	{
+		ESP_LOGE( TAG, "mqtt %d: out of memory", idx );
+		free( payload );
+		vTaskDelete( NULL );
+		return;
+	}
+	esp_mqtt_client_register_event( client, ESP_EVENT_ANY_ID, mqtt_event_handler, arg );
+	esp_mqtt_client_start( client );
+
+	while ( running )
+	{
+		const int64_t now = esp_timer_get_time();
+		memcpy( payload, &now, sizeof( now ) );
+		if ( esp_mqtt_client_publish( client, topic, ( const char * )payload, CONFIG_SOAK_MQTT_SIZE, 1, 0 ) < 0 )
+			record( PROTO_MQTT, false, 0, 0 );
+		vTaskDelay( pdMS_TO_TICKS( CONFIG_SOAK_MQTT_PERIOD_MS ) );
+	}
+	esp_mqtt_client_stop( client );
+	esp_mqtt_client_destroy( client );
+	free( payload );
+	vTaskDelete( NULL );
+}
+
+/** Fire-and-forget datagrams standing in for whatever else shares the link in production */
+static void udp_task( void *arg )
+{
+	const struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+	static uint8_t datagram[ CONFIG_SOAK_UDP_SIZE ];
+	struct addrinfo *res = NULL;
+	int sock = -1;
+
+	if ( getaddrinfo( CONFIG_SOAK_UDP_HOST, STR( CONFIG_SOAK_UDP_PORT ), &hints, &res ) || !res
+		 || ( sock = socket( AF_INET, SOCK_DGRAM, 0 ) ) < 0 )
+	{
+		ESP_LOGE( TAG, "udp: cannot reach %s", CONFIG_SOAK_UDP_HOST );
+		goto out;
+	}
+
+	const int64_t period_us = 1000000 / CONFIG_SOAK_UDP_PPS;
+	int64_t next_at = esp_timer_get_time();
+	while ( running )
+	{
+		// Clock paced, rates above the tick rate go out in small bursts
+		if ( esp_timer_get_time() < next_at )
+		{
+			vTaskDelay( 1 );
+			continue;
+		}
+		next_at += period_us;
+		sendto( sock, datagram, sizeof( datagram ), 0, res->ai_addr, res->ai_addrlen );
+	}
+
+out:
+	if ( sock >= 0 )
+		close( sock );
+	if ( res )
+		freeaddrinfo( res );
+	vTaskDelete( NULL );
+}
+
+static uint32_t drops( void )
+{
+	uint32_t n = 0;
+#if CONFIG_LWIP_STATS
+	n += lwip_stats.link.drop + lwip_stats.link.memerr + lwip_stats.ip.drop;
+#endif
+#ifdef CONFIG_W5100_TX_SCHEDULER
+	struct w5100_txq_stats txq[ W5100_TXQ_MAX ];
+	w5100_txsched_get_stats( txq );
+	for ( int q = 0; q < W5100_TXQ_MAX; ++q )
+		n += txq[ q ].dropped;
+#endif
+	return n;
+}
+
+/** Average latency this sample against the baseline, true once it has stayed too high for a few samples */
+static bool creeping( struct trend *const t, const uint32_t avg_us, const uint32_t sample )
+{
+	// The first sample pays for connection setup and is left out
+	if ( !sample || !avg_us )
+		return false;
+	if ( t->baseline_n < CONFIG_SOAK_BASELINE_SAMPLES )
+	{
+		t->baseline_us += avg_us;
+		++t->baseline_n;
+		return false;
+	}
+	const uint64_t limit = t->baseline_us / t->baseline_n * CONFIG_SOAK_LATENCY_CREEP_PCT / 100;
+	t->over = avg_us > limit ? t->over + 1 : 0;
+	return t->over >= CREEP_SAMPLES;
+}
+
+/** Least squares slope of free heap against time, in bytes per hour */
+static int32_t heap_slope( const double t_h, const double heap, uint32_t *const n_out )
+{
+	static double n, st, sh, stt, sth;
+
+	++n;
+	st += t_h;
+	sh += heap;
+	stt += t_h * t_h;
+	sth += t_h * heap;
+	*n_out = n;
+	const double den = n * stt - st * st;
+	return den > 0 ? ( n * sth - st * sh ) / den : 0;
+}
+
+static void start_load( void )
+{
+	running = true;
+	ESP_ERROR_CHECK( http_pool_init() );
+	for ( int i = 0; i < CONFIG_SOAK_HTTP_TASKS; ++i )
+		xTaskCreate( http_task, "soak_http", 6144, NULL, 5, NULL );
+	for ( int i = 0; i < CONFIG_SOAK_MQTT_CLIENTS; ++i )
+		xTaskCreate( mqtt_task, "soak_mqtt", 4096, ( void * )( intptr_t )i, 5, NULL );
+	if ( *CONFIG_SOAK_UDP_HOST )
+		xTaskCreate( udp_task, "soak_udp", 3072, NULL, 4, NULL );
+}
+
+void soak_run( void )
+{
+	const int64_t start = esp_timer_get_time();
+	const int64_t end = CONFIG_SOAK_DURATION_MIN ? start + CONFIG_SOAK_DURATION_MIN * 60000000LL : INT64_MAX;
+	struct trend trends[ PROTO_MAX ] = { 0 };
+	const uint32_t drops_at_start = drops();
+	TickType_t wake = xTaskGetTickCount();
+
+	ESP_LOGI(
+		TAG,
+		"%d http, %d mqtt, udp %s for %d min",
+		CONFIG_SOAK_HTTP_TASKS,
+		CONFIG_SOAK_MQTT_CLIENTS,
+		*CONFIG_SOAK_UDP_HOST ? "on" : "off",
+		CONFIG_SOAK_DURATION_MIN );
+	w5100_ll_reset_lock_stats( NULL );
+	start_load();
+
+	for ( uint32_t sample = 0; esp_timer_get_time() < end; ++sample )
+	{
+		vTaskDelayUntil( &wake, pdMS_TO_TICKS( CONFIG_SOAK_SAMPLE_S * 1000 ) );
+
+		struct window w[ PROTO_MAX ];
+		portENTER_CRITICAL( &window_mux );
+		memcpy( w, windows, sizeof( w ) );
+		memset( windows, 0, sizeof( windows ) );
+		portEXIT_CRITICAL( &window_mux );
+
+		struct w5100_ll_lock_stats lock;
+		w5100_ll_get_lock_stats( &lock );
+		w5100_ll_reset_lock_stats( NULL );
+
+		const int64_t now = esp_timer_get_time();
+		const uint32_t heap = heap_caps_get_free_size( MALLOC_CAP_DEFAULT );
+		uint32_t n;
+		const int32_t slope = heap_slope( ( now - start ) / 3600e6, heap, &n );
+		const bool leak = n >= LEAK_MIN_N && slope < -CONFIG_SOAK_HEAP_LEAK_BYTES_PER_H;
+
+		char line[ 768 ];
+		int len = snprintf(
+			line,
+			sizeof( line ),
+			"{\"t_s\":%" PRIu32 ",\"heap\":%" PRIu32 ",\"heap_min\":%" PRIu32 ",\"heap_largest\":%" PRIu32
+			",\"heap_slope_per_h\":%" PRIi32 ",\"drops\":%" PRIu32 ",\"lock\":{\"acq\":%" PRIu32
+			",\"contended\":%" PRIu32 ",\"wait_us\":%" PRIu32 "}",
+			( uint32_t )( ( now - start ) / 1000000 ),
+			heap,
+			( uint32_t )heap_caps_get_minimum_free_size( MALLOC_CAP_DEFAULT ),
+			( uint32_t )heap_caps_get_largest_free_block( MALLOC_CAP_DEFAULT ),
+			slope,
+			drops() - drops_at_start,
+			lock.acquisitions,
+			lock.contended,
+			( uint32_t )lock.wait_us );
+
+		bool creep[ PROTO_MAX ] = { 0 };
+		for ( enum proto p = 0; p < PROTO_MAX && ( size_t )len < sizeof( line ); ++p )
+		{
+			const uint32_t avg = w[ p ].ok ? w[ p ].latency_total_us / w[ p ].ok : 0;
+			creep[ p ] = creeping( &trends[ p ], avg, sample );
+			len += snprintf(
+				line + len,
+				sizeof( line ) - len,
+				",\"%s\":{\"ok\":%" PRIu32 ",\"errors\":%" PRIu32 ",\"bytes_per_s\":%" PRIu32 ",\"avg_us\":%" PRIu32
+				",\"max_us\":%" PRIu32 "}",
+				proto_names[ p ],
+				w[ p ].ok,
+				w[ p ].errors,
+				( uint32_t )( w[ p ].bytes / CONFIG_SOAK_SAMPLE_S ),
+				avg,
+				w[ p ].latency_max_us );
+		}
+		char flags[ 64 ] = "";
+		if ( leak )
+			strcat( flags, ",\"heap_leak\"" );
+		if ( creep[ PROTO_HTTP ] )
+			strcat( flags, ",\"http_latency_creep\"" );
+		if ( creep[ PROTO_MQTT ] )
+			strcat( flags, ",\"mqtt_latency_creep\"" );
+		// Machine readable, one line per sample: grep SOAK and strip the prefix
+		printf( "SOAK %s,\"flags\":[%s]}\n", line, *flags ? flags + 1 : flags );
+		if ( leak || creep[ PROTO_HTTP ] || creep[ PROTO_MQTT ] )
+			ESP_LOGW( TAG, "degradation flagged at %" PRIu32 " s", ( uint32_t )( ( now - start ) / 1000000 ) );
+	}
+
+	// Load tasks notice on their next iteration and clean up after themselves
+	running = false;
+	ESP_LOGI( TAG, "done" );
+}
+
+#endif
@@ -0,0 +1,5 @@
+
+#pragma once
+
+/** Runs the soak test for CONFIG_SOAK_DURATION_MIN, blocking until done */
+void soak_run( void );